@@ -1579,6 +1579,65 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CHashTable ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// String keyed hash of pointers; a key may hold several values.
+        class LIB_DELPHI CHashTable: public CObject {
+        private:
+
+            struct CHashEntry {
+                CString Key;
+                Pointer Value;
+                unsigned Hash;
+                CHashEntry *Next;
+            };
+
+            CHashEntry **m_Buckets;
+
+            size_t m_Capacity;
+            size_t m_Count;
+
+            CHashEntry *Lookup(LPCTSTR Key, size_t Length, unsigned Hash) const;
+
+            void Resize(size_t Capacity);
+
+        public:
+
+            explicit CHashTable(size_t Capacity = 16);
+
+            CHashTable(const CHashTable &) = delete;
+            CHashTable &operator=(const CHashTable &) = delete;
+
+            ~CHashTable() override;
+
+            static unsigned HashOf(LPCTSTR Key, size_t Length);
+            static unsigned HashOf(const CString &Key) { return HashOf(Key.Data(), Key.Size()); }
+
+            void Add(const CString &Key, Pointer Value);
+
+            /// Removes the first value stored under the key.
+            bool Remove(const CString &Key);
+            bool Remove(const CString &Key, Pointer Value);
+
+            Pointer Find(LPCTSTR Key, size_t Length) const;
+            Pointer Find(const CString &Key) const { return Find(Key.Data(), Key.Size()); }
+
+            /// Adds every value stored under the key to the list, returns their number.
+            int FindAll(const CString &Key, CList &List) const;
+
+            void Clear();
+
+            size_t Count() const { return m_Count; }
+
+            size_t Capacity() const { return m_Capacity; }
+            void Capacity(size_t Value) { if (Value > m_Capacity) Resize(Value); }
+
+        }; // CHashTable
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CFile -----------------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
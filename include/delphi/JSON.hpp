@@ -38,6 +38,10 @@ namespace Delphi {
         class CJSONArray;
         class CJSONObject;
         class CJSONParser;
+        class CJSONWriter;
+        class CJSONReader;
+        class CJSONArena;
+        class CJSONPointer;
         //--------------------------------------------------------------------------------------------------------------
 
         typedef struct CJSONParserResult {
@@ -51,6 +55,79 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CJSONArena ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define JSON_ARENA_BLOCK_SIZE 65536
+
+        /// Monotonic allocator for tree nodes (values, members, objects, arrays). Nodes are carved out of large
+        /// blocks while the arena is current on the thread, deleting one only drops the live count and the blocks go
+        /// back in one sweep. Strings and list slots inside the nodes stay on the heap. Not thread-safe: one arena
+        /// per document per thread, and it must outlive every node taken from it.
+        class LIB_DELPHI CJSONArena : public CObject, public CHeapComponent {
+        private:
+
+            typedef struct CBlock {
+                CBlock *Next;
+                size_t Size;
+            } CBlock;
+
+            CBlock *m_pBlocks;
+            CBlock *m_pSpare;
+
+            char *m_pPos;
+            char *m_pEnd;
+
+            size_t m_BlockSize;
+            size_t m_Allocated;
+            size_t m_Live;
+
+            void FreeBlocks(CBlock *&Blocks);
+
+        public:
+
+            explicit CJSONArena(size_t BlockSize = JSON_ARENA_BLOCK_SIZE);
+
+            ~CJSONArena() override;
+
+            Pointer Alloc(size_t Size);
+
+            /// Rewinds for the next document: standard blocks are kept for reuse, oversized ones freed. Throws while any
+            /// node is still alive.
+            void Reset();
+
+            size_t BlockSize() const { return m_BlockSize; }
+            size_t Allocated() const { return m_Allocated; }
+            size_t Live() const { return m_Live; }
+
+            /// The arena nodes are allocated from on this thread, nullptr for the heap.
+            static CJSONArena *Current();
+
+            /// Node allocation: from the current arena if any, else the heap. Each node remembers where it came from.
+            static Pointer New(size_t Size);
+            static void Delete(Pointer P);
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Makes an arena current on the thread for its lifetime; nullptr leaves the current one in place.
+        class LIB_DELPHI CJSONArenaGuard {
+        private:
+
+            CJSONArena *m_pPrior;
+
+        public:
+
+            explicit CJSONArenaGuard(CJSONArena *Arena);
+
+            ~CJSONArenaGuard();
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CJSON -----------------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -70,6 +147,8 @@ namespace Delphi {
 
             CJSON *m_Value;
 
+            CJSONArena *m_pArena;
+
             int m_UpdateCount;
 
         protected:
@@ -101,6 +180,17 @@ namespace Delphi {
 
             ~CJSON() override;
 
+            static void *operator new(size_t Size) { return CJSONArena::New(Size); }
+            static void operator delete(void *P) { CJSONArena::Delete(P); }
+
+            /// Parsing, Assign() and Concat() build the tree in this arena.
+            CJSONArena *Arena() const { return m_pArena; }
+            void Arena(CJSONArena *Value) { m_pArena = Value; }
+
+            /// Node addressed by the pointer, nullptr if there is none.
+            const CJSON *Find(const CJSONPointer &Pointer) const;
+            CJSON *Find(const CJSONPointer &Pointer);
+
             CJSONArray *GetArray();
             CJSONObject *GetObject();
 
@@ -170,6 +260,11 @@ namespace Delphi {
             CString ToString() const { return JsonToString(); };
             void ToJson(const CString &Value) { StringToJson(Value); };
 
+            /// Exact size of the text JsonWrite() produces; Spaced selects the ", " / ": " layout of ToString().
+            virtual size_t JsonLength(bool Spaced) const;
+            /// Writes the text into Buffer (at least JsonLength() bytes), returns the end of it.
+            virtual LPTSTR JsonWrite(LPTSTR Buffer, bool Spaced) const;
+
             CJSON &operator=(const CJSON &Json) {
                 if (this != &Json)
                     Assign(Json);
@@ -302,8 +397,6 @@ namespace Delphi {
 
         protected:
 
-            CString JsonToString() const override;
-
             static void Error(const CString &Msg, int Data);
 
             virtual int GetCapacity() const noexcept;
@@ -316,6 +409,9 @@ namespace Delphi {
 
             ~CJSONElements() override = default;
 
+            size_t JsonLength(bool Spaced) const override;
+            LPTSTR JsonWrite(LPTSTR Buffer, bool Spaced) const override;
+
             virtual int Add(const CJSONValue &Value);
 
             virtual int Add(const CString &Value);
@@ -482,8 +578,6 @@ namespace Delphi {
 
         protected:
 
-            CString JsonToString() const override;
-
             static void Error(const CString &Msg, int Data);
 
             virtual CJSONMember &Get(int Index) abstract;
@@ -506,6 +600,9 @@ namespace Delphi {
 
             ~CJSONMembers() override = default;
 
+            size_t JsonLength(bool Spaced) const override;
+            LPTSTR JsonWrite(LPTSTR Buffer, bool Spaced) const override;
+
             virtual int Add(const CJSONMember &Value);
 
             virtual int AddPair(const CString &String, const CJSONMembers &Value);
@@ -780,11 +877,24 @@ namespace Delphi {
 
         private:
 
-            CString m_Data;
+            enum CJSONTyped {
+                jtInteger = 0x01, jtDouble = 0x02, jtBoolean = 0x04, jtDecoded = 0x08, jtPending = 0x10
+            };
 
-        protected:
+            /// Text as it appears in JSON, strings stay escaped. Pending while a number set natively is not formatted.
+            mutable CString m_Data;
 
-            CString JsonToString() const override;
+            /// Native forms of m_Data (CJSONTyped flags), dropped whenever the text can change.
+            mutable unsigned char m_Typed;
+
+            mutable bool m_Boolean;
+            mutable int64_t m_Integer;
+            mutable double m_Double;
+            mutable CString m_Decoded;
+
+            const CString &Text() const;
+
+        protected:
 
             CJSONValue &GetValue(const CString &String);
 
@@ -806,11 +916,13 @@ namespace Delphi {
 
         public:
 
-            CJSONValue() : CJSON(this, jvtNull) {
+            CJSONValue() : CJSON(this, jvtNull), m_Typed(0),
+                    m_Boolean(false), m_Integer(0), m_Double(0) {
                 m_Value = nullptr;
             };
 
-            explicit CJSONValue(CJSONValueType AType) : CJSON(this, AType) {
+            explicit CJSONValue(CJSONValueType AType) : CJSON(this, AType), m_Typed(0),
+                    m_Boolean(false), m_Integer(0), m_Double(0) {
                 if (AType == jvtObject)
                     GetObject();
 
@@ -818,50 +930,66 @@ namespace Delphi {
                     GetArray();
             };
 
-            explicit CJSONValue(const CJSONMembers& Value) : CJSON(this, jvtObject) {
+            explicit CJSONValue(const CJSONMembers& Value) : CJSON(this, jvtObject), m_Typed(0),
+                    m_Boolean(false), m_Integer(0), m_Double(0) {
                 CJSON::Assign(Value);
             };
 
-            explicit CJSONValue(const CJSONElements& Value) : CJSON(this, jvtArray) {
+            explicit CJSONValue(const CJSONElements& Value) : CJSON(this, jvtArray), m_Typed(0),
+                    m_Boolean(false), m_Integer(0), m_Double(0) {
                 CJSON::Assign(Value);
             };
 
-            explicit CJSONValue(const CString& Value) : CJSON(this, jvtString) {
+            explicit CJSONValue(const CString& Value) : CJSON(this, jvtString), m_Typed(0),
+                    m_Boolean(false), m_Integer(0), m_Double(0) {
                 m_Value = this;
                 m_Data = Value;
             };
 
-            explicit CJSONValue(reference Value) : CJSON(this, jvtString) {
+            explicit CJSONValue(reference Value) : CJSON(this, jvtString), m_Typed(0),
+                    m_Boolean(false), m_Integer(0), m_Double(0) {
                 m_Value = this;
                 m_Data = Value;
             };
 
             ~CJSONValue() override = default;
 
+            size_t JsonLength(bool Spaced) const override;
+            LPTSTR JsonWrite(LPTSTR Buffer, bool Spaced) const override;
+
             void Assign(const CJSONValue &Value);
             void Assign(const CJSONMembers &Value);
             void Assign(const CJSONElements &Value);
 
-            bool IsEmpty() const { return m_Data.IsEmpty(); }
+            bool IsEmpty() const { return (m_Typed & jtPending) == 0 && m_Data.IsEmpty(); }
 
             bool HasOwnProperty(const CString &String) const override;
 
             void StringData(const CString &Value);
             void StringData(reference AValue);
 
-            CString &Data() { return m_Data; }
-            const CString &Data() const { return m_Data; }
+            /// Writable text, the native forms are dropped.
+            CString &Data() { Text(); m_Typed = 0; return m_Data; }
+            const CString &Data() const { return Text(); }
+
+            /// Fills the native forms from the text; the parser calls it for numbers and booleans.
+            void Resolve() const;
 
             CString AsString() const;
 
-            int AsInteger() const { return StrToInt(m_Data.c_str()); }
-            long AsLong() const { return StrToInt(m_Data.c_str()); }
-            float AsFloat() const { return StrToFloat(m_Data.c_str()); }
-            double AsDouble() const { return StrToDouble(m_Data.c_str()); }
-            long double AsDecimal() const { return StrToDecimal(m_Data.c_str()); }
+            int AsInteger() const { return (int) AsInt64(); }
+            long AsLong() const { return (long) AsInt64(); }
+            int64_t AsInt64() const { return (m_Typed & jtInteger) ? m_Integer : StrToInt(Text().c_str()); }
+            float AsFloat() const { return StrToFloat(Text().c_str()); }
+            double AsDouble() const { return (m_Typed & jtDouble) ? m_Double : StrToDouble(Text().c_str()); }
+            long double AsDecimal() const { return StrToDecimal(Text().c_str()); }
 
             bool AsBoolean() const;
 
+            /// Stores a number natively, the text is formatted on output.
+            void AsInteger(int64_t Value);
+            void AsDouble(double Value);
+
             int Compare(const CJSONValue& Value) const;
 
             CJSONArray &AsArray() { return *(CJSONArray *) m_Value; }
@@ -905,6 +1033,7 @@ namespace Delphi {
                 m_ValueType = jvtString;
                 m_Value = this;
                 m_Data = Value;
+                m_Typed = 0;
                 return *this;
             }
 
@@ -912,13 +1041,14 @@ namespace Delphi {
                 m_ValueType = jvtString;
                 m_Value = this;
                 m_Data = Value;
+                m_Typed = 0;
                 return *this;
             }
 
             CJSONValue &operator=(int Value) {
                 m_ValueType = jvtNumber;
                 m_Value = this;
-                m_Data = Value;
+                AsInteger(Value);
                 return *this;
             }
 
@@ -926,13 +1056,14 @@ namespace Delphi {
                 m_ValueType = jvtNumber;
                 m_Value = this;
                 m_Data = Value;
+                m_Typed = 0;
                 return *this;
             }
 
             CJSONValue &operator=(double Value) {
                 m_ValueType = jvtNumber;
                 m_Value = this;
-                m_Data = Value;
+                AsDouble(Value);
                 return *this;
             }
 
@@ -940,16 +1071,18 @@ namespace Delphi {
                 m_ValueType = jvtBoolean;
                 m_Value = this;
                 m_Data = Value;
+                m_Boolean = Value;
+                m_Typed = jtBoolean;
                 return *this;
             }
 
             CJSONValue &operator<<(const CString &Value) override {
-                m_Data << Value;
+                Data() << Value;
                 return *this;
             }
 
             CJSONValue &operator<<(reference Value) override {
-                m_Data << Value;
+                Data() << Value;
                 return *this;
             }
 
@@ -993,6 +1126,9 @@ namespace Delphi {
 
             };
 
+            static void *operator new(size_t Size) { return CJSONArena::New(Size); }
+            static void operator delete(void *P) { CJSONArena::Delete(P); }
+
             CJSONMember(const CJSONMember &AValue) : CPersistent(this) {
                 Assign(AValue);
             }
@@ -1072,13 +1208,13 @@ namespace Delphi {
             explicit CJSONMember(const CString &String, int AValue) : CPersistent(this) {
                 m_String = String;
                 m_Value.ValueType(jvtNumber);
-                m_Value.Data() = AValue;
+                m_Value.AsInteger(AValue);
             }
 
             explicit CJSONMember(LPCTSTR AString, int AValue) : CPersistent(this) {
                 m_String = AString;
                 m_Value.ValueType(jvtNumber);
-                m_Value.Data() = AValue;
+                m_Value.AsInteger(AValue);
             }
 
             explicit CJSONMember(const CString &String, float AValue) : CPersistent(this) {
@@ -1096,13 +1232,13 @@ namespace Delphi {
             explicit CJSONMember(const CString &String, double AValue) : CPersistent(this) {
                 m_String = String;
                 m_Value.ValueType(jvtNumber);
-                m_Value.Data() = AValue;
+                m_Value.AsDouble(AValue);
             }
 
             explicit CJSONMember(LPCTSTR AString, double AValue) : CPersistent(this) {
                 m_String = AString;
                 m_Value.ValueType(jvtNumber);
-                m_Value.Data() = AValue;
+                m_Value.AsDouble(AValue);
             }
 
             CString &String() { return m_String; };
@@ -1315,6 +1451,9 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        /// Objects with fewer members are searched linearly.
+        #define JSON_OBJECT_INDEX_THRESHOLD 16
+
         class LIB_DELPHI CJSONObject : public CJSONMembers {
             typedef CJSONMembers inherited;
             typedef LPCTSTR reference;
@@ -1325,6 +1464,16 @@ namespace Delphi {
 
             CJSONValue m_NullValue;
 
+            /// Name -> position + 1, built on the first lookup past the threshold. Appended members are indexed on
+            /// the next lookup, anything that shifts positions drops the index.
+            mutable CHashTable *m_pIndex;
+
+            void DropIndex() const;
+
+            int FindString(LPCTSTR String, size_t Length) const;
+
+            void ReplacePair(int Index, LPCTSTR String, size_t Length, const CJSONValue &Value);
+
             const CString &GetString(int Index) const override;
 
             CJSONValue &GetValue(const CString &String) override;
@@ -1343,6 +1492,10 @@ namespace Delphi {
 
             void Put(int Index, const CJSONMember &Value) override;
 
+            void PutPair(int Index, const CString &String, const CJSONValue &Value) override;
+
+            void PutPair(int Index, reference String, const CJSONValue &Value) override;
+
             int GetCapacity() const noexcept override;
 
             void SetCapacity(int NewCapacity) override;
@@ -1401,6 +1554,7 @@ namespace Delphi {
 
             void Clear() override;
 
+            /// Call after renaming a member in place through String().
             virtual void Update(int Index);
 
             void Delete(int Index) override;
@@ -1445,6 +1599,9 @@ namespace Delphi {
 
             void Insert(int Index, const CJSONMember &Value) override;
 
+            int IndexOfString(const CString &String) const override;
+            int IndexOfString(reference String) const override;
+
             bool HasOwnProperty(const CString &String) const override;
 
             CJSONMember &Members(int Index) override { return Get(Index); };
@@ -1607,9 +1764,252 @@ namespace Delphi {
 
             CParserState State() const { return m_State; };
 
+            /// Whitespace or structural character: ends a number or literal.
+            static bool IsDelimiter(u_char c) {
+                return IsWS(c) || c == ',' || c == ':' || c == '{' || c == '}' || c == '[' || c == ']' || c == '"';
+            }
+
             int Result() const { return m_Result; };
 
         };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONWriter -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define JSON_WRITER_MAX_DEPTH 64
+
+        /// Streams JSON text into a memory stream at its current position without building a CJSON tree.
+        class CJSONWriter {
+        private:
+
+            CMemoryStream &m_Stream;
+
+            /// One bit per nesting level: set once the level holds a value (next one needs a comma).
+            uint64_t m_Filled;
+
+            int m_Depth;
+
+            bool m_AfterKey;
+
+            void Put(LPCTSTR Data, size_t Size) { m_Stream.Write(Data, Size); }
+            void Put(TCHAR C) { m_Stream.Write(&C, 1); }
+
+            void Separator();
+
+            void Open(TCHAR C);
+            void Close(TCHAR C);
+
+            void Quoted(LPCTSTR Value, size_t Size);
+
+        public:
+
+            explicit CJSONWriter(CMemoryStream &Stream);
+
+            CMemoryStream &Stream() { return m_Stream; }
+
+            int Depth() const { return m_Depth; }
+
+            CJSONWriter &BeginObject();
+            CJSONWriter &EndObject();
+
+            CJSONWriter &BeginArray();
+            CJSONWriter &EndArray();
+
+            CJSONWriter &Key(LPCTSTR Name, size_t Size);
+            CJSONWriter &Key(const CString &Name) { return Key(Name.Data(), Name.Size()); }
+
+            /// Escapes the value in a single pass, unescaped runs are copied as a whole.
+            CJSONWriter &String(LPCTSTR Value, size_t Size);
+            CJSONWriter &String(const CString &Value) { return String(Value.Data(), Value.Size()); }
+
+            CJSONWriter &Integer(long Value);
+            /// Shortest text that reads back as the same double, null for NaN and infinities.
+            CJSONWriter &Number(double Value);
+            CJSONWriter &Boolean(bool Value);
+            CJSONWriter &Null();
+
+            /// Splices already serialized JSON verbatim.
+            CJSONWriter &Raw(LPCTSTR Value, size_t Size);
+            CJSONWriter &Raw(const CString &Value) { return Raw(Value.Data(), Value.Size()); }
+
+            /// Serializes the tree compactly straight into the stream, grown once to the exact size.
+            CJSONWriter &Value(const CJSON &Json);
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONReader -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define JSON_READER_MAX_DEPTH 512
+
+        enum CJSONEvent {
+            jeNone = 0, jeStartObject, jeEndObject, jeStartArray, jeEndArray, jeKey, jeString, jeNumber, jeBoolean,
+            jeNull, jeNeedMore, jeEnd
+        };
+
+        /// Pull parser: reports tokens one by one over input fed in chunks, nothing is built behind the caller.
+        class CJSONReader {
+        private:
+
+            enum CReaderState {
+                rsValue, rsFirstValue, rsFirstKey, rsKey, rsColon, rsComma, rsDone
+            } m_State;
+
+            LPTSTR m_pBuffer;
+            size_t m_Size;
+            size_t m_Capacity;
+            size_t m_Pos;
+
+            /// Bytes dropped from the front of the buffer so far (for error positions).
+            size_t m_Offset;
+
+            /// Validated part of an unfinished string token, scanning resumes from here.
+            size_t m_Scan;
+            bool m_Escaped;
+
+            bool m_Finished;
+
+            unsigned char m_Stack[JSON_READER_MAX_DEPTH];
+            int m_Depth;
+
+            /// Skip() in progress: depth to come back to, and whether the closing event is reported.
+            int m_SkipDepth;
+            bool m_SkipReport;
+
+            CJSONEvent m_Event;
+
+            CString m_Value;
+
+            [[noreturn]] void SyntaxError(size_t Pos) const;
+
+            CJSONEvent Read();
+
+            CJSONEvent Push(unsigned char C);
+            CJSONEvent Pop(unsigned char C);
+
+            void AfterValue();
+
+            int ScanString(size_t &Pos);
+            int ScanNumber(size_t &Pos);
+            int ScanLiteral(size_t &Pos, LPCTSTR Literal, size_t Length);
+
+            void DecodeString(LPCTSTR Begin, LPCTSTR End);
+
+        public:
+
+            CJSONReader();
+
+            ~CJSONReader();
+
+            void Clear();
+
+            /// Appends the next chunk of input; the data is copied.
+            void Feed(LPCTSTR Data, size_t Size);
+            void Feed(const CString &Data) { Feed(Data.Data(), Data.Size()); }
+
+            /// No more input will follow.
+            void Finish() { m_Finished = true; }
+
+            /// Returns the next event, jeNeedMore when the chunk ends inside a token, jeEnd after the document.
+            CJSONEvent Next();
+
+            /// Skips the container just opened (Next() then reports its end) or the value of the key just read.
+            void Skip();
+
+            CJSONEvent Event() const { return m_Event; }
+
+            int Depth() const { return m_Depth; }
+
+            /// Absolute input offset of the parser.
+            size_t Position() const { return m_Offset + m_Pos; }
+
+            /// Decoded key or string, or the text of a number or literal.
+            const CString &Value() const { return m_Value; }
+
+            long AsInteger() const;
+            double AsDouble() const;
+            bool AsBoolean() const { return m_Event == jeBoolean && m_Value.Size() == 4; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONPointer ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct CJSONPointerToken {
+            /// Decoded member name, as both the tree and the reader hold keys.
+            CString Name;
+            /// Array index, -1 if the token is not one.
+            int Index;
+        } CJSONPointerToken;
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Compiled path into a document, reusable across documents. Takes a JSON Pointer (RFC 6901: "/a/0/b",
+        /// "~0" and "~1" for '~' and '/', optionally as a "#" URI fragment) or a dotted path ("a[0].b", names
+        /// without '.' or '['). Resolves level by level over the tree, objects through their name index, or over
+        /// a reader, skipping unrelated subtrees without building them.
+        class LIB_DELPHI CJSONPointer : public CObject {
+        private:
+
+            CString m_Text;
+
+            TList<CJSONPointerToken> m_Tokens;
+
+            void Add(const CString &Name);
+
+            void ParsePointer(LPCTSTR Begin, LPCTSTR End, const TList<int> *Offsets = nullptr);
+            void ParseFragment(LPCTSTR Begin, LPCTSTR End);
+            void ParsePath(LPCTSTR Begin, LPCTSTR End);
+
+        public:
+
+            CJSONPointer() = default;
+
+            CJSONPointer(const CString &Text);
+
+            CJSONPointer(LPCTSTR Text);
+
+            CJSONPointer(const CJSONPointer &Pointer): CJSONPointer() {
+                Compile(Pointer.Text());
+            }
+
+            ~CJSONPointer() override = default;
+
+            void Compile(const CString &Text);
+
+            const CString &Text() const { return m_Text; }
+
+            int Count() const { return m_Tokens.Count(); }
+
+            const CString &Tokens(int Index) const { return m_Tokens.Items(Index).Name; }
+
+            const CJSON *Find(const CJSON &Json) const;
+            CJSON *Find(CJSON &Json) const { return const_cast<CJSON *> (Find((const CJSON &) Json)); }
+
+            /// The addressed value; nullptr if there is none or the pointer is empty and Json is not a value.
+            const CJSONValue *Value(const CJSON &Json) const;
+
+            bool Exists(const CJSON &Json) const { return Find(Json) != nullptr; }
+
+            /// Reads from the document start up to the addressed value and stops on its first event (a start event
+            /// for containers, which the caller may read on or Skip()). The input must be complete.
+            bool Find(CJSONReader &Reader) const;
+
+            CJSONPointer &operator=(const CJSONPointer &Pointer) {
+                if (this != &Pointer)
+                    Compile(Pointer.Text());
+                return *this;
+            }
+
+        };
     }
 }
 
@@ -29,11 +29,20 @@ Author:
 //----------------------------------------------------------------------------------------------------------------------
 
 #define BOOLOID 16
+#define BYTEAOID 17
+#define CHAROID 18
 #define INT8OID 20
 #define INT2OID 21
 #define INT4OID 23
+#define OIDOID 26
 #define JSONOID 114
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define DATEOID 1082
+#define TIMESTAMPOID 1114
+#define TIMESTAMPTZOID 1184
 #define NUMERICOID 1700
+#define UUIDOID 2950
 #define JSONBOID 3802
 #define JSONPATHOID 4072
 //----------------------------------------------------------------------------------------------------------------------
@@ -69,6 +78,12 @@ namespace Delphi {
 
             mutable CStringList m_Parameters;
 
+            mutable CStringList m_KeywordList;
+            mutable CStringList m_ValueList;
+
+            mutable LPCSTR *m_pKeywords;
+            mutable LPCSTR *m_pValues;
+
             CString m_ApplicationName;
 
             bool m_ExpandDBName;
@@ -77,6 +92,9 @@ namespace Delphi {
 
             void UpdateConnInfo() const;
 
+            void UpdateParams() const;
+            void ClearParams() const;
+
             void AssignParameters(const CStringList& Strings);
 
         protected:
@@ -98,8 +116,22 @@ namespace Delphi {
             explicit CPQConnInfo(LPCSTR AHost, LPCSTR APort, LPCSTR ADataBase, LPCSTR AUserName, LPCSTR APassword,
                 LPCSTR AOptions);
 
+            CPQConnInfo(const CPQConnInfo &Source): CPQConnInfo() {
+                Assign(Source);
+            }
+
+            ~CPQConnInfo() override;
+
             const CString& ConnInfo() const { return GetConnInfo(); };
 
+            /// Null terminated keyword and value arrays for PQconnectStartParams: built on first use and kept
+            /// until the parameters change
+            LPCSTR const *Keywords() const;
+            LPCSTR const *Values() const;
+
+            /// expand_dbname for Keywords and Values: a ConnInfo given as a string is passed as dbname
+            bool ExpandValues() const { return m_ExpandDBName || m_Parameters.Count() == 0; }
+
             PGPing Ping() { return GetPing(); };
 
             bool PingValid() const { return m_PingValid; };
@@ -343,42 +375,230 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CPQStatementCache -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define PQ_STATEMENT_CACHE_SIZE 64
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct CPQStatement {
+            CString Key;
+            CString Name;
+            CPQStatement *Prev;
+            CPQStatement *Next;
+        } CPQStatement;
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Prepared statements of one connection, the least recently used one is evicted first.
+        class CPQStatementCache: public CObject {
+        private:
+
+            CHashTable m_Index;
+
+            CPQStatement *m_pFirst;
+            CPQStatement *m_pLast;
+
+            size_t m_Capacity;
+
+            uint32_t m_Sequence;
+
+            void Link(CPQStatement *AStatement);
+            void Unlink(CPQStatement *AStatement);
+
+        public:
+
+            explicit CPQStatementCache(size_t ACapacity = PQ_STATEMENT_CACHE_SIZE);
+
+            ~CPQStatementCache() override;
+
+            CPQStatement *Find(const CString &Key);
+
+            /// Adds a statement under a new name; Evicted gets the name of the statement to deallocate, if any.
+            CPQStatement *Add(const CString &Key, CString &Evicted);
+
+            void Remove(const CString &Key);
+
+            void Clear();
+
+            size_t Count() const { return m_Index.Count(); }
+
+            size_t Capacity() const { return m_Capacity; }
+            void Capacity(size_t Value) { m_Capacity = Value == 0 ? 1 : Value; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CPQPollConnection -----------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
 
         class CPQQuery;
+        class CPQIdleList;
         //--------------------------------------------------------------------------------------------------------------
 
         enum CPollConnectionStatus { qsConnect, qsReset, qsReady, qsWait, qsError };
         //--------------------------------------------------------------------------------------------------------------
 
+        enum CPQServerRole { srUnknown, srPrimary, srStandby };
+        //--------------------------------------------------------------------------------------------------------------
+
         class CPQPollConnection: public CPQConnection {
+            friend CPQIdleList;
+
         private:
 
             CPQQuery *m_WorkQuery;
 
+            CPQIdleList *m_pIdleList;
+
+            bool m_Idle;
+
+            int m_Endpoint;
+
+            bool m_Listener;
+
+            CPQServerRole m_Role;
+            CPQServerRole m_RoleHint;
+
+            CList m_Pipeline;
+
+            bool m_PipelineMode;
+
+            CPQStatementCache m_Statements;
+
+            bool m_Reading;
+
+            ConnStatusType m_Phase;
+            CDateTime m_PhaseTime;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+            PGcancelConn *m_pCancel;
+#endif
             CPollConnectionStatus m_ConnectionStatus;
 
+            void PipelineEnter();
+            void PipelineExit();
+
+            bool ReadInput();
+            bool WaitInput();
+
+            bool CheckCopyOut();
+
+            void SetConnectionStatus(CPollConnectionStatus Value);
+
+            void UpdateRole();
+
         public:
 
             explicit CPQPollConnection(const CPQConnInfo &AConnInfo, CPollManager *AManager);
 
+            ~CPQPollConnection() override;
+
             void QueryStart(CPQQuery *AQuery);
             void QueryStop();
 
+            void PipelineStart(CPQQuery *AQuery);
+            /// The session is lost: frees the queries in flight and leaves pipeline mode.
+            void PipelineReset();
+
             CPollConnectionStatus ConnectionStatus() const { return m_ConnectionStatus; };
-            void ConnectionStatus(CPollConnectionStatus Value) { m_ConnectionStatus = Value; };
+            void ConnectionStatus(CPollConnectionStatus Value) { SetConnectionStatus(Value); };
 
             CPQQuery *WorkQuery() const { return m_WorkQuery; }
 
+            CPQQuery *Pipeline(int Index) const { return (CPQQuery *) m_Pipeline[Index]; }
+
+            /// Connections turning ready are pushed here (nullptr - not pooled)
+            CPQIdleList *IdleList() const { return m_pIdleList; }
+            void IdleList(CPQIdleList *Value) { m_pIdleList = Value; }
+
+            /// The pool's dedicated LISTEN connection: never handed out for queries
+            bool Listener() const { return m_Listener; }
+            void Listener(bool Value) { m_Listener = Value; }
+
+            /// Index of the pool endpoint the connection belongs to (-1 - the pool's own ConnInfo)
+            int Endpoint() const { return m_Endpoint; }
+            void Endpoint(int Value) { m_Endpoint = Value; }
+
+            /// Server role: in_hot_standby reported by the server (14+), else RoleHint
+            CPQServerRole Role() const { return m_Role; }
+
+            CPQServerRole RoleHint() const { return m_RoleHint; }
+            void RoleHint(CPQServerRole Value) { m_RoleHint = Value; }
+
+            /// Queries sent in pipeline mode and still waiting for their sync point
+            int PipelineCount() const { return m_Pipeline.Count(); }
+
+            bool PipelineMode() const { return m_PipelineMode; }
+
+            CPQStatementCache &Statements() { return m_Statements; }
+            const CPQStatementCache &Statements() const { return m_Statements; }
+
+            /// The query being read has paused streaming: leave the input in the socket.
+            bool Paused() const;
+
+            bool Reading() const { return m_Reading; }
+
+            /// Connect phase (PQstatus) of a connection being opened or reset and the time it was entered
+            ConnStatusType Phase() const { return m_Phase; }
+            CDateTime PhaseTime() const { return m_PhaseTime; }
+
+            void UpdatePhase(ConnStatusType Value, CDateTime Now);
+
+            /// Asks the server to cancel the running statement (without blocking with libpq 17+).
+            void Cancel();
+            /// Advances a cancel request: true when there is none left in progress.
+            bool CancelPoll();
+
+            bool Cancelling() const;
+
             bool CheckResult();
+            bool CheckCopyIn();
+            int CheckPipeline();
             int CheckNotify();
 
         };
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CPQIdleList -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Ready connections of a pool by server role, the most recently used one is handed out first.
+        /// Entries are checked on Pop, so a connection that has left qsReady in the meantime is just skipped.
+        class CPQIdleList: public CObject {
+        private:
+
+            CList m_Primary;
+            CList m_Standby;
+
+            static CPQPollConnection *Pop(CList &List);
+
+        public:
+
+            CPQIdleList() = default;
+
+            CPQIdleList(const CPQIdleList &) = delete;
+            CPQIdleList &operator=(const CPQIdleList &) = delete;
+
+            void Push(CPQPollConnection *AConnection);
+
+            /// srPrimary - primaries only, srStandby - standbys first, srUnknown - any
+            CPQPollConnection *Pop(CPQServerRole ARole = srUnknown);
+
+            void Remove(CPQPollConnection *AConnection);
+
+            /// Moves the connections whose server has changed its role (promotion) to the other list
+            void Update();
+
+            int Count() const { return m_Primary.Count() + m_Standby.Count(); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CPQResult -------------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -452,6 +672,30 @@ namespace Delphi {
 
             int GetLength(int RowNumber, int ColumnNumber);
 
+            bool IsBinary(int RowNumber, int ColumnNumber);
+
+            /// Typed values: binary format is decoded in place, text format is parsed; NULL gives zero.
+            int16_t GetInt16(int RowNumber, int ColumnNumber);
+            int32_t GetInt32(int RowNumber, int ColumnNumber);
+            int64_t GetInt64(int RowNumber, int ColumnNumber);
+
+            float GetFloat(int RowNumber, int ColumnNumber);
+            double GetDouble(int RowNumber, int ColumnNumber);
+
+            bool GetBool(int RowNumber, int ColumnNumber);
+
+            /// Microseconds since 2000-01-01 of a timestamp, timestamptz or date.
+            int64_t GetTimestamp(int RowNumber, int ColumnNumber);
+            CDateTime GetDateTime(int RowNumber, int ColumnNumber);
+
+            /// The 16 bytes of a binary uuid inside the result, nullptr in text format.
+            LPCBYTE GetUUID(int RowNumber, int ColumnNumber);
+
+            /// The value as stored inside the result: raw bytes of a binary bytea.
+            LPCBYTE GetBytes(int RowNumber, int ColumnNumber, int &Length);
+
+            CString GetNumeric(int RowNumber, int ColumnNumber);
+
             int nParams();
 
             Oid ParamType(int ParamNumber);
@@ -472,6 +716,96 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CPQCopy ---------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define PQ_COPY_BUFFER_SIZE 65536
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CPQCopyFormat { cfText, cfCSV, cfBinary };
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CPQCopyState { csNone, csCopyIn, csCopyOut };
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// COPY FROM STDIN data: rows are encoded straight into the buffer handed to PQputCopyData.
+        class CPQCopy: public CObject, public CHeapComponent {
+        private:
+
+            CPQCopyFormat m_Format;
+
+            LPSTR m_pBuffer;
+
+            size_t m_Size;
+            size_t m_Capacity;
+
+            size_t m_RowStart;
+
+            int m_Fields;
+
+            bool m_Header;
+            bool m_Ended;
+
+            CString m_Error;
+
+            void Reserve(size_t Size);
+
+            void Put(LPCSTR Data, size_t Length);
+            void PutInt16(int16_t Value);
+            void PutInt32(int32_t Value);
+
+            void NextField();
+
+            void PutText(LPCSTR Value, size_t Length);
+            void PutCSV(LPCSTR Value, size_t Length);
+
+        public:
+
+            explicit CPQCopy(CPQCopyFormat AFormat = cfText);
+
+            CPQCopy(const CPQCopy &) = delete;
+            CPQCopy &operator=(const CPQCopy &) = delete;
+
+            ~CPQCopy() override;
+
+            void Clear();
+
+            void BeginRow();
+            void EndRow();
+
+            CPQCopy &Field(LPCSTR Value, size_t Length);
+            CPQCopy &Field(const CString &Value) { return Field(Value.Data(), Value.Size()); }
+
+            /// Binary format writes 4 and 8 byte integers, 8 byte floats: the column types must match.
+            CPQCopy &Int32(int32_t Value);
+            CPQCopy &Int64(int64_t Value);
+            CPQCopy &Double(double Value);
+            CPQCopy &Bool(bool Value);
+
+            CPQCopy &Null();
+
+            /// No more rows: the COPY is ended once the buffer is sent.
+            void End();
+            /// Ends the COPY with an error, the server rolls it back.
+            void Abort(const CString &Error);
+
+            void Consumed() { m_Size = 0; }
+
+            LPCSTR Data() const { return m_pBuffer; }
+            size_t Size() const { return m_Size; }
+
+            bool Ended() const { return m_Ended; }
+
+            const CString &Error() const { return m_Error; }
+
+            CPQCopyFormat Format() const { return m_Format; }
+            void Format(CPQCopyFormat Value) { m_Format = Value; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CPQQuery --------------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -480,17 +814,42 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         typedef std::function<void (CPQQuery *AQuery)> COnPQQueryExecutedEvent;
+        typedef std::function<void (CPQQuery *AQuery, CPQCopy &Copy)> COnPQCopyInEvent;
+        typedef std::function<void (CPQQuery *AQuery, LPCSTR Data, int Length)> COnPQCopyOutEvent;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef TList<CVariant> CPQParams;
         //--------------------------------------------------------------------------------------------------------------
 
         class CPQQuery: public CCollection {
             typedef CCollection inherited;
 
+            friend CPQPollConnection;
+
         private:
 
             CPQConnection *m_pConnection;
 
             CStringList m_SQL;
 
+            CPQParams m_Params;
+
+            bool m_Prepared;
+
+            int m_ResultFormat;
+
+            int m_ChunkSize;
+            bool m_RowMode;
+
+            CPQCopy m_Copy;
+            CPQCopyState m_CopyState;
+
+            CString m_StatementKey;
+
+            int m_Statement;
+            int m_Hidden;
+            int m_Statements;
+
             CDateTime m_StartTime;
 
             COnPQQueryExecutedEvent m_OnSendQuery;
@@ -498,16 +857,33 @@ namespace Delphi {
 
             COnPQResultEvent m_OnResultStatus;
             COnPQExecResultEvent m_OnResult;
+            COnPQResultEvent m_OnRows;
+
+            COnPQCopyInEvent m_OnCopyIn;
+            COnPQCopyOutEvent m_OnCopyOut;
 
             CPQResult *GetResult(int Index);
 
         protected:
 
+            bool m_Paused;
+            bool m_Cancelled;
+
             virtual void DoExecuted();
 
             void DoSendQuery();
             void DoResultStatus(CPQResult *AResult);
             void DoResult(CPQResult *AResult, ExecStatusType AExecStatus);
+            void DoRows(CPQResult *AResult);
+
+            void DoCopyIn();
+            void DoCopyOut(LPCSTR AData, int ALength);
+
+            void AddResult(PGresult *AResult);
+
+            void SetRowMode();
+
+            void SendStatement();
 
             void SetConnection(CPQConnection *Value);
 
@@ -528,6 +904,8 @@ namespace Delphi {
             int ResultCount() { return inherited::Count(); };
 
             void SendQuery();
+            void SendPipeline();
+
             bool CancelQuery(CString &Error);
 
             CDateTime StartTime() const { return m_StartTime; }
@@ -535,6 +913,40 @@ namespace Delphi {
             CStringList& SQL() { return m_SQL; }
             const CStringList& SQL() const { return m_SQL; }
 
+            /// Parameters $1..$n of the statement; with parameters the whole SQL text is one statement.
+            CPQParams& Params() { return m_Params; }
+            const CPQParams& Params() const { return m_Params; }
+
+            /// Run through the prepared statement cache of the pool connection.
+            bool Prepared() const { return m_Prepared; }
+            void Prepared(bool Value) { m_Prepared = Value; }
+
+            /// 0 - text, 1 - binary results (read them with the typed CPQResult accessors).
+            int ResultFormat() const { return m_ResultFormat; }
+            void ResultFormat(int Value) { m_ResultFormat = Value; }
+
+            /// Stream rows to OnRows: 0 - off, 1 - row by row, N - chunks of up to N rows (libpq 17+).
+            int ChunkSize() const { return m_ChunkSize; }
+            void ChunkSize(int Value) { m_ChunkSize = Value; }
+
+            /// A cancelled query never holds the connection back
+            bool Paused() const { return m_Paused && !m_Cancelled; }
+
+            /// Results that arrive after Cancel are dropped
+            bool Cancelled() const { return m_Cancelled; }
+
+            CPQCopy &Copy() { return m_Copy; }
+            const CPQCopy &Copy() const { return m_Copy; }
+
+            CPQCopyState CopyState() const { return m_CopyState; }
+
+            /// COPY runs outside of pipeline mode.
+            bool IsCopy() const { return m_OnCopyIn != nullptr || m_OnCopyOut != nullptr; }
+
+            /// One statement per query in pipeline mode: SQL without parameters that may hold several statements
+            /// stays on the simple query protocol.
+            bool CanPipeline() const;
+
             CPQResult *Results(int Index) { return GetResult(Index); };
 
             const COnPQQueryExecutedEvent &OnExecuted() const { return m_OnExecuted; }
@@ -549,6 +961,18 @@ namespace Delphi {
             const COnPQExecResultEvent &OnResult() const { return m_OnResult; }
             void OnResult(COnPQExecResultEvent && Value) { m_OnResult = Value; }
 
+            /// Streamed rows; the result is freed when the handler returns.
+            const COnPQResultEvent &OnRows() const { return m_OnRows; }
+            void OnRows(COnPQResultEvent && Value) { m_OnRows = Value; }
+
+            /// COPY FROM STDIN: called while the connection can take more data, fill Copy() and End() it.
+            const COnPQCopyInEvent &OnCopyIn() const { return m_OnCopyIn; }
+            void OnCopyIn(COnPQCopyInEvent && Value) { m_OnCopyIn = Value; }
+
+            /// COPY TO STDOUT: one call per data row.
+            const COnPQCopyOutEvent &OnCopyOut() const { return m_OnCopyOut; }
+            void OnCopyOut(COnPQCopyOutEvent && Value) { m_OnCopyOut = Value; }
+
         };
 
         //--------------------------------------------------------------------------------------------------------------
@@ -565,15 +989,32 @@ namespace Delphi {
         typedef std::function<void (CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E)> COnPQPollQueryExceptionEvent;
         //--------------------------------------------------------------------------------------------------------------
 
+        /// rtWrite - primary only, rtRead - a standby if there is one ready, else the primary
+        enum CPQRoute { rtWrite, rtRead };
+        //--------------------------------------------------------------------------------------------------------------
+
         #define POLL_QUERY_START_OK (-1)
         #define POLL_QUERY_START_FAIL (-2)
         //--------------------------------------------------------------------------------------------------------------
 
         class CPQPollQuery: public CPollConnection, public CPQQuery {
+            friend CPQConnectPoll;
+
         private:
 
             CPQConnectPoll *m_pConnectPoll;
 
+            size_t m_Ticket;
+
+            CDateTime m_Queued;
+            CDateTime m_Deadline;
+
+            int m_Timeout;
+
+            CPQRoute m_Route;
+
+            bool Interrupt(const Delphi::Exception::Exception &E);
+
             CStringList m_Data;
 
             COnPQPollQueryExecutedEvent m_OnExecuted;
@@ -589,15 +1030,41 @@ namespace Delphi {
 
             explicit CPQPollQuery(CPQConnectPoll *AConnectPoll);
 
+            ~CPQPollQuery() override;
+
             int Start();
 
+            /// Drops a queued query (it is freed) or cancels a running one on the server; OnException is called.
+            bool Cancel();
+
             void Close() override;
 
             int AddToQueue();
             void RemoveFromQueue();
 
+            /// Back-pressure for a slow consumer of OnRows: stop reading the connection until Resume.
+            void Pause() { m_Paused = true; }
+            void Resume();
+
+            /// Sends the rows added to Copy() outside of OnCopyIn.
+            void CopyFlush();
+
             CPQConnectPoll *ConnectPoll() const { return m_pConnectPoll; };
 
+            bool Queued() const { return m_Ticket != 0; }
+
+            /// Time to give up on the query, queued or running (0 - set from Timeout on Start)
+            CDateTime Deadline() const { return m_Deadline; }
+            void Deadline(CDateTime Value) { m_Deadline = Value; }
+
+            /// Time from Start to the end of execution, ms (0 - the pool's QueryTimeout)
+            int Timeout() const { return m_Timeout; }
+            void Timeout(int Value) { m_Timeout = Value; }
+
+            /// Used when the pool has endpoints
+            CPQRoute Route() const { return m_Route; }
+            void Route(CPQRoute Value) { m_Route = Value; }
+
             CStringList &Data() { return m_Data; }
             const CStringList &Data() const { return m_Data; }
 
@@ -610,6 +1077,56 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CPQPollQueue ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define PQ_POLL_QUEUE_SIZE 64
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// FIFO of queries waiting for a connection. Push returns a ticket that removes the query in O(1).
+        class CPQPollQueue: public CObject, public CHeapComponent {
+        private:
+
+            CPQPollQuery **m_pItems;
+
+            size_t m_Capacity;
+
+            size_t m_Head;
+            size_t m_Tail;
+
+            int m_Count;
+
+            void Grow();
+
+        public:
+
+            CPQPollQueue();
+
+            ~CPQPollQueue() override;
+
+            CPQPollQueue(const CPQPollQueue &) = delete;
+            CPQPollQueue &operator=(const CPQPollQueue &) = delete;
+
+            size_t Push(CPQPollQuery *AQuery);
+            CPQPollQuery *Pop();
+
+            bool Remove(size_t Ticket, CPQPollQuery *AQuery);
+
+            CPQPollQuery *First();
+
+            /// Tickets in use are [Head(), Tail()), removed ones map to nullptr
+            size_t Head() const { return m_Head; }
+            size_t Tail() const { return m_Tail; }
+
+            CPQPollQuery *Items(size_t Ticket) const { return m_pItems[Ticket & (m_Capacity - 1)]; }
+
+            int Count() const { return m_Count; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CPQPollQueryManager ---------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -712,18 +1229,117 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        #define PQ_POLL_QUEUE_MAX 0x0FFF
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef std::function<void (Pointer ASender, PGnotify *ANotify)> COnPQSubscriberNotifyEvent;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct CPQSubscriber {
+            CString Channel;
+            Pointer Sender = nullptr;
+            COnPQSubscriberNotifyEvent Handler = nullptr;
+            /// Unsubscribed while notifications were being delivered
+            bool Removed = false;
+        } CPQSubscriber;
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// One server of a multi-host pool
+        typedef struct CPQEndpoint {
+            CPQConnInfo ConnInfo;
+            /// Share of the connections relative to the other endpoints of the same role
+            int Weight = 1;
+            /// Configured, then the role seen on the last connection that turned ready
+            CPQServerRole Role = srUnknown;
+            bool Healthy = true;
+            int Failures = 0;
+            /// An unhealthy endpoint is not tried again before this time
+            CDateTime RetryTime = 0;
+        } CPQEndpoint;
+        //--------------------------------------------------------------------------------------------------------------
+
+        typedef struct CPQPoolStats {
+            size_t Connections = 0;
+            size_t Busy = 0;
+            size_t Queued = 0;
+            /// Current adaptive connection limit
+            size_t Limit = 0;
+            uint64_t Started = 0;
+            /// Started queries that had to wait in the queue
+            uint64_t Waited = 0;
+            uint64_t Timeouts = 0;
+            uint64_t Cancelled = 0;
+            /// Queue wait, ms
+            double WaitTime = 0;
+            double WaitTimeMax = 0;
+            double WaitAverage = 0;
+
+            double Utilization() const { return Connections == 0 ? 0 : (double) Busy / Connections; }
+        } CPQPoolStats;
+        //--------------------------------------------------------------------------------------------------------------
+
         class CPQConnectPoll: public CPQConnectPollEvent, public CEPollClient {
             friend CPQPollQuery;
 
         private:
 
-            CQueue m_Queue;
+            CPQPollQueue m_Queue;
+
+            CPQIdleList m_Idle;
+
+            CList m_Endpoints;
+
+            CHashTable m_Subscribers;
+            CStringList m_Channels;
+
+            CList m_Removed;
+            int m_Dispatching;
 
             CEPollTimer *m_pTimer;
 
             bool m_Active;
 
+            CPQPoolStats m_Stats;
+
+            size_t m_SizeLimit;
+
+            CDateTime m_PackTime;
+
+            /// Backoff of the pool's own ConnInfo, the endpoints keep theirs
+            int m_Failures;
+            CDateTime m_RetryTime;
+
+            /// Wait of the queries taken from the queue since the last timer tick, ms
+            double m_TickWait;
+            uint64_t m_TickWaited;
+
             void CheckQueue();
+            void CheckDeadlines(CDateTime Now);
+            void CheckSize(CDateTime Now);
+
+            void QueryStarted(CPQPollQuery *AQuery);
+
+            void Wake(CPQPollConnection *AConnection);
+
+            int SelectEndpoint(CPQServerRole ARole, CDateTime Now) const;
+            int EndpointConnections(int Index) const;
+
+            /// Index -1 - the pool's own ConnInfo
+            void EndpointFailed(int Index);
+            void EndpointReady(CPQPollConnection *AConnection);
+
+            bool ConnectAllowed(int Index, CDateTime Now) const;
+
+            CPQServerRole RouteRole(CPQRoute ARoute) const;
+
+            CPQPollConnection *GetListener() const;
+
+            void CheckListener();
+            void SyncListener(CPQPollConnection *AListener);
+
+            void DoListenerNotify(CPQConnection *AConnection, PGnotify *ANotify);
+            void CheckPipeline(CPQPollConnection *AConnection);
+            void CheckInput(CPQPollConnection *AConnection);
 
             void UpdateTimer();
 
@@ -748,17 +1364,28 @@ namespace Delphi {
             size_t m_SizeMin;
             size_t m_SizeMax;
 
+            size_t m_PipelineDepth;
+
+            int m_QueueTimeout;
+            int m_QueryTimeout;
+            int m_WaitTarget;
+            int m_IdleTimeout;
+            int m_ConnectTimeout;
+            int m_StartupTimeout;
+
             void Start();
 
             void Stop(int Index);
 
             void StopAll();
 
-            CPQPollConnection *GetReadyConnection();
+            CPQPollConnection *GetReadyConnection(CPQServerRole ARole = srUnknown);
+            CPQPollConnection *GetPipelineConnection(CPQServerRole ARole = srUnknown);
 
-            bool NewConnection();
+            bool NewConnection(CPQServerRole ARole = srUnknown, bool AListener = false);
 
             void PackConnections(CDateTime Now, CDateTime Period);
+            void CheckConnections(CDateTime Now);
 
             void DoTimer(CPollEventHandler *AHandler);
 
@@ -782,10 +1409,28 @@ namespace Delphi {
                 }
             };
 
-            ~CPQConnectPoll() override = default;
+            ~CPQConnectPoll() override;
 
             void Assign(const CPQConnectPoll &Other);
 
+            /// Adds a server: once there is one, connections go to the endpoints instead of ConnInfo.
+            /// ARole srUnknown - detected, libpq target_session_attrs in AConnInfo is honoured as well.
+            int AddEndpoint(const CPQConnInfo &AConnInfo, int AWeight = 1, CPQServerRole ARole = srUnknown);
+            void ClearEndpoints();
+
+            /// Handler gets the notifications of Channel, delivered by a dedicated connection that listens to
+            /// every subscribed channel and subscribes again after a reconnect.
+            void Subscribe(const CString &Channel, Pointer Sender, COnPQSubscriberNotifyEvent Handler);
+            bool Unsubscribe(const CString &Channel, Pointer Sender);
+            void UnsubscribeAll(Pointer Sender);
+
+            bool Subscribed(const CString &Channel) const { return m_Subscribers.Find(Channel) != nullptr; }
+
+            const CStringList &Channels() const { return m_Channels; }
+
+            int EndpointCount() const { return m_Endpoints.Count(); }
+            CPQEndpoint *Endpoints(int Index) const { return (CPQEndpoint *) m_Endpoints[Index]; }
+
             void ConnInfo(const CPQConnInfo &AConnInfo) { m_ConnInfo = AConnInfo; };
 
             CPQConnInfo &ConnInfo() { return m_ConnInfo; };
@@ -797,7 +1442,7 @@ namespace Delphi {
             int AddToQueue(CPQPollQuery *AQuery);
             void RemoveFromQueue(CPQPollQuery *AQuery);
 
-            const CQueue &Queue() const { return m_Queue; }
+            const CPQPollQueue &Queue() const { return m_Queue; }
 
             const CPollManager &ConnectManager() const { return m_ConnectManager; }
 
@@ -810,6 +1455,39 @@ namespace Delphi {
             size_t SizeMax() const { return m_SizeMax; }
             void SizeMax(size_t Value) { m_SizeMax = Value; }
 
+            /// Max queries in flight per connection in pipeline mode (0 - pipeline mode is off)
+            size_t PipelineDepth() const { return m_PipelineDepth; }
+            void PipelineDepth(size_t Value) { m_PipelineDepth = Value; }
+
+            /// Time a query may wait for a connection, ms (0 - no limit)
+            int QueueTimeout() const { return m_QueueTimeout; }
+            void QueueTimeout(int Value) { m_QueueTimeout = Value; }
+
+            /// Default Timeout of the queries, ms (0 - no limit)
+            int QueryTimeout() const { return m_QueryTimeout; }
+            void QueryTimeout(int Value) { m_QueryTimeout = Value; }
+
+            /// Queue wait the pool grows above SizeMin to keep, ms (0 - grow up to SizeMax on demand)
+            int WaitTarget() const { return m_WaitTarget; }
+            void WaitTarget(int Value) { m_WaitTarget = Value; }
+
+            /// Connections above the current limit idle this long are closed, sec
+            int IdleTimeout() const { return m_IdleTimeout; }
+            void IdleTimeout(int Value) { m_IdleTimeout = Value; }
+
+            /// Time to get the socket connected, ms (0 - no limit)
+            int ConnectTimeout() const { return m_ConnectTimeout; }
+            void ConnectTimeout(int Value) { m_ConnectTimeout = Value; }
+
+            /// Time a connected socket may spend in each further phase of the startup (TLS, authentication,
+            /// session checks), ms (0 - no limit)
+            int StartupTimeout() const { return m_StartupTimeout; }
+            void StartupTimeout(int Value) { m_StartupTimeout = Value; }
+
+            size_t SizeLimit() const { return m_SizeLimit; }
+
+            CPQPoolStats Stats() const;
+
             CPQPollConnection *Connections(int Index) const { return GetConnection(Index); }
 
         };
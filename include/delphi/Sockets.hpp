@@ -37,6 +37,9 @@ Author:
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #endif
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 //----------------------------------------------------------------------------------------------------------------------
 
 #ifndef INT_LF
@@ -76,6 +79,9 @@ Author:
 //----------------------------------------------------------------------------------------------------------------------
 
 #define WS_FIN                  0x80u
+#define WS_RSV1                 0x40u
+#define WS_RSV2                 0x20u
+#define WS_RSV3                 0x10u
 #define WS_MASK                 0x80u
 
 #define WS_OPCODE_CONTINUATION  0x00u
@@ -87,6 +93,10 @@ Author:
 
 #define WS_PAYLOAD_LENGTH_16    126u
 #define WS_PAYLOAD_LENGTH_64    127u
+
+#define WS_CLOSE_MESSAGE_TOO_BIG 1009u
+
+#define WS_MAX_MESSAGE_SIZE     (16u * 1024u * 1024u)
 //----------------------------------------------------------------------------------------------------------------------
 
 typedef struct sockaddr SOCKADDR, *LPSOCKADDR;
@@ -158,12 +168,15 @@ namespace Delphi {
             int m_LastError;
 #ifdef WITH_SSL
             unsigned long m_SSLError;
+
+            /// Scratch buffer of SSLSendFile without kernel TLS, allocated on first use
+            char *m_pSendFileBuffer;
 #endif
         public:
 
             CStack();
 
-            virtual ~CStack() = default;
+            virtual ~CStack();
 
             inline static class CStack *CreateSocket() { return GStack = new CStack; };
 
@@ -184,9 +197,13 @@ namespace Delphi {
             static uint64_t SSLGetOptions(SSL *ssl);
             static uint64_t SSLSetOptions(SSL *ssl, uint64_t op);
 
+            static bool SSLEnableKTLS(SSL *ssl);
+            static bool SSLKTLSSend(SSL *ssl);
+            static bool SSLKTLSRecv(SSL *ssl);
+
             static ssize_t SSLRecv(SSL *ssl, void *ABuffer, int ABufferLength);
             static ssize_t SSLSend(SSL *ssl, void *ABuffer, int ABufferLength);
-            static ssize_t SSLSendFile(SSL *ssl, CHandle AHandle, off_t AOffSet, size_t ASize, int AFlags = 0);
+            ssize_t SSLSendFile(SSL *ssl, CHandle AHandle, off_t AOffSet, size_t ASize, int AFlags = 0);
 
             virtual unsigned long GetSSLError();
 
@@ -318,6 +335,7 @@ namespace Delphi {
         #define GSendBufferSizeDefault  (64 * 1024)
         #define MaxLineLengthDefault    (32 * 1024)
         #define InBufCacheSizeDefault   (32 * 1024) //CManagedBuffer.PackReadSize
+        #define OutputQueueLimitDefault (4 * 1024 * 1024)
         //--------------------------------------------------------------------------------------------------------------
 
         enum CMaxLineAction {
@@ -325,6 +343,12 @@ namespace Delphi {
         };
         //--------------------------------------------------------------------------------------------------------------
 
+        /// What to do with a slow consumer whose output queue is over its limit.
+        enum COutputQueueAction {
+            oqDrop, oqDisconnect
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
         class LIB_DELPHI CSimpleBuffer : public CMemoryStream {
             typedef CMemoryStream inherited;
 
@@ -380,6 +404,41 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CSharedBuffer ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Immutable reference counted buffer, queued as is into several connections (not thread safe).
+        class LIB_DELPHI CSharedBuffer {
+        private:
+
+            int m_RefCount;
+            size_t m_Size;
+
+            CSharedBuffer(const void *ABuffer, size_t ASize);
+
+            ~CSharedBuffer() = default;
+
+        public:
+
+            CSharedBuffer(const CSharedBuffer &) = delete;
+            CSharedBuffer &operator=(const CSharedBuffer &) = delete;
+
+            static CSharedBuffer *Create(const void *ABuffer, size_t ASize);
+            static CSharedBuffer *Create(const CMemoryStream &Stream);
+
+            CSharedBuffer *AddRef();
+            void Release();
+
+            int RefCount() const { return m_RefCount; }
+
+            size_t Size() const { return m_Size; }
+            const void *Memory() const { return this + 1; }
+
+        }; // CSharedBuffer
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CSocketHandle ---------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -392,6 +451,8 @@ namespace Delphi {
             SSL *m_pSSL;
 
             CSSLMethod m_SSLMethod;
+
+            bool m_KTLS;
 #endif
             int m_SocketType;
 
@@ -442,6 +503,12 @@ namespace Delphi {
             void SSLMethod(CSSLMethod Value) { m_SSLMethod = Value; }
 
             bool UsedSSL() const { return m_SSLMethod != sslNotUsed; }
+
+            bool KTLS() const { return m_KTLS; }
+            void KTLS(bool Value) { m_KTLS = Value; }
+
+            bool KTLSSend() const;
+            bool KTLSRecv() const;
 #endif
             bool Accept(CSocket ASocket, unsigned int AFlag);
 
@@ -591,6 +658,8 @@ namespace Delphi {
             virtual CSSLMethod SSLMethod() const abstract;
 
             virtual bool UsedSSL() const abstract;
+
+            virtual bool KTLSSend() const abstract;
 #else
             virtual void Open() abstract;
 #endif
@@ -630,6 +699,8 @@ namespace Delphi {
             bool UsedSSL() const override;
 
             CSSLMethod SSLMethod() const override;
+
+            bool KTLSSend() const override;
 #else
             void Open() override;
 #endif
@@ -783,11 +854,21 @@ namespace Delphi {
             CManagedBuffer m_InputBuffer;
             CSimpleBuffer m_OutputBuffer;
 
+            CList m_OutputQueue;
+
+            size_t m_OutputQueueOffset;
+            size_t m_OutputQueueSize;
+            size_t m_OutputQueueLimit;
+            size_t m_OutputQueueDropped;
+
+            COutputQueueAction m_OutputQueueAction;
+
             bool m_ReadLnSplit;
             bool m_ReadLnTimedOut;
             bool m_ClosedGracefully;
             bool m_OEM;
             bool m_UsedSSL;
+            bool m_KTLS;
 
             size_t m_SendBufferSize;
             size_t m_RecvBufferSize;
@@ -805,6 +886,10 @@ namespace Delphi {
             void SetIOHandler(CIOHandler *AValue, bool AFree);
             void FreeIOHandler();
 
+            void SetKTLS(bool Value);
+
+            bool WriteQueueAsync();
+
         protected:
 
             CDateTime m_Clock;
@@ -831,6 +916,11 @@ namespace Delphi {
 
             bool UsedSSL() const { return m_UsedSSL; }
 
+            bool KTLS() const { return m_KTLS; }
+            void KTLS(bool Value) { SetKTLS(Value); }
+
+            bool KTLSSend();
+
             CDateTime Clock() const { return m_Clock; };
             void UpdateClock() { m_Clock = Now(); };
 
@@ -861,6 +951,10 @@ namespace Delphi {
 
             bool WriteAsync(ssize_t AByteCount = -1);
 
+            bool Enqueue(CSharedBuffer *ABuffer);
+
+            void ClearOutputQueue();
+
             void WriteInteger(int AValue, bool AConvert = true);
 
             ssize_t SendFile(CHandle AHandle, off_t AOffSet, size_t AByteCount, int AFlags = 0);
@@ -911,6 +1005,19 @@ namespace Delphi {
             CSimpleBuffer &OutputBuffer() { return m_OutputBuffer; }
             const CSimpleBuffer &OutputBuffer() const { return m_OutputBuffer; }
 
+            /// Bytes waiting in the shared output queue.
+            size_t OutputQueueSize() const { return m_OutputQueueSize; }
+
+            /// Upper bound for pending output (0 - unlimited).
+            size_t OutputQueueLimit() const { return m_OutputQueueLimit; }
+            void OutputQueueLimit(size_t Value) { m_OutputQueueLimit = Value; }
+
+            COutputQueueAction OutputQueueAction() const { return m_OutputQueueAction; }
+            void OutputQueueAction(COutputQueueAction Value) { m_OutputQueueAction = Value; }
+
+            /// Number of shared buffers rejected because the queue was full.
+            size_t OutputQueueDropped() const { return m_OutputQueueDropped; }
+
             CNotifyEvent &OnDisconnected() { return m_OnDisconnected; }
             const CNotifyEvent &OnDisconnected() const { return m_OnDisconnected; }
             void OnDisconnected(CNotifyEvent && Value) { m_OnDisconnected = Value; }
@@ -1195,6 +1302,7 @@ namespace Delphi {
         struct CWebSocketFrame {
 
             unsigned char FIN = WS_FIN;
+            unsigned char RSV1 = 0;
             unsigned char Opcode = 0xFF;
             unsigned char Mask = 0;
             unsigned char Length = 0;
@@ -1202,6 +1310,7 @@ namespace Delphi {
 
             void Clear() {
                 FIN = WS_FIN;
+                RSV1 = 0;
                 Opcode = 0xFF;
                 Mask = 0;
                 Length = 0;
@@ -1227,8 +1336,6 @@ namespace Delphi {
 
             enum CWSParserState {
                 frame,
-                extended,
-                masking_key,
                 payload_start,
                 payload
             } m_State = frame;
@@ -1240,15 +1347,27 @@ namespace Delphi {
 
             size_t m_MaskingIndex;
 
-            void LoadHeader(const CMemoryStream &Stream);
-            void LoadExtended(const CMemoryStream &Stream);
-            void LoadMaskingKey(const CMemoryStream &Stream);
+            unsigned char m_Header[14];
+            size_t m_HeaderSize;
+
+            bool m_Compressed;
+
+            bool m_Streaming;
+            bool m_Chunked;
+
+            unsigned char m_MessageOpcode;
+
+            uint64_t m_MessageSize;
+            uint64_t m_MaxMessageSize;
+            uint64_t m_FrameRemaining;
+
+            bool LoadHeader(const CMemoryStream &Stream);
+
+            void WriteFrame(CMemoryStream &Stream, unsigned char Header, const void *Data, size_t Size);
 
-            void Encode(CMemoryStream &Stream);
             void Decode(const CMemoryStream &Stream);
 
             void PayloadFromStream(const CMemoryStream &Stream);
-            void PayloadToStream(CMemoryStream &Stream);
 
         public:
 
@@ -1264,16 +1383,55 @@ namespace Delphi {
 
             CWSParserState State() { return m_State; }
 
+            /// RSV1 of the first frame of the current message (permessage-deflate).
+            bool Compressed() const { return m_Compressed; }
+            void Compressed(bool Value) { m_Compressed = Value; }
+
+            /// Hand out payload as it arrives instead of collecting the whole message (compressed messages are still collected).
+            bool Streaming() const { return m_Streaming; }
+            void Streaming(bool Value) { m_Streaming = Value; }
+
+            /// True if the current message is delivered chunk by chunk.
+            bool Chunked() const { return m_Chunked; }
+
+            /// Upper bound for a data message, checked against frame headers before any allocation.
+            /// Defaults to WS_MAX_MESSAGE_SIZE (16 MiB), 0 - unlimited.
+            uint64_t MaxMessageSize() const { return m_MaxMessageSize; }
+            void MaxMessageSize(uint64_t Value) { m_MaxMessageSize = Value; }
+
+            /// Opcode of the current data message (continuation frames keep it).
+            unsigned char MessageOpcode() const { return m_MessageOpcode; }
+
+            uint64_t MessageSize() const { return m_MessageSize; }
+
+            bool FrameEnd() const { return m_State == frame && m_HeaderSize == 0; }
+            bool MessageEnd() const { return FrameEnd() && m_Frame.FIN == WS_FIN; }
+
+            void UpdateLength();
+
             void Close(CMemoryStream &Stream);
             void Ping(CMemoryStream &Stream);
             void Pong(CMemoryStream &Stream);
 
             void SaveToStream(CMemoryStream &Stream);
+            void SaveToStream(CMemoryStream &Stream, size_t FragmentSize);
+
+            /// Returns 1 - frame complete, 2 - streamed chunk ready, -1 - need more data, -2 - message too big.
             int LoadFromStream(const CMemoryStream &Stream);
 
+            void SaveFragment(CMemoryStream &Stream, const void *Data, size_t Size, unsigned char Opcode, bool Final);
+
+            /// Frames the current payload once for a broadcast; the caller owns one reference.
+            CSharedBuffer *SaveToShared();
+
+            static void Mask(unsigned char *Data, size_t Size, const unsigned char Key[4], size_t Index = 0);
+
             void SetPayload(CMemoryStream &Stream, uint32_t Key = 0);
             void SetPayload(const CString &String, uint32_t Key = 0);
 
+            /// Completes a payload written in place through Payload() starting at position 0.
+            void PayloadWritten(unsigned char Opcode = WS_OPCODE_TEXT, uint32_t Key = 0);
+
             CWebSocket& operator<< (const CString &String) {
                 SetPayload(String);
                 return *this;
@@ -1295,6 +1453,83 @@ namespace Delphi {
             }
 
         };
+#ifdef WITH_ZLIB
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CWebSocketDeflate -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// permessage-deflate parameters (RFC 7692).
+        struct CWebSocketDeflateOptions {
+
+            bool Enabled = false;
+
+            bool ServerNoContextTakeover = false;
+            bool ClientNoContextTakeover = false;
+
+            int ServerMaxWindowBits = 15;
+            int ClientMaxWindowBits = 15;
+
+            int Level = Z_DEFAULT_COMPRESSION;
+            int MemLevel = 8;
+
+            /// Messages smaller than this are sent uncompressed.
+            size_t Threshold = 64;
+
+            /// Limit of zlib allocations per connection (0 - no limit).
+            size_t MemoryLimit = 512 * 1024;
+
+            /// Limit of an inflated message size (0 - no limit).
+            size_t MaxMessageSize = WS_MAX_MESSAGE_SIZE;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CWebSocketDeflate {
+        private:
+
+            CWebSocketDeflateOptions m_Options;
+
+            bool m_Server;
+
+            z_stream m_Deflate;
+            z_stream m_Inflate;
+
+            bool m_DeflateReady;
+            bool m_InflateReady;
+
+            size_t m_MemoryUsed;
+
+            static voidpf Alloc(voidpf Opaque, uInt Items, uInt Size);
+            static void Free(voidpf Opaque, voidpf Address);
+
+            bool InitDeflate();
+            void InitInflate();
+
+            bool DeflateNoContextTakeover() const { return m_Server ? m_Options.ServerNoContextTakeover : m_Options.ClientNoContextTakeover; }
+            bool InflateNoContextTakeover() const { return m_Server ? m_Options.ClientNoContextTakeover : m_Options.ServerNoContextTakeover; }
+
+        public:
+
+            CWebSocketDeflate(const CWebSocketDeflateOptions &Options, bool Server);
+
+            ~CWebSocketDeflate();
+
+            const CWebSocketDeflateOptions &Options() const { return m_Options; }
+
+            size_t MemoryUsed() const { return m_MemoryUsed; }
+
+            void Compress(CWebSocket &WebSocket);
+            void Decompress(CWebSocket &WebSocket);
+
+            static bool Negotiate(const CString &Offers, const CWebSocketDeflateOptions &Options, CWebSocketDeflateOptions &Agreed, CString &Response);
+            static bool Accept(const CString &Response, const CWebSocketDeflateOptions &Options, CWebSocketDeflateOptions &Agreed);
+            static CString Offer(const CWebSocketDeflateOptions &Options);
+
+        };
+#endif
 
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1314,7 +1549,10 @@ namespace Delphi {
 
             CWebSocket m_WSRequest;
             CWebSocket m_WSReply;
-
+#ifdef WITH_ZLIB
+            CWebSocketDeflateOptions m_DeflateOptions;
+            CWebSocketDeflate *m_pDeflate;
+#endif
             CStringList m_Data;
 
             CNotifyEvent m_OnWaitRequest;
@@ -1326,6 +1564,12 @@ namespace Delphi {
             CNotifyEvent m_OnPing;
             CNotifyEvent m_OnPong;
 
+            CNotifyEvent m_OnFragment;
+
+            size_t m_FragmentSize;
+
+            bool m_FragmentOpen;
+
         protected:
 
             CConnectionStatus m_ConnectionStatus;
@@ -1341,6 +1585,8 @@ namespace Delphi {
             void DoPing();
             void DoPong();
 
+            void DoFragment();
+
             void SetObject(CObject *Value);
 
             virtual void Parse(const CMemoryStream &Stream, COnSocketExecuteEvent && OnExecute);
@@ -1349,10 +1595,18 @@ namespace Delphi {
 
             explicit CWebSocketConnection(CPollManager *AManager);
 
-            ~CWebSocketConnection() override = default;
+            ~CWebSocketConnection() override;
 
             CHTTPProtocol Protocol() const { return m_Protocol; }
+#ifdef WITH_ZLIB
+            CWebSocketDeflateOptions &DeflateOptions() { return m_DeflateOptions; }
+            const CWebSocketDeflateOptions &DeflateOptions() const { return m_DeflateOptions; }
+
+            CWebSocketDeflate *Deflate() const { return m_pDeflate; }
 
+            void EnableDeflate(const CWebSocketDeflateOptions &Agreed, bool Server);
+            void DisableDeflate();
+#endif
             CWebSocket &WSRequest() { return m_WSRequest; }
             const CWebSocket &WSRequest() const { return m_WSRequest; }
 
@@ -1363,6 +1617,9 @@ namespace Delphi {
             void ConnectionStatus(CConnectionStatus Value) { m_ConnectionStatus = Value; }
 
             void SendWebSocket(bool bSendNow = false);
+            bool SendWebSocket(CSharedBuffer *AFrame);
+
+            void SendWebSocketFragment(const void *Data, size_t Size, bool Final, unsigned char Opcode = WS_OPCODE_BINARY, bool bSendNow = false);
 
             void SendWebSocketPing(bool bSendNow = false);
             void SendWebSocketPong(bool bSendNow = false);
@@ -1376,6 +1633,13 @@ namespace Delphi {
             CStringList &Data() { return m_Data; }
             const CStringList &Data() const { return m_Data; }
 
+            /// Outgoing messages larger than this are split into frames (0 - never split).
+            size_t FragmentSize() const { return m_FragmentSize; }
+            void FragmentSize(size_t Value) { m_FragmentSize = Value; }
+
+            uint64_t MaxMessageSize() const { return m_WSRequest.MaxMessageSize(); }
+            void MaxMessageSize(uint64_t Value) { m_WSRequest.MaxMessageSize(Value); }
+
             CNotifyEvent &OnWaitRequest() { return m_OnWaitRequest; }
             const CNotifyEvent &OnWaitRequest() const { return m_OnWaitRequest; }
             void OnWaitRequest(CNotifyEvent && Value) { m_OnWaitRequest = Value; }
@@ -1400,6 +1664,11 @@ namespace Delphi {
             const CNotifyEvent &OnPong() const { return m_OnPong; }
             void OnPong(CNotifyEvent && Value) { m_OnPong = Value; }
 
+            /// Streaming receive: called for every chunk of a data message, see CWebSocket::Streaming().
+            CNotifyEvent &OnFragment() { return m_OnFragment; }
+            const CNotifyEvent &OnFragment() const { return m_OnFragment; }
+            void OnFragment(CNotifyEvent && Value) { m_OnFragment = Value; m_WSRequest.Streaming(m_OnFragment != nullptr); }
+
         }; // CWebSocketConnection
 
         //--------------------------------------------------------------------------------------------------------------
@@ -2044,6 +2313,7 @@ namespace Delphi {
             bool m_Active;
 #ifdef WITH_SSL
             bool m_UsedSSL;
+            bool m_KTLS;
 #endif
             CStringList m_Data;
 
@@ -2079,6 +2349,9 @@ namespace Delphi {
 #ifdef WITH_SSL
             bool UsedSSL() const { return m_UsedSSL; }
             void UsedSSL(bool Value) { m_UsedSSL = Value; }
+
+            bool KTLS() const { return m_KTLS; }
+            void KTLS(bool Value) { m_KTLS = Value; }
 #endif
             CCommandHandlers &CommandHandlers() { return m_CommandHandlers; }
             const CCommandHandlers &CommandHandlers() const { return m_CommandHandlers; }
@@ -2572,6 +2845,7 @@ namespace Delphi {
             bool m_Active;
 #ifdef WITH_SSL
             bool m_UsedSSL;
+            bool m_KTLS;
 #endif
             CStringList m_Data;
 
@@ -2607,6 +2881,9 @@ namespace Delphi {
 #ifdef WITH_SSL
             bool UsedSSL() const { return m_UsedSSL; }
             void UsedSSL(bool Value) { SetUsedSSL(Value); }
+
+            bool KTLS() const { return m_KTLS; }
+            void KTLS(bool Value) { m_KTLS = Value; }
 #endif
 
             CCommandHandlers &CommandHandlers() { return m_CommandHandlers; }
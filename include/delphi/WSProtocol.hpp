@@ -39,13 +39,31 @@ namespace Delphi {
 
         enum CWSMessageType { mtOpen = 0, mtClose, mtCall, mtCallResult, mtCallError };
 
+        class CWSProtocol;
+        //--------------------------------------------------------------------------------------------------------------
+
         typedef struct CWSMessage {
+            friend CWSProtocol;
+
             CWSMessageType MessageTypeId = mtOpen;
             CString UniqueId {};
             CString Action {};
             int ErrorCode = -1;
             CString ErrorMessage {};
-            CJSON Payload {};
+
+            /// Serialized payload as received: spliced verbatim on send until Json() is accessed.
+            CString RawPayload {};
+
+            /// The payload, parsed from RawPayload on first access.
+            CJSON &Json() {
+                return const_cast<CJSON &> (static_cast<const CWSMessage *> (this)->Json());
+            }
+
+            const CJSON &Json() const {
+                if (m_Payload.IsNull() && !RawPayload.IsEmpty())
+                    m_Payload.ToJson(RawPayload);
+                return m_Payload;
+            }
 
             static CString MessageTypeIdToString(CWSMessageType Value) {
                 switch (Value) {
@@ -65,9 +83,13 @@ namespace Delphi {
             }
 
             size_t Size() const {
-                return UniqueId.Size() + Action.Size() + ErrorMessage.Size();
+                return UniqueId.Size() + Action.Size() + ErrorMessage.Size() + RawPayload.Size();
             }
 
+        private:
+
+            mutable CJSON m_Payload {};
+
         } CWSMessage;
 
         //--------------------------------------------------------------------------------------------------------------
@@ -86,7 +108,13 @@ namespace Delphi {
         class CWSProtocol {
         public:
 
+            /// Single pass over the envelope, "p" is kept as raw text in RawPayload and parsed by Json() on demand.
+            static bool Request(LPCTSTR Buffer, size_t Size, CWSMessage &Message);
             static bool Request(const CString &String, CWSMessage &Message);
+
+            /// Writes the envelope at the current position of the stream.
+            static void Response(const CWSMessage &Message, CMemoryStream &Stream);
+            static void Response(const CWSMessage &Message, CWebSocket &Reply);
             static void Response(const CWSMessage &Message, CString &String);
 
             static void PrepareResponse(const CWSMessage &Request, CWSMessage &Response);
@@ -112,27 +140,54 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         typedef std::function<void (CMessageHandler *Handler, CHTTPServerConnection *Connection)> COnMessageHandlerEvent;
+        typedef std::function<void (CMessageHandler *Handler)> COnMessageCancelEvent;
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define MESSAGE_TIMEOUT_DEFAULT     60000
+        #define MESSAGE_WHEEL_SIZE          64
+        #define MESSAGE_WHEEL_RESOLUTION    1000
         //--------------------------------------------------------------------------------------------------------------
 
         class CMessageHandler: public CCollectionItem {
+            friend CMessageManager;
+
         private:
 
+            CMessageManager *m_pManager;
+
             CString m_UniqueId;
             CString m_Action;
 
+            unsigned long m_Deadline;
+            int m_Slot;
+
+            bool m_Expired;
+
             COnMessageHandlerEvent m_Handler;
+            COnMessageCancelEvent m_OnCancel;
 
         public:
 
             CMessageHandler(CMessageManager *AManager, COnMessageHandlerEvent && Handler);
 
+            ~CMessageHandler() override;
+
             const CString &UniqueId() const { return m_UniqueId; }
 
             CString &Action() { return m_Action; }
             const CString &Action() const { return m_Action; }
 
+            /// Epoch milliseconds after which the call is cancelled (0 - never).
+            unsigned long Deadline() const { return m_Deadline; }
+
+            /// True if the call was cancelled by its deadline rather than explicitly.
+            bool Expired() const { return m_Expired; }
+
             void Handler(CHTTPServerConnection *AConnection);
 
+            const COnMessageCancelEvent &OnCancel() const { return m_OnCancel; }
+            void OnCancel(COnMessageCancelEvent && Value) { m_OnCancel = Value; }
+
         };
 
         //--------------------------------------------------------------------------------------------------------------
@@ -146,21 +201,59 @@ namespace Delphi {
 
         class CMessageManager: public CCollection {
             typedef CCollection inherited;
+            friend CMessageHandler;
 
         private:
 
             CSession *m_pSession;
 
+            CHashTable m_Index;
+
+            CList m_Wheel[MESSAGE_WHEEL_SIZE];
+            unsigned long m_WheelTick;
+
+            unsigned long m_Timeout;
+            int m_MaxPending;
+
+            /// Set by the destructor while CheckTimeout() runs callbacks.
+            bool *m_pDestroyed;
+
             CMessageHandler *Get(int Index) const;
             void Set(int Index, CMessageHandler *Value);
 
+            void Schedule(CMessageHandler *AHandler, unsigned long Timeout);
+            void Detach(CMessageHandler *AHandler);
+
         public:
 
-            explicit CMessageManager(CSession *ASession): CCollection(this), m_pSession(ASession) {
+            explicit CMessageManager(CSession *ASession);
 
-            }
+            ~CMessageManager() override;
 
+            /// Returns nullptr without sending when MaxPending() calls are already outstanding.
             CMessageHandler *Add(COnMessageHandlerEvent &&Handler, const CString &Action, const CJSON &Payload);
+            CMessageHandler *Add(COnMessageHandlerEvent &&Handler, const CString &Action, const CJSON &Payload,
+                unsigned long Timeout, COnMessageCancelEvent &&OnCancel = nullptr);
+
+            /// Runs and frees the handler waiting for UniqueId.
+            bool Resolve(const CString &UniqueId, CHTTPServerConnection *AConnection);
+
+            void Cancel(CMessageHandler *AHandler);
+            void CancelAll();
+
+            /// Cancels calls whose deadline has passed, returns their number. A cancel callback may cancel other
+            /// calls or drop the session.
+            int CheckTimeout(unsigned long Now);
+
+            /// Default call timeout in milliseconds (0 - no deadline).
+            unsigned long Timeout() const { return m_Timeout; }
+            void Timeout(unsigned long Value) { m_Timeout = Value; }
+
+            /// Upper bound for outstanding calls (0 - unlimited).
+            int MaxPending() const { return m_MaxPending; }
+            void MaxPending(int Value) { m_MaxPending = Value; }
+
+            bool Full() const { return m_MaxPending > 0 && Count() >= m_MaxPending; }
 
             CMessageHandler *First() { return Get(0); };
             CMessageHandler *Last() { return Get(Count() - 1); };
@@ -180,12 +273,20 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        class CSession;
         class CSessionManager;
         //--------------------------------------------------------------------------------------------------------------
 
+        typedef std::function<bool (CSession *Session)> COnSessionFilterEvent;
+        //--------------------------------------------------------------------------------------------------------------
+
         class CSession: public CCollectionItem {
+            friend CSessionManager;
+
         private:
 
+            CSessionManager *m_pManager;
+
             CHTTPServerConnection *m_pConnection;
 
             CMessageManager m_Messages {this};
@@ -198,6 +299,14 @@ namespace Delphi {
             CString m_IP;
             CString m_Agent;
 
+            /// Keys the session is filed under in the manager's indexes
+            CString m_IndexedIdentity;
+            CString m_IndexedSession;
+            CString m_IndexedIP;
+
+            /// A mutable key was handed out: the manager reindexes the session before its next lookup
+            bool m_Stale;
+
             int m_UpdateCount;
 
             bool m_Authorized;
@@ -205,6 +314,12 @@ namespace Delphi {
             void AddToConnection(CHTTPServerConnection *AConnection);
             void DeleteFromConnection(CHTTPServerConnection *AConnection);
 
+            void SetIdentity(const CString &Value);
+            void SetSession(const CString &Value);
+            void SetIP(const CString &Value);
+
+            CString &GetMutableKey(CString &Value);
+
         public:
 
             explicit CSession(CHTTPServerConnection *AConnection, CSessionManager *AManager);
@@ -228,17 +343,23 @@ namespace Delphi {
             CAuthorization &Authorization() { return m_Authorization; };
             const CAuthorization &Authorization() const { return m_Authorization; };
 
-            CString &Identity() { return m_Identity; };
+            /// Deprecated: use the setters. A write through the reference is picked up on the next lookup
+            CString &Identity() { return GetMutableKey(m_Identity); };
             const CString &Identity() const { return m_Identity; };
+            void Identity(const CString &Value) { SetIdentity(Value); };
 
-            CString &Session() { return m_Session; };
+            /// Deprecated: see Identity()
+            CString &Session() { return GetMutableKey(m_Session); };
             const CString &Session() const { return m_Session; };
+            void Session(const CString &Value) { SetSession(Value); };
 
             CString &Secret() { return m_Secret; };
             const CString &Secret() const { return m_Secret; };
 
-            CString &IP() { return m_IP; };
+            /// Deprecated: see Identity()
+            CString &IP() { return GetMutableKey(m_IP); };
             const CString &IP() const { return m_IP; };
+            void IP(const CString &Value) { SetIP(Value); };
 
             CString &Agent() { return m_Agent; };
             const CString &Agent() const { return m_Agent; };
@@ -256,27 +377,52 @@ namespace Delphi {
 
         class CSessionManager: public CCollection {
             typedef CCollection inherited;
+            friend CSession;
 
         private:
 
+            CHashTable m_SessionIndex;
+            CHashTable m_IdentityIndex;
+            CHashTable m_IPIndex;
+
+            CList m_Stale;
+
             CSession *Get(int Index) const;
             void Set(int Index, CSession *Value);
 
+            static void Reindex(CHashTable &Index, CString &OldKey, const CString &NewKey, CSession *ASession);
+
+            void UpdateIndex(CSession *ASession);
+            void DeleteFromIndex(CSession *ASession);
+
+            void CheckStale();
+
         public:
 
             CSessionManager();
 
+            ~CSessionManager() override;
+
             CSession *Add(CHTTPServerConnection *AConnection);
 
             CSession *First() { return Get(0); };
             CSession *Last() { return Get(Count() - 1); };
 
+            /// An empty key matches no session.
             CSession *Find(const CString &Session, const CString &Identity);
             CSession *FindByIP(const CString &Value);
             CSession *FindBySession(const CString &Value);
             CSession *FindByIdentity(const CString &Value);
             CSession *FindByConnection(CHTTPServerConnection *Value);
 
+            int FindAllByIP(const CString &Value, CList &List);
+            int FindAllByIdentity(const CString &Value, CList &List);
+
+            int CheckTimeout(unsigned long Now);
+
+            int Broadcast(const CWSMessage &Message, const COnSessionFilterEvent &Filter = nullptr);
+            int Broadcast(CSharedBuffer *AFrame, const COnSessionFilterEvent &Filter = nullptr);
+
             CSession *Sessions(int Index) const { return Get(Index); }
             void Sessions(int Index, CSession *Value) { Set(Index, Value); }
 
@@ -2817,6 +2817,165 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CHashTable ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHashTable::CHashTable(size_t Capacity): CObject() {
+            m_Capacity = 16;
+            while (m_Capacity < Capacity)
+                m_Capacity <<= 1;
+
+            m_Count = 0;
+            m_Buckets = new CHashEntry* [m_Capacity]();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHashTable::~CHashTable() {
+            Clear();
+            delete [] m_Buckets;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        unsigned CHashTable::HashOf(LPCTSTR Key, size_t Length) {
+            // FNV-1a
+            unsigned Result = 2166136261u;
+            for (size_t I = 0; I < Length; ++I) {
+                Result ^= (unsigned char) Key[I];
+                Result *= 16777619u;
+            }
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHashTable::CHashEntry *CHashTable::Lookup(LPCTSTR Key, size_t Length, unsigned Hash) const {
+            for (auto Entry = m_Buckets[Hash & (m_Capacity - 1)]; Entry != nullptr; Entry = Entry->Next) {
+                if (Entry->Hash == Hash && Entry->Key.Size() == Length && ::memcmp(Entry->Key.Data(), Key, Length) == 0)
+                    return Entry;
+            }
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHashTable::Resize(size_t Capacity) {
+            size_t NewCapacity = m_Capacity;
+            while (NewCapacity < Capacity)
+                NewCapacity <<= 1;
+
+            auto Buckets = new CHashEntry* [NewCapacity]();
+
+            // Walk each chain back to front so equal keys keep their insertion order
+            for (size_t I = 0; I < m_Capacity; ++I) {
+                CHashEntry *Reversed = nullptr;
+                for (auto Entry = m_Buckets[I]; Entry != nullptr; ) {
+                    auto Next = Entry->Next;
+                    Entry->Next = Reversed;
+                    Reversed = Entry;
+                    Entry = Next;
+                }
+                for (auto Entry = Reversed; Entry != nullptr; ) {
+                    auto Next = Entry->Next;
+                    auto &Bucket = Buckets[Entry->Hash & (NewCapacity - 1)];
+                    Entry->Next = Bucket;
+                    Bucket = Entry;
+                    Entry = Next;
+                }
+            }
+
+            delete [] m_Buckets;
+
+            m_Buckets = Buckets;
+            m_Capacity = NewCapacity;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHashTable::Add(const CString &Key, Pointer Value) {
+            if (m_Count >= m_Capacity)
+                Resize(m_Capacity << 1);
+
+            const auto Hash = HashOf(Key);
+            auto &Bucket = m_Buckets[Hash & (m_Capacity - 1)];
+
+            // New values go behind existing ones with the same key
+            auto Entry = new CHashEntry { Key, Value, Hash, nullptr };
+            auto Prev = Lookup(Key.Data(), Key.Size(), Hash);
+            if (Prev == nullptr) {
+                Entry->Next = Bucket;
+                Bucket = Entry;
+            } else {
+                while (Prev->Next != nullptr && Prev->Next->Hash == Hash && Prev->Next->Key == Key)
+                    Prev = Prev->Next;
+                Entry->Next = Prev->Next;
+                Prev->Next = Entry;
+            }
+
+            m_Count++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHashTable::Remove(const CString &Key) {
+            const auto Hash = HashOf(Key);
+            for (auto Link = &m_Buckets[Hash & (m_Capacity - 1)]; *Link != nullptr; Link = &(*Link)->Next) {
+                auto Entry = *Link;
+                if (Entry->Hash == Hash && Entry->Key == Key) {
+                    *Link = Entry->Next;
+                    delete Entry;
+                    m_Count--;
+                    return true;
+                }
+            }
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CHashTable::Remove(const CString &Key, Pointer Value) {
+            const auto Hash = HashOf(Key);
+            for (auto Link = &m_Buckets[Hash & (m_Capacity - 1)]; *Link != nullptr; Link = &(*Link)->Next) {
+                auto Entry = *Link;
+                if (Entry->Value == Value && Entry->Hash == Hash && Entry->Key == Key) {
+                    *Link = Entry->Next;
+                    delete Entry;
+                    m_Count--;
+                    return true;
+                }
+            }
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        Pointer CHashTable::Find(LPCTSTR Key, size_t Length) const {
+            const auto Entry = Lookup(Key, Length, HashOf(Key, Length));
+            return Entry == nullptr ? nullptr : Entry->Value;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CHashTable::FindAll(const CString &Key, CList &List) const {
+            int Result = 0;
+            const auto Hash = HashOf(Key);
+            for (auto Entry = Lookup(Key.Data(), Key.Size(), Hash); Entry != nullptr; Entry = Entry->Next) {
+                if (Entry->Hash != Hash || Entry->Key != Key)
+                    break;
+                List.Add(Entry->Value);
+                Result++;
+            }
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHashTable::Clear() {
+            for (size_t I = 0; I < m_Capacity; ++I) {
+                for (auto Entry = m_Buckets[I]; Entry != nullptr; ) {
+                    auto Next = Entry->Next;
+                    delete Entry;
+                    Entry = Next;
+                }
+                m_Buckets[I] = nullptr;
+            }
+            m_Count = 0;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CFile -----------------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
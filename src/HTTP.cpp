@@ -2201,7 +2201,16 @@ namespace Delphi {
 
             if (!Protocol.IsEmpty())
                 m_Reply.AddHeader("Sec-WebSocket-Protocol", Protocol);
-
+#ifdef WITH_ZLIB
+            if (DeflateOptions().Enabled) {
+                CWebSocketDeflateOptions Agreed;
+                CString Extensions;
+                if (CWebSocketDeflate::Negotiate(m_Request.Headers[_T("Sec-WebSocket-Extensions")], DeflateOptions(), Agreed, Extensions)) {
+                    m_Reply.AddHeader("Sec-WebSocket-Extensions", Extensions);
+                    EnableDeflate(Agreed, true);
+                }
+            }
+#endif
             SendReply();
 
             m_Protocol = pWebSocket;
@@ -2310,10 +2319,25 @@ namespace Delphi {
 
         void CHTTPClientConnection::SwitchingProtocols(CHTTPProtocol Protocol) {
             m_Protocol = Protocol;
+#ifdef WITH_ZLIB
+            if (Protocol == pWebSocket && DeflateOptions().Enabled) {
+                CWebSocketDeflateOptions Agreed;
+                if (CWebSocketDeflate::Accept(m_Reply.Headers[_T("Sec-WebSocket-Extensions")], DeflateOptions(), Agreed)) {
+                    EnableDeflate(Agreed, false);
+                }
+            }
+#endif
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CHTTPClientConnection::SendRequest(bool bSendNow) {
+#ifdef WITH_ZLIB
+            // The WebSocket upgrade request offers permessage-deflate, SwitchingProtocols accepts the answer
+            if (DeflateOptions().Enabled && m_Request.Headers[_T("Upgrade")].Lower() == _T("websocket") &&
+                    m_Request.Headers[_T("Sec-WebSocket-Extensions")].IsEmpty()) {
+                m_Request.AddHeader(_T("Sec-WebSocket-Extensions"), CWebSocketDeflate::Offer(DeflateOptions()));
+            }
+#endif
             m_Request.ToBuffers(OutputBuffer());
 
             m_ConnectionStatus = csRequestReady;
@@ -24,6 +24,10 @@ Author:
 #include "delphi.hpp"
 #include "delphi/JSON.hpp"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define JSON_INVALID_VALUE_TYPE "Invalid JSON value type."
 
 extern "C++" {
@@ -32,11 +36,111 @@ namespace Delphi {
 
     namespace Json {
 
+        static const char JsonDigitPairs[] =
+                "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                "8081828384858687888990919293949596979899";
+
+        /// Table driven: two digits per division. Buffer takes at least 20 characters.
+        static size_t IntegerToJson(int64_t Value, LPTSTR Buffer) {
+            TCHAR Digits[24];
+            LPTSTR P = Digits + sizeof(Digits);
+
+            auto U = Value < 0 ? 0 - (uint64_t) Value : (uint64_t) Value;
+
+            while (U >= 100) {
+                const auto Pair = (size_t) (U % 100) * 2;
+                U /= 100;
+                *--P = JsonDigitPairs[Pair + 1];
+                *--P = JsonDigitPairs[Pair];
+            }
+
+            if (U >= 10) {
+                const auto Pair = (size_t) U * 2;
+                *--P = JsonDigitPairs[Pair + 1];
+                *--P = JsonDigitPairs[Pair];
+            } else {
+                *--P = (TCHAR) ('0' + U);
+            }
+
+            if (Value < 0)
+                *--P = '-';
+
+            const auto Size = (size_t) (Digits + sizeof(Digits) - P);
+            ::memcpy(Buffer, P, Size);
+            return Size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Shortest text that reads back as the same double: integral values take the integer path, the rest the
+        /// first of %.15g, %.16g, %.17g that round-trips. NaN and infinities have no JSON form and become null.
+        /// Buffer takes at least 32 characters.
+        static size_t DoubleToJson(double Value, LPTSTR Buffer) {
+            if (!std::isfinite(Value)) {
+                ::memcpy(Buffer, "null", 4);
+                return 4;
+            }
+
+            if (std::fabs(Value) < 9007199254740992.0 && Value == std::trunc(Value) && !(Value == 0 && std::signbit(Value)))
+                return IntegerToJson((int64_t) Value, Buffer);
+
+            int Size = 0;
+            for (int Precision = 15; Precision <= 17; ++Precision) {
+                Size = ::snprintf(Buffer, 32, "%.*g", Precision, Value);
+                if (Precision == 17 || ::strtod(Buffer, nullptr) == Value)
+                    break;
+            }
+
+            return (size_t) Size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Length of the leading run that goes into a JSON string as is (no quote, backslash or control character),
+        /// sixteen bytes per step with SSE2.
+        static size_t PlainLength(LPCTSTR Value, size_t Size) {
+            size_t Index = 0;
+#ifdef __SSE2__
+            const __m128i Quote = _mm_set1_epi8('"');
+            const __m128i Backslash = _mm_set1_epi8('\\');
+            const __m128i Control = _mm_set1_epi8(0x1F);
+
+            for (; Index + 16 <= Size; Index += 16) {
+                const __m128i Chunk = _mm_loadu_si128((const __m128i *) (Value + Index));
+                const __m128i Special = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(Chunk, Quote), _mm_cmpeq_epi8(Chunk, Backslash)),
+                        _mm_cmpeq_epi8(_mm_min_epu8(Chunk, Control), Chunk));
+
+                const auto Mask = (unsigned) _mm_movemask_epi8(Special);
+                if (Mask != 0)
+                    return Index + __builtin_ctz(Mask);
+            }
+#endif
+            for (; Index < Size; ++Index) {
+                const auto ch = (u_char) Value[Index];
+                if (ch < 0x20 || ch == '"' || ch == '\\')
+                    break;
+            }
+
+            return Index;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         CString EncodeJsonString(const CString &String) {
+            LPCTSTR Data = String.Data();
+            const auto Size = String.Size();
+
+            size_t Index = PlainLength(Data, Size);
+            if (Index == Size)
+                return String;
+
             CString Result;
             TCHAR ch;
-            for (size_t Index = 0; Index < String.Size(); Index++) {
-                ch = String.at(Index);
+
+            if (Index > 0)
+                Result.Append(Data, Index);
+
+            while (Index < Size) {
+                ch = Data[Index++];
                 switch (ch) {
                     case '\r':
                         Result.Append("\\r");
@@ -56,7 +160,14 @@ namespace Delphi {
                         Result.Append(ch);
                         break;
                 }
+
+                const auto Run = PlainLength(Data + Index, Size - Index);
+                if (Run > 0) {
+                    Result.Append(Data + Index, Run);
+                    Index += Run;
+                }
             }
+
             return Result;
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -103,6 +214,554 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CJSONIndexer ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Stage one of the structural parser: classifies 64 bytes at a time (SSE2 when available) and hands out
+        /// positions of { } [ ] : , both string quotes and the first byte of every number or literal.
+        class CJSONIndexer {
+        private:
+
+            typedef struct CBlockMasks {
+                uint64_t Quote;
+                uint64_t Backslash;
+                uint64_t Operator;
+                uint64_t Space;
+                uint64_t Control;
+            } CBlockMasks;
+
+            const u_char *m_pBuffer;
+            size_t m_Size;
+            size_t m_Block;
+
+            uint64_t m_PrevEscaped;
+            uint64_t m_PrevInString;
+            uint64_t m_PrevScalar;
+
+            size_t m_Queue[64];
+            int m_Head;
+            int m_Count;
+
+            bool m_Control;
+
+            static void Classify(const u_char *Block, CBlockMasks &Masks);
+
+            static uint64_t PrefixXor(uint64_t Bits) {
+                Bits ^= Bits << 1;
+                Bits ^= Bits << 2;
+                Bits ^= Bits << 4;
+                Bits ^= Bits << 8;
+                Bits ^= Bits << 16;
+                Bits ^= Bits << 32;
+                return Bits;
+            }
+
+            /// Bits of characters preceded by an odd run of backslashes.
+            uint64_t Escaped(uint64_t Backslash) {
+                const uint64_t EvenBits = UINT64_C(0x5555555555555555);
+
+                Backslash &= ~m_PrevEscaped;
+
+                const uint64_t FollowsEscape = (Backslash << 1) | m_PrevEscaped;
+                const uint64_t OddStarts = Backslash & ~EvenBits & ~FollowsEscape;
+
+                unsigned long long Sequences;
+                m_PrevEscaped = __builtin_uaddll_overflow(OddStarts, Backslash, &Sequences) ? 1 : 0;
+
+                return (EvenBits ^ (Sequences << 1)) & FollowsEscape;
+            }
+
+            bool Fill();
+
+        public:
+
+            CJSONIndexer(LPCTSTR Buffer, size_t Size) {
+                m_pBuffer = (const u_char *) Buffer;
+                m_Size = Size;
+                m_Block = 0;
+                m_PrevEscaped = 0;
+                m_PrevInString = 0;
+                m_PrevScalar = 0;
+                m_Head = 0;
+                m_Count = 0;
+                m_Control = false;
+            }
+
+            /// A raw control character was met inside a string (left to the lenient parser).
+            bool Control() const { return m_Control; }
+
+            bool Next(size_t &Pos) {
+                if (m_Head == m_Count && !Fill())
+                    return false;
+                Pos = m_Queue[m_Head++];
+                return true;
+            }
+
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONIndexer::Classify(const u_char *Block, CBlockMasks &Masks) {
+#ifdef __SSE2__
+            const __m128i Quote = _mm_set1_epi8('"');
+            const __m128i Backslash = _mm_set1_epi8('\\');
+            const __m128i Lower = _mm_set1_epi8(0x20);
+            const __m128i OpenBrace = _mm_set1_epi8('{');
+            const __m128i CloseBrace = _mm_set1_epi8('}');
+            const __m128i Colon = _mm_set1_epi8(':');
+            const __m128i Comma = _mm_set1_epi8(',');
+            const __m128i Space = _mm_set1_epi8(' ');
+            const __m128i Tab = _mm_set1_epi8('\t');
+            const __m128i NewLine = _mm_set1_epi8('\n');
+            const __m128i Return = _mm_set1_epi8('\r');
+            const __m128i Ctl = _mm_set1_epi8(0x1F);
+
+            Masks = {0, 0, 0, 0, 0};
+
+            for (int i = 0; i < 4; ++i) {
+                const __m128i V = _mm_loadu_si128((const __m128i *) (Block + i * 16));
+                // '[' | 0x20 == '{' and ']' | 0x20 == '}'
+                const __m128i Folded = _mm_or_si128(V, Lower);
+
+                const auto Shift = i * 16;
+
+                Masks.Quote |= (uint64_t) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(V, Quote)) << Shift;
+                Masks.Backslash |= (uint64_t) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(V, Backslash)) << Shift;
+
+                const __m128i Op = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(Folded, OpenBrace), _mm_cmpeq_epi8(Folded, CloseBrace)),
+                        _mm_or_si128(_mm_cmpeq_epi8(V, Colon), _mm_cmpeq_epi8(V, Comma)));
+                Masks.Operator |= (uint64_t) (unsigned) _mm_movemask_epi8(Op) << Shift;
+
+                const __m128i WS = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(V, Space), _mm_cmpeq_epi8(V, Tab)),
+                        _mm_or_si128(_mm_cmpeq_epi8(V, NewLine), _mm_cmpeq_epi8(V, Return)));
+                Masks.Space |= (uint64_t) (unsigned) _mm_movemask_epi8(WS) << Shift;
+
+                const __m128i Control = _mm_cmpeq_epi8(_mm_max_epu8(V, Ctl), Ctl);
+                Masks.Control |= (uint64_t) (unsigned) _mm_movemask_epi8(Control) << Shift;
+            }
+#else
+            Masks = {0, 0, 0, 0, 0};
+
+            for (int i = 0; i < 64; ++i) {
+                const u_char C = Block[i];
+                const uint64_t Bit = uint64_t(1) << i;
+
+                switch (C) {
+                    case '"':
+                        Masks.Quote |= Bit;
+                        break;
+                    case '\\':
+                        Masks.Backslash |= Bit;
+                        break;
+                    case '{':
+                    case '}':
+                    case '[':
+                    case ']':
+                    case ':':
+                    case ',':
+                        Masks.Operator |= Bit;
+                        break;
+                    case ' ':
+                        Masks.Space |= Bit;
+                        break;
+                    case '\t':
+                    case '\n':
+                    case '\r':
+                        Masks.Space |= Bit;
+                        Masks.Control |= Bit;
+                        break;
+                    default:
+                        if (C < 0x20)
+                            Masks.Control |= Bit;
+                        break;
+                }
+            }
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CJSONIndexer::Fill() {
+            u_char Tail[64];
+            CBlockMasks Masks = {};
+
+            m_Head = 0;
+            m_Count = 0;
+
+            while (m_Count == 0) {
+                if (m_Block >= m_Size)
+                    return false;
+
+                const u_char *Block = m_pBuffer + m_Block;
+
+                if (m_Size - m_Block < 64) {
+                    ::memset(Tail, ' ', sizeof(Tail));
+                    ::memcpy(Tail, Block, m_Size - m_Block);
+                    Block = Tail;
+                }
+
+                Classify(Block, Masks);
+
+                const uint64_t Quote = Masks.Quote & ~Escaped(Masks.Backslash);
+                const uint64_t InString = PrefixXor(Quote) ^ m_PrevInString;
+                m_PrevInString = (uint64_t) ((int64_t) InString >> 63);
+
+                const uint64_t Content = InString & ~Quote;
+                if (Masks.Control & Content)
+                    m_Control = true;
+
+                const uint64_t Scalar = ~(Masks.Operator | Masks.Space | Quote);
+                const uint64_t ScalarStart = Scalar & ~((Scalar << 1) | m_PrevScalar);
+                m_PrevScalar = Scalar >> 63;
+
+                uint64_t Structurals = ((Masks.Operator | ScalarStart) & ~InString) | Quote;
+
+                while (Structurals != 0) {
+                    m_Queue[m_Count++] = m_Block + __builtin_ctzll(Structurals);
+                    Structurals &= Structurals - 1;
+                }
+
+                m_Block += 64;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static bool IsJsonNumber(LPCTSTR P, LPCTSTR End) {
+            const auto IsDigit = [](TCHAR C) { return C >= '0' && C <= '9'; };
+
+            if (P < End && *P == '-')
+                P++;
+
+            if (P < End && *P == '0') {
+                P++;
+            } else {
+                if (P == End || !IsDigit(*P))
+                    return false;
+                while (P < End && IsDigit(*P)) P++;
+            }
+
+            if (P < End && *P == '.') {
+                LPCTSTR Digits = ++P;
+                while (P < End && IsDigit(*P)) P++;
+                if (P == Digits)
+                    return false;
+            }
+
+            if (P < End && (*P == 'e' || *P == 'E')) {
+                P++;
+                if (P < End && (*P == '+' || *P == '-'))
+                    P++;
+                LPCTSTR Digits = P;
+                while (P < End && IsDigit(*P)) P++;
+                if (P == Digits)
+                    return false;
+            }
+
+            return P == End;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Stage two: builds the tree from the structural positions. Returns false on anything unexpected, the
+        /// caller then runs CJSONParser over the same text so that its behaviour and error reports are kept.
+        static bool StructuralParse(CJSON &Json, LPCTSTR Buffer, size_t Size) {
+            enum { psObjectFirst, psObjectKey, psArrayFirst, psArrayValue, psAfterValue } State;
+
+            CJSONIndexer Indexer(Buffer, Size);
+            CList Stack;
+
+            size_t Pos, Close;
+
+            const auto Top = [&Stack]() { return (CJSON *) Stack.Last(); };
+
+            if (!Indexer.Next(Pos))
+                return false;
+
+            if (Buffer[Pos] == '{') {
+                Stack.Add(Json.GetObject());
+                State = psObjectFirst;
+            } else if (Buffer[Pos] == '[') {
+                Stack.Add(Json.GetArray());
+                State = psArrayFirst;
+            } else {
+                return false;
+            }
+
+            while (Stack.Count() > 0) {
+                if (!Indexer.Next(Pos))
+                    return false;
+
+                TCHAR C = Buffer[Pos];
+
+                if (State == psAfterValue) {
+                    if (C == ',') {
+                        State = Top()->IsObject() ? psObjectKey : psArrayValue;
+                        continue;
+                    }
+                    if ((C == '}' && Top()->IsObject()) || (C == ']' && Top()->IsArray())) {
+                        Stack.Delete(Stack.Count() - 1);
+                        continue;
+                    }
+                    return false;
+                }
+
+                if ((State == psObjectFirst && C == '}') || (State == psArrayFirst && C == ']')) {
+                    Stack.Delete(Stack.Count() - 1);
+                    State = psAfterValue;
+                    continue;
+                }
+
+                CJSONValue *pValue = nullptr;
+
+                if (State == psObjectFirst || State == psObjectKey) {
+                    if (C != '"' || !Indexer.Next(Close))
+                        return false;
+
+                    // Escaped names are kept as written by CJSONParser, leave them to it
+                    if (::memchr(Buffer + Pos + 1, '\\', Close - Pos - 1) != nullptr)
+                        return false;
+
+                    auto &Object = *(CJSONObject *) Top();
+
+                    Object.Add(CJSONMember());
+                    auto &Member = Object.Last();
+                    if (Close > Pos + 1)
+                        Member.String().Append(Buffer + Pos + 1, Close - Pos - 1);
+
+                    if (!Indexer.Next(Pos) || Buffer[Pos] != ':' || !Indexer.Next(Pos))
+                        return false;
+
+                    C = Buffer[Pos];
+                    pValue = &Member.Value();
+                }
+
+                CJSONValueType ValueType;
+                LPCTSTR Data = Buffer + Pos;
+                size_t Length = 0;
+
+                switch (C) {
+                    case '{':
+                        ValueType = jvtObject;
+                        break;
+                    case '[':
+                        ValueType = jvtArray;
+                        break;
+                    case '"':
+                        if (!Indexer.Next(Close))
+                            return false;
+                        ValueType = jvtString;
+                        Data++;
+                        Length = Close - Pos - 1;
+                        break;
+                    default: {
+                        size_t End = Pos;
+                        while (End < Size && !CJSONParser::IsDelimiter((u_char) Buffer[End]))
+                            End++;
+
+                        Length = End - Pos;
+
+                        if (Length == 4 && ::strncmp(Data, "true", 4) == 0) {
+                            ValueType = jvtBoolean;
+                        } else if (Length == 5 && ::strncmp(Data, "false", 5) == 0) {
+                            ValueType = jvtBoolean;
+                        } else if (Length == 4 && ::strncmp(Data, "null", 4) == 0) {
+                            ValueType = jvtNull;
+                        } else if (IsJsonNumber(Data, Data + Length)) {
+                            ValueType = jvtNumber;
+                        } else {
+                            return false;
+                        }
+                        break;
+                    }
+                }
+
+                if (pValue == nullptr) {
+                    auto &Array = *(CJSONArray *) Top();
+                    Array.Add(CJSONValue(ValueType));
+                    pValue = &Array.Last();
+                    if (ValueType == jvtObject || ValueType == jvtArray)
+                        Stack.Add(pValue->Value());
+                } else if (ValueType == jvtObject) {
+                    Stack.Add(pValue->GetObject());
+                } else if (ValueType == jvtArray) {
+                    Stack.Add(pValue->GetArray());
+                } else {
+                    pValue->ValueType(ValueType);
+                }
+
+                if (ValueType == jvtObject) {
+                    State = psObjectFirst;
+                } else if (ValueType == jvtArray) {
+                    State = psArrayFirst;
+                } else {
+                    if (Length > 0)
+                        pValue->Data().Append(Data, Length);
+                    if (ValueType == jvtNumber || ValueType == jvtBoolean)
+                        pValue->Resolve();
+                    State = psAfterValue;
+                }
+            }
+
+            // Only whitespace may follow the top-level value
+            if (Indexer.Next(Pos))
+                return false;
+
+            return !Indexer.Control();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONArena ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        static thread_local CJSONArena *GCurrentArena = nullptr;
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONArena::CJSONArena(size_t BlockSize): CObject(), CHeapComponent() {
+            m_pBlocks = nullptr;
+            m_pSpare = nullptr;
+            m_pPos = nullptr;
+            m_pEnd = nullptr;
+            m_BlockSize = BlockSize < 1024 ? 1024 : BlockSize;
+            m_Allocated = 0;
+            m_Live = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONArena::~CJSONArena() {
+            if (GCurrentArena == this)
+                GCurrentArena = nullptr;
+
+            FreeBlocks(m_pBlocks);
+            FreeBlocks(m_pSpare);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONArena::FreeBlocks(CBlock *&Blocks) {
+            while (Blocks != nullptr) {
+                auto Next = Blocks->Next;
+                m_Allocated -= Blocks->Size;
+                GHeap->Free(0, Blocks, Blocks->Size);
+                Blocks = Next;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        Pointer CJSONArena::Alloc(size_t Size) {
+            Size = (Size + 7) & ~(size_t) 7;
+
+            if (Size <= (size_t) (m_pEnd - m_pPos)) {
+                auto P = m_pPos;
+                m_pPos += Size;
+                return P;
+            }
+
+            CBlock *Block;
+
+            if (Size > m_BlockSize / 4) {
+                // Oversized: a block of its own, the current one stays open
+                Block = (CBlock *) GHeap->Alloc(0, sizeof(CBlock) + Size);
+                Block->Size = sizeof(CBlock) + Size;
+                m_Allocated += Block->Size;
+
+                Block->Next = m_pBlocks;
+                m_pBlocks = Block;
+
+                return Block + 1;
+            }
+
+            if (m_pSpare != nullptr) {
+                Block = m_pSpare;
+                m_pSpare = Block->Next;
+            } else {
+                Block = (CBlock *) GHeap->Alloc(0, m_BlockSize);
+                Block->Size = m_BlockSize;
+                m_Allocated += m_BlockSize;
+            }
+
+            Block->Next = m_pBlocks;
+            m_pBlocks = Block;
+
+            m_pPos = (char *) (Block + 1) + Size;
+            m_pEnd = (char *) Block + Block->Size;
+
+            return Block + 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONArena::Reset() {
+            if (m_Live != 0)
+                throw Delphi::Exception::ExceptionFrm(_T("JSON Arena: %d nodes still alive."), (int) m_Live);
+
+            while (m_pBlocks != nullptr) {
+                auto Block = m_pBlocks;
+                m_pBlocks = Block->Next;
+
+                if (Block->Size == m_BlockSize) {
+                    Block->Next = m_pSpare;
+                    m_pSpare = Block;
+                } else {
+                    m_Allocated -= Block->Size;
+                    GHeap->Free(0, Block, Block->Size);
+                }
+            }
+
+            m_pPos = nullptr;
+            m_pEnd = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONArena *CJSONArena::Current() {
+            return GCurrentArena;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        Pointer CJSONArena::New(size_t Size) {
+            auto Arena = GCurrentArena;
+            Pointer *P;
+
+            if (Arena != nullptr) {
+                P = (Pointer *) Arena->Alloc(sizeof(Pointer) + Size);
+                Arena->m_Live++;
+            } else {
+                P = (Pointer *) ::operator new(sizeof(Pointer) + Size);
+            }
+
+            *P = Arena;
+            return P + 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONArena::Delete(Pointer P) {
+            if (P == nullptr)
+                return;
+
+            auto Base = (Pointer *) P - 1;
+            auto Arena = (CJSONArena *) *Base;
+
+            if (Arena != nullptr)
+                Arena->m_Live--;
+            else
+                ::operator delete(Base);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONArenaGuard::CJSONArenaGuard(CJSONArena *Arena) {
+            m_pPrior = GCurrentArena;
+            if (Arena != nullptr)
+                GCurrentArena = Arena;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONArenaGuard::~CJSONArenaGuard() {
+            GCurrentArena = m_pPrior;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CJSON -----------------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -129,6 +788,7 @@ namespace Delphi {
 
         CJSON::CJSON(CPersistent *AOwner, CJSONValueType ValueType): CPersistent(AOwner), m_ValueType(ValueType) {
             m_Value = nullptr;
+            m_pArena = nullptr;
             m_UpdateCount = 0;
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -175,6 +835,8 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSON::Assign(const CJSON &Source) {
+            CJSONArenaGuard Guard(m_pArena);
+
             Clear();
             m_ValueType = Source.ValueType();
 
@@ -195,6 +857,8 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSON::Concat(const CJSON& Source) {
+            CJSONArenaGuard Guard(m_pArena);
+
             if (Assigned(Source.Value()) && (ValueType() == Source.Value()->ValueType())) {
                 if (Source.Value()->IsObject())
                     GetObject()->Concat(Source.Object());
@@ -276,42 +940,46 @@ namespace Delphi {
         CString CJSON::JsonToString() const {
             CString S;
 
-            if (ValueType() == jvtObject) {
-                S = "{";
-
-                for (int i = 0; i < Count(); i++) {
+            const auto Size = JsonLength(true);
+            if (Size > 0) {
+                S.SetLength(Size);
+                JsonWrite(S.Data(), true);
+            }
 
-                    if (i > 0) {
-                        S += ", ";
-                    }
+            return S;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                    S += "\"";
-                    S += Members(i).String();
-                    S += "\": ";
+        size_t CJSON::JsonLength(bool Spaced) const {
+            if (IsObject() || IsArray()) {
+                if (m_Value != nullptr && m_Value != this)
+                    return m_Value->JsonLength(Spaced);
+                return 2;
+            }
 
-                    S << Object()[i].ToString();
-                }
+            return 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                S += "}";
+        LPTSTR CJSON::JsonWrite(LPTSTR Buffer, bool Spaced) const {
+            if (IsObject() || IsArray()) {
+                if (m_Value != nullptr && m_Value != this)
+                    return m_Value->JsonWrite(Buffer, Spaced);
+                *Buffer++ = IsObject() ? '{' : '[';
+                *Buffer++ = IsObject() ? '}' : ']';
             }
 
-            if (IsArray()) {
-
-                S = "[";
+            return Buffer;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                for (int i = 0; i < Count(); i++) {
-
-                    if (i > 0) {
-                        S += ", ";
-                    }
-
-                    S << Array()[i].ToString();
-                }
-
-                S += "]";
-            }
+        const CJSON *CJSON::Find(const CJSONPointer &Pointer) const {
+            return Pointer.Find(*this);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            return S;
+        CJSON *CJSON::Find(const CJSONPointer &Pointer) {
+            return Pointer.Find(*this);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -335,12 +1003,20 @@ namespace Delphi {
 
         void CJSON::StrToJson(LPCTSTR ABuffer, size_t ASize) {
 
+            CJSONArenaGuard Guard(m_pArena);
             CJSONParser pParser(this);
             CJSONParserResult R;
 
             BeginUpdate();
             try {
                 if (Assigned(ABuffer)) {
+                    Clear();
+
+                    if (StructuralParse(*this, ABuffer, ASize)) {
+                        EndUpdate();
+                        return;
+                    }
+
                     Clear();
                     R = pParser.Parse((LPTSTR) ABuffer, ABuffer + ASize);
                     if (!R.result) {
@@ -653,22 +1329,36 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CString CJSONElements::JsonToString() const {
-            CString S;
+        size_t CJSONElements::JsonLength(bool Spaced) const {
+            const auto Count = this->Count();
+
+            size_t Size = 2;
+            if (Count > 1)
+                Size += (Count - 1) * (Spaced ? 2 : 1);
+
+            for (int i = 0; i < Count; i++)
+                Size += Values(i).JsonLength(Spaced);
 
-            S += "[";
+            return Size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPTSTR CJSONElements::JsonWrite(LPTSTR Buffer, bool Spaced) const {
+            *Buffer++ = '[';
 
             for (int i = 0; i < Count(); i++) {
                 if (i > 0) {
-                    S += ", ";
+                    *Buffer++ = ',';
+                    if (Spaced)
+                        *Buffer++ = ' ';
                 }
 
-                S << Values(i).ToString();
+                Buffer = Values(i).JsonWrite(Buffer, Spaced);
             }
 
-            S += "]";
+            *Buffer++ = ']';
 
-            return S;
+            return Buffer;
         }
 
         //--------------------------------------------------------------------------------------------------------------
@@ -754,27 +1444,51 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CString CJSONMembers::JsonToString() const {
-            CString S;
+        size_t CJSONMembers::JsonLength(bool Spaced) const {
+            const auto Count = this->Count();
+
+            size_t Size = 2;
+            if (Count > 1)
+                Size += (Count - 1) * (Spaced ? 2 : 1);
+
+            for (int i = 0; i < Count; i++) {
+                const auto &Member = Members(i);
+                Size += Member.String().Size() + (Spaced ? 4 : 3) + Member.Value().JsonLength(Spaced);
+            }
 
-            S = "{";
+            return Size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPTSTR CJSONMembers::JsonWrite(LPTSTR Buffer, bool Spaced) const {
+            *Buffer++ = '{';
 
             for (int i = 0; i < Count(); i++) {
+                const auto &Member = Members(i);
+                const auto &Name = Member.String();
 
                 if (i > 0) {
-                    S += ", ";
+                    *Buffer++ = ',';
+                    if (Spaced)
+                        *Buffer++ = ' ';
                 }
 
-                S += "\"";
-                S += Members(i).String();
-                S += "\": ";
+                *Buffer++ = '"';
+                if (Name.Size() > 0) {
+                    ::memcpy(Buffer, Name.Data(), Name.Size());
+                    Buffer += Name.Size();
+                }
+                *Buffer++ = '"';
+                *Buffer++ = ':';
+                if (Spaced)
+                    *Buffer++ = ' ';
 
-                S << Members(i).Value().ToString();
+                Buffer = Member.Value().JsonWrite(Buffer, Spaced);
             }
 
-            S += "}";
+            *Buffer++ = '}';
 
-            return S;
+            return Buffer;
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1154,6 +1868,12 @@ namespace Delphi {
         void CJSONValue::Assign(const CJSONValue &Value) {
             inherited::Assign(Value);
             m_Data = Value.m_Data;
+            m_Typed = Value.m_Typed;
+            m_Boolean = Value.m_Boolean;
+            m_Integer = Value.m_Integer;
+            m_Double = Value.m_Double;
+            if (m_Typed & jtDecoded)
+                m_Decoded = Value.m_Decoded;
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1169,29 +1889,122 @@ namespace Delphi {
 
         void CJSONValue::StringData(const CString &Value) {
             m_Data = EncodeJsonString(Value);
+            m_Decoded = Value;
+            m_Typed = jtDecoded;
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONValue::StringData(CJSONValue::reference AValue) {
             CString Value(AValue);
-            m_Data = EncodeJsonString(Value);
+            StringData(Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const CString &CJSONValue::Text() const {
+            if (m_Typed & jtPending) {
+                TCHAR Buffer[32];
+                const auto Size = m_Typed & jtInteger ? IntegerToJson(m_Integer, Buffer) : DoubleToJson(m_Double, Buffer);
+
+                m_Data.Clear();
+                m_Data.Append(Buffer, Size);
+
+                m_Typed &= ~jtPending;
+            }
+
+            return m_Data;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONValue::Resolve() const {
+            const auto &Text = this->Text();
+
+            if (Text.IsEmpty())
+                return;
+
+            LPCTSTR P = Text.Data();
+            LPCTSTR End = P + Text.Size();
+
+            if (*P == '-' || (*P >= '0' && *P <= '9')) {
+                const bool Negative = *P == '-';
+                LPCTSTR Digit = Negative ? P + 1 : P;
+
+                uint64_t U = 0;
+                while (Digit < End && *Digit >= '0' && *Digit <= '9' && U <= (UINT64_MAX - 9) / 10)
+                    U = U * 10 + (*Digit++ - '0');
+
+                if (Digit == End && Digit > P + (Negative ? 1 : 0) && U <= (uint64_t) INT64_MAX) {
+                    m_Integer = Negative ? -(int64_t) U : (int64_t) U;
+                    m_Double = (double) m_Integer;
+                    m_Typed |= jtInteger | jtDouble;
+                    return;
+                }
+
+                LPTSTR Stop = nullptr;
+                const double Value = ::strtod(P, &Stop);
+                if (Stop == End) {
+                    m_Double = Value;
+                    m_Typed |= jtDouble;
+                }
+
+                return;
+            }
+
+            if (Text == "true" || Text == "false") {
+                m_Boolean = Text.Size() == 4;
+                m_Typed |= jtBoolean;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONValue::AsInteger(int64_t Value) {
+            m_Data.Clear();
+            m_Integer = Value;
+            m_Double = (double) Value;
+            m_Typed = jtInteger | jtDouble | jtPending;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONValue::AsDouble(double Value) {
+            m_Data.Clear();
+            m_Double = Value;
+            m_Typed = jtDouble | jtPending;
         }
         //--------------------------------------------------------------------------------------------------------------
 
         CString CJSONValue::AsString() const {
-            return DecodeJsonString(m_Data);
+            if (m_Typed & jtDecoded)
+                return m_Decoded;
+
+            const auto &Text = this->Text();
+
+            // Nothing to unescape: the text is the value
+            if (Text.IsEmpty() || ::memchr(Text.Data(), '\\', Text.Size()) == nullptr)
+                return Text;
+
+            m_Decoded = DecodeJsonString(Text);
+            m_Typed |= jtDecoded;
+
+            return m_Decoded;
         }
         //--------------------------------------------------------------------------------------------------------------
 
         bool CJSONValue::AsBoolean() const {
+            if (m_Typed & jtBoolean)
+                return m_Boolean;
+
             LPCTSTR LBoolStr[] = ARRAY_BOOLEAN_STRINGS;
 
+            const auto &Text = this->Text();
+
             for (size_t i = 0; i < chARRAY(LBoolStr); ++i) {
-                if (SameText(LBoolStr[i], m_Data.c_str()))
-                    return Odd(i);
+                if (SameText(LBoolStr[i], Text.c_str())) {
+                    m_Boolean = Odd(i);
+                    m_Typed |= jtBoolean;
+                    return m_Boolean;
+                }
             }
 
-            throw EConvertError(_T("Invalid conversion string \"%s\" to boolean value."), m_Data.c_str());
+            throw EConvertError(_T("Invalid conversion string \"%s\" to boolean value."), Text.c_str());
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1240,43 +2053,78 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CString CJSONValue::JsonToString() const {
-            CString S;
-
+        size_t CJSONValue::JsonLength(bool Spaced) const {
             switch (ValueType()) {
                 case jvtObject:
-                    S = AsObject().ToString();
-                    break;
+                case jvtArray:
+                    if (m_Value != nullptr && m_Value != this)
+                        return m_Value->JsonLength(Spaced);
+                    return 2;
+
+                case jvtString:
+                    return Text().Size() + 2;
+
+                case jvtNumber:
+                    return Text().Size();
+
+                case jvtBoolean:
+                    return AsBoolean() ? 4 : 5;
+
+                case jvtNull:
+                    return 4;
+            }
+
+            return 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
+        LPTSTR CJSONValue::JsonWrite(LPTSTR Buffer, bool Spaced) const {
+            switch (ValueType()) {
+                case jvtObject:
                 case jvtArray:
-                    S = AsArray().ToString();
+                    if (m_Value != nullptr && m_Value != this)
+                        return m_Value->JsonWrite(Buffer, Spaced);
+                    *Buffer++ = IsObject() ? '{' : '[';
+                    *Buffer++ = IsObject() ? '}' : ']';
                     break;
 
                 case jvtString:
-                    S = "\"";
-                    S += Data();
-                    S += "\"";
-                    break;
+                case jvtNumber: {
+                    const auto &Value = Text();
+
+                    if (IsString())
+                        *Buffer++ = '"';
+
+                    if (Value.Size() > 0) {
+                        ::memcpy(Buffer, Value.Data(), Value.Size());
+                        Buffer += Value.Size();
+                    }
+
+                    if (IsString())
+                        *Buffer++ = '"';
 
-                case jvtNumber:
-                    S = Data();
                     break;
+                }
 
                 case jvtBoolean:
                     if (AsBoolean()) {
-                        S = "true";
+                        ::memcpy(Buffer, "true", 4);
+                        Buffer += 4;
                     } else {
-                        S = "false";
+                        ::memcpy(Buffer, "false", 5);
+                        Buffer += 5;
                     }
                     break;
 
                 case jvtNull:
-                    S = "null";
+                    ::memcpy(Buffer, "null", 4);
+                    Buffer += 4;
                     break;
             }
 
-            return S;
+            return Buffer;
         }
+        //--------------------------------------------------------------------------------------------------------------
 
         bool CJSONValue::HasOwnProperty(const CString &String) const {
             if (Assigned(m_Value)) {
@@ -1286,7 +2134,7 @@ namespace Delphi {
                     return Array().HasOwnProperty(String);
                 return dynamic_cast<CJSONValue *> (m_Value)->Data() == String;
             }
-            return m_Data == String;
+            return Text() == String;
         }
 
         //--------------------------------------------------------------------------------------------------------------
@@ -1470,6 +2318,7 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         CJSONObject::CJSONObject(CPersistent *AOwner): CJSONMembers(AOwner, jvtObject) {
+            m_pIndex = nullptr;
 
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -1479,6 +2328,61 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CJSONObject::DropIndex() const {
+            delete m_pIndex;
+            m_pIndex = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CJSONObject::FindString(LPCTSTR String, size_t Length) const {
+            const int Count = GetCount();
+
+            if (Count < JSON_OBJECT_INDEX_THRESHOLD) {
+                for (int I = 0; I < Count; ++I) {
+                    const auto &Name = m_pList[I].String();
+                    if (Name.Size() == Length && (Length == 0 || ::memcmp(Name.Data(), String, Length) == 0))
+                        return I;
+                }
+                return -1;
+            }
+
+            for (int Attempt = 0; Attempt < 2; ++Attempt) {
+                if (m_pIndex == nullptr)
+                    m_pIndex = new CHashTable((size_t) Count * 2);
+
+                // Members appended since the last lookup
+                for (auto I = (int) m_pIndex->Count(); I < Count; ++I)
+                    m_pIndex->Add(m_pList[I].String(), (Pointer) (size_t) (I + 1));
+
+                const auto Found = (size_t) m_pIndex->Find(String, Length);
+                if (Found == 0)
+                    return -1;
+
+                const auto I = (int) Found - 1;
+                if (I < Count) {
+                    const auto &Name = m_pList[I].String();
+                    if (Name.Size() == Length && (Length == 0 || ::memcmp(Name.Data(), String, Length) == 0))
+                        return I;
+                }
+
+                // Renamed in place without Update(): rebuild once
+                DropIndex();
+            }
+
+            return -1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CJSONObject::IndexOfString(const CString &String) const {
+            return FindString(String.Data(), String.Size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CJSONObject::IndexOfString(reference String) const {
+            return FindString(String, String == nullptr ? 0 : ::strlen(String));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         const CString &CJSONObject::GetString(int Index) const {
             if ((Index < 0) || (Index >= GetCount()))
                 throw ExceptionFrm(SListIndexError, Index);
@@ -1547,10 +2451,42 @@ namespace Delphi {
             if ((Index < 0) || (Index >= GetCount()))
                 throw ExceptionFrm(SListIndexError, Index);
 
+            if (m_pIndex != nullptr && m_pList[Index].String() != Value.String())
+                DropIndex();
+
             m_pList[Index] = Value;
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CJSONObject::ReplacePair(int Index, LPCTSTR String, size_t Length, const CJSONValue &Value) {
+            if ((Index < 0) || (Index >= GetCount()))
+                throw ExceptionFrm(SListIndexError, Index);
+
+            auto &Member = m_pList[Index];
+            auto &Name = Member.String();
+
+            // Same name keeps the position and therefore the index
+            if (Name.Size() != Length || (Length != 0 && ::memcmp(Name.Data(), String, Length) != 0)) {
+                DropIndex();
+                Name.Clear();
+                if (Length > 0)
+                    Name.Append(String, Length);
+            }
+
+            Member.Value() = Value;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONObject::PutPair(int Index, const CString &String, const CJSONValue &Value) {
+            ReplacePair(Index, String.Data(), String.Size(), Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONObject::PutPair(int Index, reference String, const CJSONValue &Value) {
+            ReplacePair(Index, String, String == nullptr ? 0 : ::strlen(String), Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         int CJSONObject::Add(const CJSONMember &Value) {
             return m_pList.Add(Value);
         }
@@ -1642,105 +2578,121 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::Insert(int Index, const CJSONMember &Value) {
+            DropIndex();
             return m_pList.Insert(Index, Value);
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, const CJSONMembers &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, const CJSONMembers &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, const CJSONElements &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, const CJSONElements &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, const CJSONValue &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, const CJSONValue &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, const CString &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, const CString &Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, reference Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, reference Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, bool Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, bool Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, int Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, int Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, float Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, float Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, const CString &String, double Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::InsertPair(int Index, reference String, double Value) {
+            DropIndex();
             m_pList.Insert(Index, CJSONMember(String, Value));
         }
         //--------------------------------------------------------------------------------------------------------------
 
         bool CJSONObject::HasOwnProperty(const CString &String) const {
-            int Index = 0;
-            while (Index < GetCount() && Get(Index).String() != String)
-                Index++;
-            return Index != GetCount();
+            return IndexOfString(String) != -1;
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1760,16 +2712,25 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::Clear() {
+            DropIndex();
             m_pList.Clear();
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::Update(int Index) {
-
+            DropIndex();
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CJSONObject::Delete(int Index) {
+            if (m_pIndex != nullptr) {
+                // Only removing the last member keeps the other positions
+                if (Index == GetCount() - 1 && (int) m_pIndex->Count() == GetCount())
+                    m_pIndex->Remove(m_pList[Index].String(), (Pointer) (size_t) (Index + 1));
+                else
+                    DropIndex();
+            }
+
             m_pList.Delete(Index);
         }
 
@@ -2179,6 +3140,1032 @@ namespace Delphi {
                     return false;
             }
         }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONWriter -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter::CJSONWriter(CMemoryStream &Stream): m_Stream(Stream) {
+            m_Filled = 0;
+            m_Depth = 0;
+            m_AfterKey = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Separator() {
+            if (m_AfterKey) {
+                m_AfterKey = false;
+                return;
+            }
+
+            if (m_Depth > 0) {
+                const uint64_t Bit = uint64_t(1) << (m_Depth - 1);
+                if (m_Filled & Bit)
+                    Put(',');
+                else
+                    m_Filled |= Bit;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Open(TCHAR C) {
+            if (m_Depth == JSON_WRITER_MAX_DEPTH)
+                throw Delphi::Exception::Exception(_T("JSON Writer: nesting too deep."));
+
+            Separator();
+            Put(C);
+
+            m_Filled &= ~(uint64_t(1) << m_Depth);
+            m_Depth++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Close(TCHAR C) {
+            if (m_Depth == 0 || m_AfterKey)
+                throw Delphi::Exception::ExceptionFrm(_T("JSON Writer: unbalanced \"%c\"."), C);
+
+            m_Depth--;
+            Put(C);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONWriter::Quoted(LPCTSTR Value, size_t Size) {
+            static const TCHAR Hex[] = _T("0123456789abcdef");
+
+            LPCTSTR P = Value;
+            LPCTSTR End = Value + Size;
+            TCHAR Escape[6] = { '\\', 'u', '0', '0', 0, 0 };
+
+            Put('"');
+
+            while (P < End) {
+                const auto Run = PlainLength(P, End - P);
+                if (Run > 0) {
+                    Put(P, Run);
+                    P += Run;
+                    if (P == End)
+                        break;
+                }
+
+                const auto ch = (u_char) *P++;
+
+                switch (ch) {
+                    case '"':
+                        Put(_T("\\\""), 2);
+                        break;
+                    case '\\':
+                        Put(_T("\\\\"), 2);
+                        break;
+                    case '\r':
+                        Put(_T("\\r"), 2);
+                        break;
+                    case '\n':
+                        Put(_T("\\n"), 2);
+                        break;
+                    case '\t':
+                        Put(_T("\\t"), 2);
+                        break;
+                    case '\b':
+                        Put(_T("\\b"), 2);
+                        break;
+                    case '\f':
+                        Put(_T("\\f"), 2);
+                        break;
+                    default:
+                        Escape[4] = Hex[ch >> 4];
+                        Escape[5] = Hex[ch & 0x0F];
+                        Put(Escape, sizeof(Escape));
+                        break;
+                }
+            }
+
+            Put('"');
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::BeginObject() {
+            Open('{');
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::EndObject() {
+            Close('}');
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::BeginArray() {
+            Open('[');
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::EndArray() {
+            Close(']');
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Key(LPCTSTR Name, size_t Size) {
+            Separator();
+            Quoted(Name, Size);
+            Put(':');
+            m_AfterKey = true;
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::String(LPCTSTR Value, size_t Size) {
+            Separator();
+            Quoted(Value, Size);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Integer(long Value) {
+            TCHAR Buffer[24];
+            const auto Size = IntegerToJson(Value, Buffer);
+
+            Separator();
+            Put(Buffer, Size);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Number(double Value) {
+            TCHAR Buffer[32];
+            const auto Size = DoubleToJson(Value, Buffer);
+
+            Separator();
+            Put(Buffer, Size);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Boolean(bool Value) {
+            Separator();
+            if (Value)
+                Put(_T("true"), 4);
+            else
+                Put(_T("false"), 5);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Null() {
+            Separator();
+            Put(_T("null"), 4);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Raw(LPCTSTR Value, size_t Size) {
+            if (Size == 0)
+                return Null();
+            Separator();
+            Put(Value, Size);
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONWriter &CJSONWriter::Value(const CJSON &Json) {
+            const auto Size = Json.JsonLength(false);
+            if (Size == 0)
+                return Null();
+
+            Separator();
+
+            const auto Position = (size_t) m_Stream.Position();
+            if (Position + Size > (size_t) m_Stream.Size())
+                m_Stream.SetSize(Position + Size);
+
+            Json.JsonWrite((LPTSTR) m_Stream.Memory() + Position, false);
+            m_Stream.Position((off_t) (Position + Size));
+
+            return *this;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONReader -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define JSON_READER_SYNTAX_ERROR "JSON Reader syntax error in position %d, char: %#x"
+
+        #define JSON_ONES  UINT64_C(0x0101010101010101)
+        #define JSON_HIGHS UINT64_C(0x8080808080808080)
+
+        /// True if all 8 bytes are printable ASCII other than '"' and '\\'.
+        inline static bool PlainWord(uint64_t W) {
+            const uint64_t Quote = W ^ (JSON_ONES * '"');
+            const uint64_t Slash = W ^ (JSON_ONES * '\\');
+            const uint64_t Bad = (W & JSON_HIGHS) | ((W - JSON_ONES * 0x20) & ~W & JSON_HIGHS) |
+                                 ((Quote - JSON_ONES) & ~Quote & JSON_HIGHS) | ((Slash - JSON_ONES) & ~Slash & JSON_HIGHS);
+            return Bad == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline static int HexValue(u_char C) {
+            if (C >= '0' && C <= '9') return C - '0';
+            if (C >= 'a' && C <= 'f') return C - 'a' + 10;
+            if (C >= 'A' && C <= 'F') return C - 'A' + 10;
+            return -1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Four hex digits at P, or -1.
+        inline static int HexCode(LPCTSTR P) {
+            int Result = 0;
+            for (int i = 0; i < 4; ++i) {
+                const int V = HexValue((u_char) P[i]);
+                if (V < 0)
+                    return -1;
+                Result = (Result << 4) | V;
+            }
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Length of the UTF-8 sequence at P (0 - invalid, -1 - cut off by End).
+        inline static int Utf8Length(const u_char *P, const u_char *End) {
+            const u_char C = *P;
+            int Length;
+            u_char Min = 0x80, Max = 0xBF;
+
+            if (C >= 0xC2 && C <= 0xDF) {
+                Length = 2;
+            } else if (C >= 0xE0 && C <= 0xEF) {
+                Length = 3;
+                if (C == 0xE0) Min = 0xA0;
+                if (C == 0xED) Max = 0x9F;
+            } else if (C >= 0xF0 && C <= 0xF4) {
+                Length = 4;
+                if (C == 0xF0) Min = 0x90;
+                if (C == 0xF4) Max = 0x8F;
+            } else {
+                return 0;
+            }
+
+            for (int i = 1; i < Length; ++i) {
+                if (P + i >= End)
+                    return -1;
+                const u_char N = P[i];
+                if (i == 1 ? (N < Min || N > Max) : (N < 0x80 || N > 0xBF))
+                    return 0;
+            }
+
+            return Length;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        inline static void AppendUtf8(CString &S, unsigned Code) {
+            if (Code < 0x80) {
+                S.Append((TCHAR) Code);
+            } else if (Code < 0x800) {
+                S.Append((TCHAR) (0xC0 | (Code >> 6)));
+                S.Append((TCHAR) (0x80 | (Code & 0x3F)));
+            } else if (Code < 0x10000) {
+                S.Append((TCHAR) (0xE0 | (Code >> 12)));
+                S.Append((TCHAR) (0x80 | ((Code >> 6) & 0x3F)));
+                S.Append((TCHAR) (0x80 | (Code & 0x3F)));
+            } else {
+                S.Append((TCHAR) (0xF0 | (Code >> 18)));
+                S.Append((TCHAR) (0x80 | ((Code >> 12) & 0x3F)));
+                S.Append((TCHAR) (0x80 | ((Code >> 6) & 0x3F)));
+                S.Append((TCHAR) (0x80 | (Code & 0x3F)));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONReader::CJSONReader() {
+            m_pBuffer = nullptr;
+            m_Capacity = 0;
+            Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONReader::~CJSONReader() {
+            if (m_pBuffer != nullptr)
+                GHeap->Free(0, m_pBuffer, m_Capacity);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONReader::Clear() {
+            m_State = rsValue;
+            m_Size = 0;
+            m_Pos = 0;
+            m_Offset = 0;
+            m_Scan = 0;
+            m_Escaped = false;
+            m_Finished = false;
+            m_Depth = 0;
+            m_SkipDepth = -1;
+            m_SkipReport = false;
+            m_Event = jeNone;
+            m_Value.Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONReader::SyntaxError(size_t Pos) const {
+            throw Exception::EJSONParseSyntaxError(_T(JSON_READER_SYNTAX_ERROR), (int) (m_Offset + Pos),
+                                                   Pos < m_Size ? (u_char) m_pBuffer[Pos] : 0);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONReader::Feed(LPCTSTR Data, size_t Size) {
+            if (Size == 0)
+                return;
+
+            if (m_Pos > 0) {
+                m_Size -= m_Pos;
+                if (m_Size > 0)
+                    ::MoveMemory(m_pBuffer, m_pBuffer + m_Pos, m_Size);
+                m_Offset += m_Pos;
+                m_Pos = 0;
+            }
+
+            if (m_Size + Size > m_Capacity) {
+                size_t Capacity = m_Capacity == 0 ? 4096 : m_Capacity;
+                while (Capacity < m_Size + Size)
+                    Capacity <<= 1;
+
+                if (m_pBuffer == nullptr)
+                    m_pBuffer = (LPTSTR) GHeap->Alloc(0, Capacity);
+                else
+                    m_pBuffer = (LPTSTR) GHeap->ReAlloc(0, m_pBuffer, Capacity, m_Capacity);
+
+                m_Capacity = Capacity;
+            }
+
+            ::CopyMemory(m_pBuffer + m_Size, Data, Size);
+            m_Size += Size;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CJSONReader::ScanString(size_t &Pos) {
+            const auto Begin = (const u_char *) m_pBuffer + Pos;
+            const auto End = (const u_char *) m_pBuffer + m_Size;
+
+            auto P = Begin + (m_Scan == 0 ? 1 : m_Scan);
+
+            while (true) {
+                while (End - P >= 8) {
+                    uint64_t W;
+                    ::memcpy(&W, P, 8);
+                    if (!PlainWord(W))
+                        break;
+                    P += 8;
+                }
+
+                if (P == End)
+                    break;
+
+                const u_char C = *P;
+
+                if (C == '"') {
+                    Pos = P + 1 - (const u_char *) m_pBuffer;
+                    m_Scan = 0;
+                    return 1;
+                }
+
+                if (C == '\\') {
+                    if (End - P < 2)
+                        break;
+
+                    switch (P[1]) {
+                        case '"':
+                        case '\\':
+                        case '/':
+                        case 'b':
+                        case 'f':
+                        case 'n':
+                        case 'r':
+                        case 't':
+                            P += 2;
+                            break;
+                        case 'u': {
+                            if (End - P < 6)
+                                goto need_more;
+                            const int Code = HexCode((LPCTSTR) P + 2);
+                            if (Code < 0 || (Code >= 0xDC00 && Code <= 0xDFFF))
+                                SyntaxError(P - (const u_char *) m_pBuffer);
+                            if (Code >= 0xD800 && Code <= 0xDBFF) {
+                                if (End - P < 12)
+                                    goto need_more;
+                                const int Low = P[6] == '\\' && P[7] == 'u' ? HexCode((LPCTSTR) P + 8) : -1;
+                                if (Low < 0xDC00 || Low > 0xDFFF)
+                                    SyntaxError(P + 6 - (const u_char *) m_pBuffer);
+                                P += 12;
+                            } else {
+                                P += 6;
+                            }
+                            break;
+                        }
+                        default:
+                            SyntaxError(P + 1 - (const u_char *) m_pBuffer);
+                    }
+
+                    m_Escaped = true;
+                    continue;
+                }
+
+                if (C < 0x20)
+                    SyntaxError(P - (const u_char *) m_pBuffer);
+
+                if (C < 0x80) {
+                    P++;
+                    continue;
+                }
+
+                const int Length = Utf8Length(P, End);
+                if (Length < 0)
+                    break;
+                if (Length == 0)
+                    SyntaxError(P - (const u_char *) m_pBuffer);
+
+                P += Length;
+            }
+
+        need_more:
+            if (m_Finished)
+                SyntaxError(m_Size);
+
+            m_Scan = P - Begin;
+            return 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CJSONReader::ScanNumber(size_t &Pos) {
+            LPCTSTR P = m_pBuffer + Pos;
+            LPCTSTR End = m_pBuffer + m_Size;
+
+            const auto IsDigit = [](TCHAR C) { return C >= '0' && C <= '9'; };
+
+            // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+            if (*P == '-')
+                P++;
+
+            if (P < End && *P == '0') {
+                P++;
+            } else if (P < End && IsDigit(*P)) {
+                while (P < End && IsDigit(*P)) P++;
+            } else if (P < End) {
+                SyntaxError(P - m_pBuffer);
+            }
+
+            if (P < End && *P == '.') {
+                LPCTSTR Digits = ++P;
+                while (P < End && IsDigit(*P)) P++;
+                if (P < End && P == Digits)
+                    SyntaxError(P - m_pBuffer);
+            }
+
+            if (P < End && (*P == 'e' || *P == 'E')) {
+                P++;
+                if (P < End && (*P == '+' || *P == '-'))
+                    P++;
+                LPCTSTR Digits = P;
+                while (P < End && IsDigit(*P)) P++;
+                if (P < End && P == Digits)
+                    SyntaxError(P - m_pBuffer);
+            }
+
+            if (P == End) {
+                if (!m_Finished)
+                    return 0;
+                const TCHAR Last = *(P - 1);
+                if (!IsDigit(Last))
+                    SyntaxError(m_Size);
+            }
+
+            m_Value.Clear();
+            m_Value.Append(m_pBuffer + Pos, P - m_pBuffer - Pos);
+
+            Pos = P - m_pBuffer;
+            return 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CJSONReader::ScanLiteral(size_t &Pos, LPCTSTR Literal, size_t Length) {
+            const size_t Count = Length < m_Size - Pos ? Length : m_Size - Pos;
+
+            if (::strncmp(m_pBuffer + Pos, Literal, Count) != 0)
+                SyntaxError(Pos);
+
+            if (Count < Length) {
+                if (m_Finished)
+                    SyntaxError(m_Size);
+                return 0;
+            }
+
+            m_Value.Clear();
+            m_Value.Append(Literal, Length);
+
+            Pos += Length;
+            return 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONReader::DecodeString(LPCTSTR Begin, LPCTSTR End) {
+            m_Value.Clear();
+
+            if (!m_Escaped) {
+                if (End > Begin)
+                    m_Value.Append(Begin, End - Begin);
+                return;
+            }
+
+            LPCTSTR Run = Begin;
+            for (LPCTSTR P = Begin; P < End; ++P) {
+                if (*P != '\\')
+                    continue;
+
+                if (P > Run)
+                    m_Value.Append(Run, P - Run);
+
+                P++;
+                switch (*P) {
+                    case 'b': m_Value.Append('\b'); break;
+                    case 'f': m_Value.Append('\f'); break;
+                    case 'n': m_Value.Append('\n'); break;
+                    case 'r': m_Value.Append('\r'); break;
+                    case 't': m_Value.Append('\t'); break;
+                    case 'u': {
+                        unsigned Code = HexCode(P + 1);
+                        P += 4;
+                        if (Code >= 0xD800 && Code <= 0xDBFF) {
+                            Code = 0x10000 + ((Code - 0xD800) << 10) + (HexCode(P + 3) - 0xDC00);
+                            P += 6;
+                        }
+                        AppendUtf8(m_Value, Code);
+                        break;
+                    }
+                    default:
+                        m_Value.Append(*P);
+                        break;
+                }
+
+                Run = P + 1;
+            }
+
+            if (End > Run)
+                m_Value.Append(Run, End - Run);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONEvent CJSONReader::Push(unsigned char C) {
+            if (m_Depth == JSON_READER_MAX_DEPTH)
+                SyntaxError(m_Pos);
+
+            m_Stack[m_Depth++] = C;
+            m_Pos++;
+
+            if (C == '{') {
+                m_State = rsFirstKey;
+                return jeStartObject;
+            }
+
+            m_State = rsFirstValue;
+            return jeStartArray;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONEvent CJSONReader::Pop(unsigned char C) {
+            if (m_Depth == 0 || (C == '}') != (m_Stack[m_Depth - 1] == '{'))
+                SyntaxError(m_Pos);
+
+            m_Depth--;
+            m_Pos++;
+
+            AfterValue();
+
+            return C == '}' ? jeEndObject : jeEndArray;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONReader::AfterValue() {
+            m_State = m_Depth == 0 ? rsDone : rsComma;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONEvent CJSONReader::Read() {
+            while (true) {
+                while (m_Pos < m_Size) {
+                    const TCHAR C = m_pBuffer[m_Pos];
+                    if (C != ' ' && C != '\t' && C != '\n' && C != '\r')
+                        break;
+                    m_Pos++;
+                }
+
+                if (m_Pos == m_Size) {
+                    if (!m_Finished)
+                        return jeNeedMore;
+                    if (m_State != rsDone)
+                        SyntaxError(m_Pos);
+                    return jeEnd;
+                }
+
+                const TCHAR C = m_pBuffer[m_Pos];
+
+                switch (m_State) {
+                    case rsDone:
+                        SyntaxError(m_Pos);
+
+                    case rsColon:
+                        if (C != ':')
+                            SyntaxError(m_Pos);
+                        m_Pos++;
+                        m_State = rsValue;
+                        continue;
+
+                    case rsComma:
+                        if (C == '}' || C == ']')
+                            return Pop(C);
+                        if (C != ',')
+                            SyntaxError(m_Pos);
+                        m_Pos++;
+                        m_State = m_Stack[m_Depth - 1] == '{' ? rsKey : rsValue;
+                        continue;
+
+                    case rsFirstKey:
+                        if (C == '}')
+                            return Pop(C);
+                        // fallthrough
+                    case rsKey: {
+                        if (C != '"')
+                            SyntaxError(m_Pos);
+
+                        size_t Pos = m_Pos;
+                        if (m_Scan == 0)
+                            m_Escaped = false;
+                        if (ScanString(Pos) == 0)
+                            return jeNeedMore;
+
+                        if (m_SkipDepth == -1)
+                            DecodeString(m_pBuffer + m_Pos + 1, m_pBuffer + Pos - 1);
+
+                        m_Pos = Pos;
+                        m_State = rsColon;
+                        return jeKey;
+                    }
+
+                    case rsFirstValue:
+                        if (C == ']')
+                            return Pop(C);
+                        // fallthrough
+                    case rsValue: {
+                        size_t Pos = m_Pos;
+                        CJSONEvent Event;
+
+                        switch (C) {
+                            case '{':
+                            case '[':
+                                return Push(C);
+
+                            case '"':
+                                if (m_Scan == 0)
+                                    m_Escaped = false;
+                                if (ScanString(Pos) == 0)
+                                    return jeNeedMore;
+                                if (m_SkipDepth == -1)
+                                    DecodeString(m_pBuffer + m_Pos + 1, m_pBuffer + Pos - 1);
+                                Event = jeString;
+                                break;
+
+                            case 't':
+                                if (ScanLiteral(Pos, _T("true"), 4) == 0)
+                                    return jeNeedMore;
+                                Event = jeBoolean;
+                                break;
+
+                            case 'f':
+                                if (ScanLiteral(Pos, _T("false"), 5) == 0)
+                                    return jeNeedMore;
+                                Event = jeBoolean;
+                                break;
+
+                            case 'n':
+                                if (ScanLiteral(Pos, _T("null"), 4) == 0)
+                                    return jeNeedMore;
+                                Event = jeNull;
+                                break;
+
+                            default:
+                                if (C != '-' && (C < '0' || C > '9'))
+                                    SyntaxError(m_Pos);
+                                if (ScanNumber(Pos) == 0)
+                                    return jeNeedMore;
+                                Event = jeNumber;
+                                break;
+                        }
+
+                        m_Pos = Pos;
+                        AfterValue();
+                        return Event;
+                    }
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONEvent CJSONReader::Next() {
+            while (true) {
+                const auto Event = Read();
+
+                if (Event == jeNeedMore || Event == jeEnd)
+                    return Event;
+
+                if (m_SkipDepth == -1 || Event == jeKey || Event == jeStartObject || Event == jeStartArray ||
+                    m_Depth != m_SkipDepth) {
+                    if (m_SkipDepth == -1) {
+                        m_Event = Event;
+                        return Event;
+                    }
+                    continue;
+                }
+
+                // The skipped value is complete
+                m_SkipDepth = -1;
+
+                if (m_SkipReport) {
+                    m_Value.Clear();
+                    m_Event = Event;
+                    return Event;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONReader::Skip() {
+            switch (m_Event) {
+                case jeStartObject:
+                case jeStartArray:
+                    m_SkipDepth = m_Depth - 1;
+                    m_SkipReport = true;
+                    break;
+                case jeKey:
+                    m_SkipDepth = m_Depth;
+                    m_SkipReport = false;
+                    break;
+                default:
+                    break;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        long CJSONReader::AsInteger() const {
+            return ::strtol(m_Value.c_str(), nullptr, 10);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        double CJSONReader::AsDouble() const {
+            return ::strtod(m_Value.c_str(), nullptr);
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJSONPointer ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define JSON_POINTER_SYNTAX_ERROR "Invalid JSON pointer \"%s\" in position %d."
+
+        CJSONPointer::CJSONPointer(const CString &Text): CJSONPointer() {
+            Compile(Text);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJSONPointer::CJSONPointer(LPCTSTR Text): CJSONPointer() {
+            Compile(Text == nullptr ? CString() : CString(Text));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONPointer::Compile(const CString &Text) {
+            m_Tokens.Clear();
+            m_Text = Text;
+
+            if (m_Text.IsEmpty())
+                return;
+
+            LPCTSTR Begin = m_Text.Data();
+            LPCTSTR End = Begin + m_Text.Size();
+
+            if (*Begin == '#')
+                ParseFragment(Begin + 1, End);
+            else if (*Begin == '/')
+                ParsePointer(Begin, End);
+            else
+                ParsePath(Begin, End);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONPointer::Add(const CString &Name) {
+            CJSONPointerToken Token;
+
+            Token.Name = Name;
+            Token.Index = -1;
+
+            // Array index: "0" or digits without a leading zero, within int
+            const auto Size = Name.Size();
+            if (Size > 0 && Size <= 9 && (Size == 1 || Name.at(0) != '0')) {
+                int Index = 0;
+                size_t i = 0;
+                for (; i < Size && IsNumeral(Name.at(i)); i++)
+                    Index = Index * 10 + (Name.at(i) - '0');
+                if (i == Size)
+                    Token.Index = Index;
+            }
+
+            m_Tokens.Add(Token);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONPointer::ParsePointer(LPCTSTR Begin, LPCTSTR End, const TList<int> *Offsets) {
+            CString Name;
+
+            if (Begin == End)
+                return;
+
+            // Error positions refer to the compiled text, a decoded fragment maps them back through Offsets
+            const auto Position = [Begin, Offsets](LPCTSTR P) {
+                return Offsets == nullptr ? (int) (P - Begin) : (*Offsets)[(int) (P - Begin)];
+            };
+
+            if (*Begin != '/')
+                throw Exception::EJSONParseSyntaxError(_T(JSON_POINTER_SYNTAX_ERROR), m_Text.c_str(), Position(Begin));
+
+            for (LPCTSTR P = Begin + 1; P <= End; ++P) {
+                if (P == End || *P == '/') {
+                    Add(Name);
+                    Name.Clear();
+                    continue;
+                }
+
+                TCHAR ch = *P;
+
+                if (ch == '~') {
+                    if (P + 1 == End || (P[1] != '0' && P[1] != '1'))
+                        throw Exception::EJSONParseSyntaxError(_T(JSON_POINTER_SYNTAX_ERROR), m_Text.c_str(), Position(P));
+                    ch = P[1] == '0' ? '~' : '/';
+                    P++;
+                }
+
+                Name.Append(ch);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONPointer::ParseFragment(LPCTSTR Begin, LPCTSTR End) {
+            CString Pointer;
+            TList<int> Offsets;
+
+            // RFC 6901, section 6: percent-decode the whole fragment first, "%2F" is then a separator and "%7E0" a '~'
+            for (LPCTSTR P = Begin; P < End; ++P) {
+                TCHAR ch = *P;
+
+                Offsets.Add((int) (P - m_Text.Data()));
+
+                if (ch == '%') {
+                    const auto High = P + 1 < End ? HexValue(P[1]) : -1;
+                    const auto Low = P + 2 < End ? HexValue(P[2]) : -1;
+                    if (High < 0 || Low < 0)
+                        throw Exception::EJSONParseSyntaxError(_T(JSON_POINTER_SYNTAX_ERROR), m_Text.c_str(), (int) (P - m_Text.Data()));
+                    ch = (TCHAR) (High << 4 | Low);
+                    P += 2;
+                }
+
+                Pointer.Append(ch);
+            }
+
+            ParsePointer(Pointer.Data(), Pointer.Data() + Pointer.Size(), &Offsets);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJSONPointer::ParsePath(LPCTSTR Begin, LPCTSTR End) {
+            LPCTSTR P = Begin;
+
+            while (P < End) {
+                if (*P == '[') {
+                    LPCTSTR Close = P + 1;
+                    while (Close < End && IsNumeral(*Close))
+                        Close++;
+                    if (Close == P + 1 || Close == End || *Close != ']')
+                        throw Exception::EJSONParseSyntaxError(_T(JSON_POINTER_SYNTAX_ERROR), m_Text.c_str(), (int) (P - Begin));
+                    Add(CString(P + 1, Close - P - 1));
+                    P = Close + 1;
+                } else {
+                    LPCTSTR Stop = P;
+                    while (Stop < End && *Stop != '.' && *Stop != '[')
+                        Stop++;
+                    if (Stop == P)
+                        throw Exception::EJSONParseSyntaxError(_T(JSON_POINTER_SYNTAX_ERROR), m_Text.c_str(), (int) (P - Begin));
+                    Add(CString(P, Stop - P));
+                    P = Stop;
+                }
+
+                if (P < End && *P == '.') {
+                    if (++P == End)
+                        throw Exception::EJSONParseSyntaxError(_T(JSON_POINTER_SYNTAX_ERROR), m_Text.c_str(), (int) (P - Begin));
+                } else if (P < End && *P != '[') {
+                    throw Exception::EJSONParseSyntaxError(_T(JSON_POINTER_SYNTAX_ERROR), m_Text.c_str(), (int) (P - Begin));
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const CJSON *CJSONPointer::Find(const CJSON &Json) const {
+            const CJSON *Node = &Json;
+
+            for (int i = 0; i < m_Tokens.Count(); i++) {
+                const auto &Token = m_Tokens.Items(i);
+
+                // Values and documents hold their container in Value(), containers are their own
+                const CJSON *Container = Node->Value();
+                if (Container == nullptr || Container == Node)
+                    Container = Node;
+
+                if (Container->IsObject()) {
+                    const auto Members = dynamic_cast<const CJSONMembers *> (Container);
+                    if (Members == nullptr)
+                        return nullptr;
+
+                    const auto Index = Members->IndexOfString(Token.Name);
+                    if (Index < 0)
+                        return nullptr;
+
+                    Node = &Members->Members(Index).Value();
+                } else if (Container->IsArray()) {
+                    const auto Elements = dynamic_cast<const CJSONElements *> (Container);
+                    if (Elements == nullptr || Token.Index < 0 || Token.Index >= Elements->Count())
+                        return nullptr;
+
+                    Node = &Elements->Values(Token.Index);
+                } else {
+                    return nullptr;
+                }
+            }
+
+            return Node;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const CJSONValue *CJSONPointer::Value(const CJSON &Json) const {
+            const auto Node = Find(Json);
+            if (Node == nullptr)
+                return nullptr;
+            if (m_Tokens.Count() > 0)
+                return static_cast<const CJSONValue *> (Node);
+            return dynamic_cast<const CJSONValue *> (Node);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CJSONPointer::Find(CJSONReader &Reader) const {
+            auto Event = Reader.Next();
+
+            for (int i = 0; i < m_Tokens.Count(); i++) {
+                const auto &Token = m_Tokens.Items(i);
+
+                if (Event == jeStartObject) {
+                    while (true) {
+                        Event = Reader.Next();
+                        if (Event != jeKey)
+                            return false;
+                        const auto &Key = Reader.Value();
+                        if (Key.Size() == Token.Name.Size() && (Key.Size() == 0 || ::memcmp(Key.Data(), Token.Name.Data(), Key.Size()) == 0))
+                            break;
+                        Reader.Skip();
+                    }
+                } else if (Event == jeStartArray) {
+                    if (Token.Index < 0)
+                        return false;
+
+                    for (int Index = 0; Index < Token.Index; Index++) {
+                        Event = Reader.Next();
+                        if (Event == jeEndArray || Event == jeNeedMore || Event == jeEnd)
+                            return false;
+                        if (Event == jeStartObject || Event == jeStartArray) {
+                            // Next() then reports the end of the skipped element, not of this array
+                            Reader.Skip();
+                            Event = Reader.Next();
+                            if (Event == jeNeedMore || Event == jeEnd)
+                                return false;
+                        }
+                    }
+                } else {
+                    return false;
+                }
+
+                Event = Reader.Next();
+                if (Event == jeEndArray || Event == jeNeedMore || Event == jeEnd)
+                    return false;
+            }
+
+            return Event != jeNeedMore && Event != jeEnd;
+        }
     }
 }
 }
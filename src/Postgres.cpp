@@ -24,6 +24,13 @@ Author:
 #ifdef WITH_POSTGRESQL
 #include "delphi.hpp"
 #include "delphi/Postgres.hpp"
+
+#include <endian.h>
+#include <sys/ioctl.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PQ_EPOCH_DELTA          36526           // 2000-01-01 as CDateTime
+#define PQ_USECS_PER_DAY        86400000000.0
 //----------------------------------------------------------------------------------------------------------------------
 
 void OnNoticeReceiver(void *AData, const PGresult *AResult) {
@@ -154,10 +161,17 @@ namespace Delphi {
             m_Ping = PQPING_NO_ATTEMPT;
             m_PingValid = false;
             m_ExpandDBName = false;
+            m_pKeywords = nullptr;
+            m_pValues = nullptr;
             m_ApplicationName = _T("'") DELPHI_LIB_DESCRIPTION _T("'");
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        CPQConnInfo::~CPQConnInfo() {
+            ClearParams();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         CPQConnInfo::CPQConnInfo(LPCSTR AConnInfo): CPQConnInfo() {
             m_ConnInfo = AConnInfo;
         }
@@ -220,9 +234,84 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CPQConnInfo::UpdateParams() const {
+            // Values are kept the way a conninfo string wants them: 'quoted' ones are unquoted for libpq
+            auto Unquote = [](const CString &Value) {
+                if (Value.Size() < 2 || Value.front() != '\'' || Value.back() != '\'')
+                    return Value;
+
+                CString Result;
+                for (size_t i = 1; i < Value.Size() - 1; ++i) {
+                    if (Value[i] == '\\' && i + 1 < Value.Size() - 1)
+                        i++;
+                    Result.Append(Value[i]);
+                }
+
+                return Result;
+            };
+
+            ClearParams();
+
+            const CString &ConnInfo = GetConnInfo();
+
+            if (m_Parameters.Count() == 0) {
+                // Created from a connection string: libpq expands it from the dbname value
+                m_KeywordList.Add(_T("dbname"));
+                m_ValueList.Add(ConnInfo);
+            } else {
+                for (int i = 0; i < m_Parameters.Count(); ++i) {
+                    m_KeywordList.Add(m_Parameters.Names(i));
+                    m_ValueList.Add(Unquote(m_Parameters.ValueFromIndex(i)));
+                }
+
+                if (m_Parameters.Values(_T("application_name")).IsEmpty() && !m_ApplicationName.IsEmpty()) {
+                    m_KeywordList.Add(_T("application_name"));
+                    m_ValueList.Add(Unquote(m_ApplicationName));
+                }
+            }
+
+            m_pKeywords = new LPCSTR[m_KeywordList.Count() + 1];
+            m_pValues = new LPCSTR[m_ValueList.Count() + 1];
+
+            for (int i = 0; i < m_KeywordList.Count(); ++i) {
+                m_pKeywords[i] = m_KeywordList[i].c_str();
+                m_pValues[i] = m_ValueList[i].c_str();
+            }
+
+            m_pKeywords[m_KeywordList.Count()] = nullptr;
+            m_pValues[m_ValueList.Count()] = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnInfo::ClearParams() const {
+            delete [] m_pKeywords;
+            delete [] m_pValues;
+
+            m_pKeywords = nullptr;
+            m_pValues = nullptr;
+
+            m_KeywordList.Clear();
+            m_ValueList.Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR const *CPQConnInfo::Keywords() const {
+            if (m_pKeywords == nullptr)
+                UpdateParams();
+            return m_pKeywords;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR const *CPQConnInfo::Values() const {
+            if (m_pValues == nullptr)
+                UpdateParams();
+            return m_pValues;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         PGPing CPQConnInfo::GetPing() {
             if (!m_PingValid) {
-                m_Ping = PQping(GetConnInfo().c_str());
+                m_Ping = PQpingParams(Keywords(), Values(), ExpandValues());
             }
             return m_Ping;
         }
@@ -234,6 +323,7 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnInfo::Clear() {
+            ClearParams();
             m_ConnInfo.Clear();
             m_Parameters.Clear();
             m_ExpandDBName = false;
@@ -241,11 +331,13 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnInfo::Add(LPCSTR Keyword, LPCSTR Value) {
+            ClearParams();
             m_Parameters.AddPair(Keyword, Value);
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnInfo::Assign(const CPQConnInfo &Source) {
+            ClearParams();
             m_ApplicationName = Source.m_ApplicationName;
             m_ConnInfo = Source.m_ConnInfo;
             m_Parameters = Source.m_Parameters;
@@ -548,14 +640,14 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnection::Connect() {
-            m_pHandle = PQconnectdb(m_ConnInfo.ConnInfo().c_str());
+            m_pHandle = PQconnectdbParams(m_ConnInfo.Keywords(), m_ConnInfo.Values(), m_ConnInfo.ExpandValues());
             CheckConnection();
             CheckSocket();
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnection::ConnectStart() {
-            m_pHandle = PQconnectStart(m_ConnInfo.ConnInfo().c_str());
+            m_pHandle = PQconnectStartParams(m_ConnInfo.Keywords(), m_ConnInfo.Values(), m_ConnInfo.ExpandValues());
             CheckPollConnection();
             CheckSocket(true);
         }
@@ -679,523 +771,2520 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
-        //-- CPQPollConnection -----------------------------------------------------------------------------------------
+        //-- CPQStatementCache -----------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
 
-        CPQPollConnection::CPQPollConnection(const CPQConnInfo &AConnInfo, CPollManager *AManager):
-                CPQConnection(AConnInfo, AManager) {
-            m_ConnectionStatus = qsConnect;
-            m_WorkQuery = nullptr;
-            m_AutoFree = true;
+        CPQStatementCache::CPQStatementCache(size_t ACapacity): CObject(), m_Index(ACapacity * 2) {
+            m_pFirst = nullptr;
+            m_pLast = nullptr;
+            m_Capacity = ACapacity == 0 ? 1 : ACapacity;
+            m_Sequence = 0;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        bool CPQPollConnection::CheckResult() {
-            if (m_WorkQuery == nullptr)
-                return false;
-
-//            if (IsBusy()) {
-//                ConsumeInput();
-//                return false;
-//            }
-
-            m_WorkQuery->GetResult();
-            QueryStop();
-
-            return true;
+        CPQStatementCache::~CPQStatementCache() {
+            Clear();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQPollConnection::CheckNotify() {
-            PGnotify *pNotify;
-            int nNotifies = 0;
-
-            CPollConnectionStatus status = m_ConnectionStatus;
-
-            m_ConnectionStatus = qsWait;
+        void CPQStatementCache::Link(CPQStatement *AStatement) {
+            AStatement->Prev = nullptr;
+            AStatement->Next = m_pFirst;
+            if (m_pFirst != nullptr)
+                m_pFirst->Prev = AStatement;
+            m_pFirst = AStatement;
+            if (m_pLast == nullptr)
+                m_pLast = AStatement;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            ConsumeInput();
-            while ((pNotify = Notify()) != nullptr) {
-                DoNotify(this, pNotify);
-                PQfreemem(pNotify);
-                nNotifies++;
-                ConsumeInput();
-            }
+        void CPQStatementCache::Unlink(CPQStatement *AStatement) {
+            if (AStatement->Prev != nullptr)
+                AStatement->Prev->Next = AStatement->Next;
+            else
+                m_pFirst = AStatement->Next;
 
-            m_ConnectionStatus = status;
+            if (AStatement->Next != nullptr)
+                AStatement->Next->Prev = AStatement->Prev;
+            else
+                m_pLast = AStatement->Prev;
 
-            return nNotifies;
+            AStatement->Prev = nullptr;
+            AStatement->Next = nullptr;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQPollConnection::QueryStart(CPQQuery *AQuery) {
-            m_WorkQuery = AQuery;
-            m_WorkQuery->Connection(this);
-            m_WorkQuery->SendQuery();
-            m_ConnectionStatus = qsWait;
-            Flush();
+        CPQStatement *CPQStatementCache::Find(const CString &Key) {
+            auto pStatement = (CPQStatement *) m_Index.Find(Key);
+            if (pStatement != nullptr && pStatement != m_pFirst) {
+                Unlink(pStatement);
+                Link(pStatement);
+            }
+            return pStatement;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQPollConnection::QueryStop() {
-            FreeAndNil(m_WorkQuery);
-            m_ConnectionStatus = qsReady;
-        }
+        CPQStatement *CPQStatementCache::Add(const CString &Key, CString &Evicted) {
+            Evicted.Clear();
 
-        //--------------------------------------------------------------------------------------------------------------
+            if (m_Index.Count() >= m_Capacity && m_pLast != nullptr) {
+                auto pLast = m_pLast;
+                Evicted = pLast->Name;
+                Unlink(pLast);
+                m_Index.Remove(pLast->Key, pLast);
+                delete pLast;
+            }
 
-        //-- CPQResult -------------------------------------------------------------------------------------------------
+            auto pStatement = new CPQStatement();
 
-        //--------------------------------------------------------------------------------------------------------------
+            pStatement->Key = Key;
+            pStatement->Name.Format("delphi_stmt_%u", ++m_Sequence);
 
-        CPQResult::CPQResult(CPQQuery *AQQuery, PGresult *AHandle): CCollectionItem(AQQuery) {
-            m_Query = AQQuery;
-            m_pHandle = AHandle;
-            m_Status = PGRES_FATAL_ERROR;
-            m_OnStatus = nullptr;
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            Link(pStatement);
+            m_Index.Add(Key, pStatement);
 
-        CPQResult::~CPQResult() {
-            Clear();
+            return pStatement;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQResult::Clear() {
-            if (m_pHandle != nullptr)
-                PQclear(m_pHandle);
+        void CPQStatementCache::Remove(const CString &Key) {
+            auto pStatement = (CPQStatement *) m_Index.Find(Key);
+            if (pStatement != nullptr) {
+                Unlink(pStatement);
+                m_Index.Remove(Key, pStatement);
+                delete pStatement;
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        ExecStatusType CPQResult::ResultStatus() {
-            if (m_pHandle != nullptr) {
-                m_Status = PQresultStatus(m_pHandle);
-                DoStatus();
-                return m_Status;
+        void CPQStatementCache::Clear() {
+            CPQStatement *pNext;
+            while (m_pFirst != nullptr) {
+                pNext = m_pFirst->Next;
+                delete m_pFirst;
+                m_pFirst = pNext;
             }
-            return PGRES_FATAL_ERROR;
+            m_pLast = nullptr;
+            m_Index.Clear();
         }
-        //--------------------------------------------------------------------------------------------------------------
 
-        LPCSTR CPQResult::GetErrorMessage() {
-            return PQresultErrorMessage(m_pHandle);
-        }
         //--------------------------------------------------------------------------------------------------------------
 
-        LPCSTR CPQResult::StatusString() {
-            return PQresStatus(m_Status);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+        //-- CPQPollConnection -----------------------------------------------------------------------------------------
 
-        LPCSTR CPQResult::VerboseErrorMessage(PGVerbosity Verbosity, PGContextVisibility Context) {
-            LPCSTR lpError = PQresultVerboseErrorMessage(m_pHandle, Verbosity, Context);
-            m_VerboseErrorMessage = lpError;
-            PQfreemem((void *) lpError);
-            return m_VerboseErrorMessage.c_str();
-        }
         //--------------------------------------------------------------------------------------------------------------
 
-        LPCSTR CPQResult::ErrorField(int FieldCode) {
-            return PQresultErrorField(m_pHandle, FieldCode);
+        CPQPollConnection::CPQPollConnection(const CPQConnInfo &AConnInfo, CPollManager *AManager):
+                CPQConnection(AConnInfo, AManager) {
+            m_ConnectionStatus = qsConnect;
+            m_WorkQuery = nullptr;
+            m_pIdleList = nullptr;
+            m_Idle = false;
+            m_Endpoint = -1;
+            m_Listener = false;
+            m_Role = srUnknown;
+            m_RoleHint = srUnknown;
+            m_PipelineMode = false;
+            m_Reading = false;
+            m_Phase = CONNECTION_BAD;
+            m_PhaseTime = 0;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+            m_pCancel = nullptr;
+#endif
+            m_AutoFree = true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQResult::nTuples() {
-            return PQntuples(m_pHandle);
+        CPQPollConnection::~CPQPollConnection() {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+            if (m_pCancel != nullptr)
+                PQcancelFinish(m_pCancel);
+#endif
+            if (m_Idle && m_pIdleList != nullptr)
+                m_pIdleList->Remove(this);
+            for (int i = 0; i < m_Pipeline.Count(); ++i)
+                delete (CPQQuery *) m_Pipeline[i];
+            m_Pipeline.Clear();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQResult::nFields() {
-            return PQnfields(m_pHandle);
+        void CPQPollConnection::SetConnectionStatus(CPollConnectionStatus Value) {
+            m_ConnectionStatus = Value;
+            if (Value == qsConnect || Value == qsReset) {
+                m_PhaseTime = 0;
+            } else if (Value == qsReady) {
+                UpdateRole();
+                if (!m_Idle && m_pIdleList != nullptr)
+                    m_pIdleList->Push(this);
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        LPCSTR CPQResult::fName(int ColumnNumber) {
-            return PQfname(m_pHandle, ColumnNumber);
+        void CPQPollConnection::UpdatePhase(ConnStatusType Value, CDateTime Now) {
+            if (m_PhaseTime == 0 || m_Phase != Value) {
+                m_Phase = Value;
+                m_PhaseTime = Now;
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQResult::fNumber(LPCSTR ColumnName) {
-            return PQfnumber(m_pHandle, ColumnName);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+        void CPQPollConnection::UpdateRole() {
+            // Reported by the server on connect and again on promotion, so no query is needed
+            const auto standby = Connected() ? PQparameterStatus(Handle(), "in_hot_standby") : nullptr;
 
-        Oid CPQResult::fTable(int ColumnNumber) {
-            return PQftable(m_pHandle, ColumnNumber);
+            if (standby != nullptr) {
+                m_Role = strcmp(standby, "on") == 0 ? srStandby : srPrimary;
+            } else if (m_Role == srUnknown) {
+                m_Role = m_RoleHint == srUnknown ? srPrimary : m_RoleHint;
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQResult::fTableCol(int ColumnNumber) {
-            return PQftablecol(m_pHandle, ColumnNumber);
+        bool CPQPollConnection::Paused() const {
+            if (m_Pipeline.Count() > 0)
+                return ((CPQQuery *) m_Pipeline.First())->Paused();
+            return m_WorkQuery != nullptr && m_WorkQuery->Paused();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQResult::fFormat(int ColumnNumber) {
-            return PQfformat(m_pHandle, ColumnNumber);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+        void CPQPollConnection::Cancel() {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+            if (m_pCancel != nullptr)
+                return;
 
-        Oid CPQResult::fType(int ColumnNumber) {
-            return PQftype(m_pHandle, ColumnNumber);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            m_pCancel = PQcancelCreate(Handle());
+            if (m_pCancel == nullptr)
+                throw EDBConnectionError(_T("PQcancelCreate failed: out of memory."));
 
-        int CPQResult::fMod(int ColumnNumber) {
-            return PQfmod(m_pHandle, ColumnNumber);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            if (PQcancelStart(m_pCancel) == 0) {
+                const CString Message(PQcancelErrorMessage(m_pCancel));
+                PQcancelFinish(m_pCancel);
+                m_pCancel = nullptr;
+                throw EDBConnectionError(_T("PQcancelStart failed: %s"), Message.c_str());
+            }
 
-        int CPQResult::fSize(int ColumnNumber) {
-            return PQfsize(m_pHandle, ColumnNumber);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            CancelPoll();
+#else
+            // Older libpq only has the blocking call: it connects to the server and sends the cancel request
+            TCHAR szError[256] = {0};
 
-        int CPQResult::BinaryTuples() {
-            return PQbinaryTuples(m_pHandle);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            auto pCancel = PQgetCancel(Handle());
+            if (pCancel == nullptr)
+                throw EDBConnectionError(_T("PQgetCancel failed: %s"), GetErrorMessage());
 
-        LPCSTR CPQResult::GetValue(int RowNumber, int ColumnNumber) {
-            return PQgetvalue(m_pHandle, RowNumber, ColumnNumber);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            const auto Result = PQcancel(pCancel, szError, sizeof(szError));
+            PQfreeCancel(pCancel);
 
-        int CPQResult::GetIsNull(int RowNumber, int ColumnNumber) {
-            return PQgetisnull(m_pHandle, RowNumber, ColumnNumber);
+            if (Result == 0)
+                throw EDBConnectionError(_T("PQcancel failed: %s"), szError);
+#endif
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQResult::GetLength(int RowNumber, int ColumnNumber) {
-            return PQgetlength(m_pHandle, RowNumber, ColumnNumber);
+        bool CPQPollConnection::CancelPoll() {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+            if (m_pCancel == nullptr)
+                return true;
+
+            switch (PQcancelPoll(m_pCancel)) {
+                case PGRES_POLLING_OK:
+                case PGRES_POLLING_FAILED:
+                    PQcancelFinish(m_pCancel);
+                    m_pCancel = nullptr;
+                    // Held back from the idle list while the request could still hit the next query
+                    if (m_ConnectionStatus == qsReady)
+                        SetConnectionStatus(qsReady);
+                    return true;
+
+                default:
+                    return false;
+            }
+#else
+            return true;
+#endif
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQResult::nParams() {
-            return PQnparams(m_pHandle);
+        bool CPQPollConnection::Cancelling() const {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+            return m_pCancel != nullptr;
+#else
+            return false;
+#endif
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        Oid CPQResult::ParamType(int ParamNumber) {
-            return PQparamtype(m_pHandle, ParamNumber);
+        bool CPQPollConnection::ReadInput() {
+            int Pending = 0;
+
+            // Edge triggered polling reports input once: what libpq left in the socket is read now
+            if (ioctl(PQSocket(), FIONREAD, &Pending) == 0 && Pending > 0) {
+                ConsumeInput();
+                return true;
+            }
+#ifdef WITH_SSL
+            // On TLS, decrypted bytes may be waiting in OpenSSL while the socket is empty (see libpq pqSocketCheck)
+            const auto pSSL = (SSL *) PQsslStruct(Handle(), "OpenSSL");
+            if (pSSL != nullptr && SSL_pending(pSSL) > 0) {
+                ConsumeInput();
+                return true;
+            }
+#endif
+            return false;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQResult::DoStatus() {
-            if (m_OnStatus != nullptr) {
-                m_OnStatus(this);
+        bool CPQPollConnection::WaitInput() {
+            while (IsBusy()) {
+                if (!ReadInput())
+                    return true;
             }
+            return false;
         }
-
         //--------------------------------------------------------------------------------------------------------------
 
-        //-- CPQQuery --------------------------------------------------------------------------------------------------
+        bool CPQPollConnection::CheckCopyOut() {
+            char *pBuffer = nullptr;
+            int Length;
 
-        //--------------------------------------------------------------------------------------------------------------
+            while (!m_WorkQuery->Paused()) {
+                Length = PQgetCopyData(Handle(), &pBuffer, 1);
 
-        CPQQuery::CPQQuery(): CCollection(this) {
-            m_StartTime = 0;
-            m_pConnection = nullptr;
+                if (Length > 0) {
+                    m_WorkQuery->DoCopyOut(pBuffer, Length);
+                    PQfreemem(pBuffer);
+                    continue;
+                }
 
-            m_OnSendQuery = nullptr;
-            m_OnExecuted = nullptr;
+                if (Length == 0) {
+                    if (ReadInput())
+                        continue;
+                    return false;
+                }
 
-            m_OnResultStatus = nullptr;
-            m_OnResult = nullptr;
-        }
-        //--------------------------------------------------------------------------------------------------------------
+                // -1 is the end of the data, -2 an error: the next result tells which
+                m_WorkQuery->m_CopyState = csNone;
+                return true;
+            }
 
-        CPQQuery::CPQQuery(CPQConnection *AConnection): CPQQuery() {
-            m_pConnection = AConnection;
+            return false;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CPQQuery::~CPQQuery() {
-            CPQQuery::Clear();
-        }
-        //--------------------------------------------------------------------------------------------------------------
+        bool CPQPollConnection::CheckCopyIn() {
+            int Result;
+            bool Idle;
 
-        CPQResult *CPQQuery::GetResult(int Index) {
-            return (CPQResult *) inherited::GetItem(Index);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            if (m_WorkQuery == nullptr || m_WorkQuery->m_CopyState != csCopyIn)
+                return false;
 
-        void CPQQuery::SetConnection(CPQConnection *Value) {
-            if (m_pConnection != Value) {
-                m_pConnection = Value;
-            }
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            auto &Copy = m_WorkQuery->m_Copy;
 
-        void CPQQuery::GetResult() {
-            CPQResult *pQueryResult;
-            PGresult *pResult;
+            m_Reading = true;
+            try {
+                for (;;) {
+                    Idle = false;
 
-            while ((pResult = m_pConnection->GetResult()) != nullptr) {
-                pQueryResult = new CPQResult(this, pResult);
-#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
-                pQueryResult->OnStatus([this](auto &&AResult) { DoResultStatus(AResult); });
-#else
-                pQueryResult->OnStatus(std::bind(&CPQQuery::DoResultStatus, this, _1));
-#endif
-                DoResult(pQueryResult, pQueryResult->ResultStatus());
-            }
+                    if (!Copy.Ended() && Copy.Size() < PQ_COPY_BUFFER_SIZE) {
+                        const auto Size = Copy.Size();
+                        m_WorkQuery->DoCopyIn();
+                        Idle = Copy.Size() == Size && !Copy.Ended();
+                    }
 
-            DoExecuted();
-        }
-        //--------------------------------------------------------------------------------------------------------------
+                    if (Copy.Size() > 0 && Copy.Error().IsEmpty()) {
+                        Result = PQputCopyData(Handle(), Copy.Data(), (int) Copy.Size());
 
-        void CPQQuery::SendQuery() {
-            if (m_pConnection == nullptr)
-                throw EDBError(_T("Not set connection!"));
+                        if (Result == -1) {
+                            // The server has ended the COPY (most likely with an error): read the result
+                            m_WorkQuery->m_CopyState = csNone;
+                            break;
+                        }
 
-            if (!m_pConnection->Connected())
-                throw EDBError(_T("Not connected!"));
+                        // libpq output buffer is full: wait until the socket is writable
+                        if (Result == 0)
+                            break;
 
-            if (m_SQL.Count() == 0)
-                throw EDBError(_T("Empty SQL query!"));
+                        Copy.Consumed();
+                    }
 
-            if (PQsendQuery(m_pConnection->Handle(), m_SQL.Text().c_str()) == 0) {
-                throw EDBError("PQsendQuery failed: %s", m_pConnection->GetErrorMessage());
+                    if (!Flush())
+                        break;
+
+                    if (Copy.Ended()) {
+                        Result = PQputCopyEnd(Handle(), Copy.Error().IsEmpty() ? nullptr : Copy.Error().c_str());
+
+                        if (Result == 0)
+                            break;
+
+                        m_WorkQuery->m_CopyState = csNone;
+                        Flush();
+
+                        m_Reading = false;
+                        return true;
+                    }
+
+                    if (Idle)
+                        break;
+                }
+            } catch (...) {
+                m_Reading = false;
+                throw;
+            }
+            m_Reading = false;
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQPollConnection::CheckResult() {
+            PGresult *pResult;
+
+            if (m_WorkQuery == nullptr)
+                return false;
+
+            m_Reading = true;
+            try {
+                // Take only what has arrived: streamed rows must not wait for the whole result
+                while (!m_WorkQuery->Paused()) {
+                    if (m_WorkQuery->m_CopyState == csCopyIn)
+                        break;
+
+                    if (m_WorkQuery->m_CopyState == csCopyOut) {
+                        if (!CheckCopyOut())
+                            break;
+                        continue;
+                    }
+
+                    if (WaitInput())
+                        break;
+
+                    pResult = GetResult();
+
+                    if (pResult == nullptr) {
+                        m_Reading = false;
+                        m_WorkQuery->DoExecuted();
+                        QueryStop();
+                        return true;
+                    }
+
+                    switch (PQresultStatus(pResult)) {
+                        case PGRES_COPY_IN:
+                            // Pool connections are non-blocking: COPY data is put without blocking, EPOLLOUT resumes it
+                            m_WorkQuery->m_CopyState = csCopyIn;
+                            break;
+
+                        case PGRES_COPY_OUT:
+                            m_WorkQuery->m_CopyState = csCopyOut;
+                            break;
+
+                        default:
+                            break;
+                    }
+
+                    m_WorkQuery->AddResult(pResult);
+                }
+            } catch (...) {
+                m_Reading = false;
+                throw;
+            }
+            m_Reading = false;
+
+            if (m_WorkQuery->m_CopyState == csCopyIn)
+                CheckCopyIn();
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQPollConnection::CheckNotify() {
+            PGnotify *pNotify;
+            int nNotifies = 0;
+
+            CPollConnectionStatus status = m_ConnectionStatus;
+
+            m_ConnectionStatus = qsWait;
+
+            // Everything that has arrived is parsed first, then the whole batch is delivered
+            ConsumeInput();
+            do {
+                while ((pNotify = Notify()) != nullptr) {
+                    DoNotify(this, pNotify);
+                    PQfreemem(pNotify);
+                    nNotifies++;
+                }
+            } while (ReadInput());
+
+            SetConnectionStatus(status);
+
+            return nNotifies;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollConnection::QueryStart(CPQQuery *AQuery) {
+            m_WorkQuery = AQuery;
+            m_WorkQuery->Connection(this);
+            m_WorkQuery->SendQuery();
+            m_WorkQuery->SetRowMode();
+            m_ConnectionStatus = qsWait;
+            Flush();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollConnection::QueryStop() {
+            FreeAndNil(m_WorkQuery);
+            SetConnectionStatus(qsReady);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollConnection::PipelineEnter() {
+            if (m_PipelineMode)
+                return;
+#ifdef LIBPQ_HAS_PIPELINING
+            if (PQenterPipelineMode(Handle()) == 0)
+                throw EDBConnectionError(_T("PQenterPipelineMode failed: %s"), GetErrorMessage());
+            m_PipelineMode = true;
+#else
+            throw EDBError(_T("Pipeline mode is not supported by libpq."));
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollConnection::PipelineExit() {
+            if (!m_PipelineMode)
+                return;
+#ifdef LIBPQ_HAS_PIPELINING
+            if (PQexitPipelineMode(Handle()) == 0)
+                throw EDBConnectionError(_T("PQexitPipelineMode failed: %s"), GetErrorMessage());
+#endif
+            m_PipelineMode = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollConnection::PipelineStart(CPQQuery *AQuery) {
+            PipelineEnter();
+
+            AQuery->Connection(this);
+            m_Pipeline.Add(AQuery);
+
+            try {
+                AQuery->SendPipeline();
+            } catch (...) {
+                m_Pipeline.Remove(AQuery);
+                if (m_Pipeline.Count() == 0) {
+                    PipelineExit();
+                    SetConnectionStatus(qsReady);
+                }
+                throw;
+            }
+
+            m_ConnectionStatus = qsWait;
+            Flush();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollConnection::PipelineReset() {
+            for (int i = 0; i < m_Pipeline.Count(); ++i)
+                delete (CPQQuery *) m_Pipeline[i];
+            m_Pipeline.Clear();
+
+            // libpq drops pipeline mode with the closed session, only our own flag is left
+            m_PipelineMode = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQPollConnection::CheckPipeline() {
+            CPQQuery *pQuery;
+            PGresult *pResult;
+
+            int nQueries = 0;
+            bool bEndOfStatement = false;
+
+            m_Reading = true;
+            try {
+                while (m_Pipeline.Count() > 0 && !Paused() && !WaitInput()) {
+                    ((CPQQuery *) m_Pipeline.First())->SetRowMode();
+
+                    pResult = GetResult();
+
+                    // nullptr ends the results of every statement; two in a row means nothing more has arrived
+                    if (pResult == nullptr) {
+                        if (bEndOfStatement)
+                            break;
+                        bEndOfStatement = true;
+                        pQuery = (CPQQuery *) m_Pipeline.First();
+                        pQuery->m_Statement++;
+                        pQuery->m_RowMode = false;
+                        continue;
+                    }
+
+                    bEndOfStatement = false;
+                    pQuery = (CPQQuery *) m_Pipeline.First();
+                    pQuery->m_RowMode = true;
+
+                    const auto status = PQresultStatus(pResult);
+#ifdef LIBPQ_HAS_PIPELINING
+                    if (status == PGRES_PIPELINE_SYNC) {
+                        PQclear(pResult);
+
+                        m_Pipeline.Delete(0);
+                        pQuery->DoExecuted();
+                        delete pQuery;
+
+                        nQueries++;
+                        continue;
+                    }
+#endif
+                    if (pQuery->m_Statement < pQuery->m_Hidden) {
+                        // PQsendPrepare of a statement new to the cache: only a failure concerns the caller
+                        if (status == PGRES_COMMAND_OK) {
+                            PQclear(pResult);
+                        } else {
+                            m_Statements.Remove(pQuery->m_StatementKey);
+                            pQuery->AddResult(pResult);
+                        }
+                    } else if (pQuery->m_Statement >= pQuery->m_Hidden + pQuery->m_Statements) {
+                        // DEALLOCATE of an evicted statement
+                        PQclear(pResult);
+                    } else {
+                        if (status == PGRES_FATAL_ERROR && !pQuery->m_StatementKey.IsEmpty()) {
+                            const auto state = PQresultErrorField(pResult, PG_DIAG_SQLSTATE);
+                            // invalid_sql_statement_name: the statement is gone on the server (DISCARD ALL, etc.)
+                            if (state != nullptr && strcmp(state, "26000") == 0)
+                                m_Statements.Remove(pQuery->m_StatementKey);
+                        }
+                        pQuery->AddResult(pResult);
+                    }
+                }
+            } catch (...) {
+                m_Reading = false;
+                throw;
+            }
+            m_Reading = false;
+
+            if (m_Pipeline.Count() == 0 && m_ConnectionStatus == qsWait) {
+                PipelineExit();
+                SetConnectionStatus(qsReady);
+            }
+
+            return nQueries;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPQIdleList -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQIdleList::Push(CPQPollConnection *AConnection) {
+            if (AConnection->Role() == srStandby)
+                m_Standby.Add(AConnection);
+            else
+                m_Primary.Add(AConnection);
+            AConnection->m_Idle = true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollConnection *CPQIdleList::Pop(CPQServerRole ARole) {
+            CPQPollConnection *pConnection = nullptr;
+
+            if (ARole != srPrimary)
+                pConnection = Pop(m_Standby);
+
+            if (pConnection == nullptr)
+                pConnection = Pop(m_Primary);
+
+            return pConnection;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollConnection *CPQIdleList::Pop(CList &List) {
+            CPQPollConnection *pConnection;
+
+            while (List.Count() > 0) {
+                pConnection = (CPQPollConnection *) List.Last();
+                List.Delete(List.Count() - 1);
+                pConnection->m_Idle = false;
+
+                if (pConnection->ConnectionStatus() == qsReady && pConnection->Connected() && !pConnection->Cancelling())
+                    return pConnection;
+            }
+
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQIdleList::Remove(CPQPollConnection *AConnection) {
+            if (m_Primary.Remove(AConnection) == -1)
+                m_Standby.Remove(AConnection);
+            AConnection->m_Idle = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQIdleList::Update() {
+            CPQPollConnection *pConnection;
+
+            for (int i = m_Primary.Count() - 1; i >= 0; --i) {
+                pConnection = (CPQPollConnection *) m_Primary[i];
+                pConnection->UpdateRole();
+                if (pConnection->Role() == srStandby) {
+                    m_Primary.Delete(i);
+                    m_Standby.Add(pConnection);
+                }
+            }
+
+            for (int i = m_Standby.Count() - 1; i >= 0; --i) {
+                pConnection = (CPQPollConnection *) m_Standby[i];
+                pConnection->UpdateRole();
+                if (pConnection->Role() != srStandby) {
+                    m_Standby.Delete(i);
+                    m_Primary.Add(pConnection);
+                }
+            }
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPQResult -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQResult::CPQResult(CPQQuery *AQQuery, PGresult *AHandle): CCollectionItem(AQQuery) {
+            m_Query = AQQuery;
+            m_pHandle = AHandle;
+            m_Status = PGRES_FATAL_ERROR;
+            m_OnStatus = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQResult::~CPQResult() {
+            Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQResult::Clear() {
+            if (m_pHandle != nullptr)
+                PQclear(m_pHandle);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        ExecStatusType CPQResult::ResultStatus() {
+            if (m_pHandle != nullptr) {
+                m_Status = PQresultStatus(m_pHandle);
+                DoStatus();
+                return m_Status;
+            }
+            return PGRES_FATAL_ERROR;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR CPQResult::GetErrorMessage() {
+            return PQresultErrorMessage(m_pHandle);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR CPQResult::StatusString() {
+            return PQresStatus(m_Status);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR CPQResult::VerboseErrorMessage(PGVerbosity Verbosity, PGContextVisibility Context) {
+            LPCSTR lpError = PQresultVerboseErrorMessage(m_pHandle, Verbosity, Context);
+            m_VerboseErrorMessage = lpError;
+            PQfreemem((void *) lpError);
+            return m_VerboseErrorMessage.c_str();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR CPQResult::ErrorField(int FieldCode) {
+            return PQresultErrorField(m_pHandle, FieldCode);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::nTuples() {
+            return PQntuples(m_pHandle);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::nFields() {
+            return PQnfields(m_pHandle);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR CPQResult::fName(int ColumnNumber) {
+            return PQfname(m_pHandle, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::fNumber(LPCSTR ColumnName) {
+            return PQfnumber(m_pHandle, ColumnName);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        Oid CPQResult::fTable(int ColumnNumber) {
+            return PQftable(m_pHandle, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::fTableCol(int ColumnNumber) {
+            return PQftablecol(m_pHandle, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::fFormat(int ColumnNumber) {
+            return PQfformat(m_pHandle, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        Oid CPQResult::fType(int ColumnNumber) {
+            return PQftype(m_pHandle, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::fMod(int ColumnNumber) {
+            return PQfmod(m_pHandle, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::fSize(int ColumnNumber) {
+            return PQfsize(m_pHandle, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::BinaryTuples() {
+            return PQbinaryTuples(m_pHandle);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCSTR CPQResult::GetValue(int RowNumber, int ColumnNumber) {
+            return PQgetvalue(m_pHandle, RowNumber, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::GetIsNull(int RowNumber, int ColumnNumber) {
+            return PQgetisnull(m_pHandle, RowNumber, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::GetLength(int RowNumber, int ColumnNumber) {
+            return PQgetlength(m_pHandle, RowNumber, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQResult::nParams() {
+            return PQnparams(m_pHandle);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        Oid CPQResult::ParamType(int ParamNumber) {
+            return PQparamtype(m_pHandle, ParamNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static inline int16_t PQBinaryInt16(LPCSTR Value) {
+            uint16_t Result;
+            memcpy(&Result, Value, sizeof(Result));
+            return (int16_t) be16toh(Result);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static inline int32_t PQBinaryInt32(LPCSTR Value) {
+            uint32_t Result;
+            memcpy(&Result, Value, sizeof(Result));
+            return (int32_t) be32toh(Result);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static inline int64_t PQBinaryInt64(LPCSTR Value) {
+            uint64_t Result;
+            memcpy(&Result, Value, sizeof(Result));
+            return (int64_t) be64toh(Result);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQResult::IsBinary(int RowNumber, int ColumnNumber) {
+            return fFormat(ColumnNumber) == 1 && GetIsNull(RowNumber, ColumnNumber) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int16_t CPQResult::GetInt16(int RowNumber, int ColumnNumber) {
+            return (int16_t) GetInt64(RowNumber, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int32_t CPQResult::GetInt32(int RowNumber, int ColumnNumber) {
+            return (int32_t) GetInt64(RowNumber, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int64_t CPQResult::GetInt64(int RowNumber, int ColumnNumber) {
+            if (GetIsNull(RowNumber, ColumnNumber))
+                return 0;
+
+            const auto Value = GetValue(RowNumber, ColumnNumber);
+
+            if (fFormat(ColumnNumber) == 0)
+                return strtoll(Value, nullptr, 10);
+
+            switch (fType(ColumnNumber)) {
+                case BOOLOID:
+                case CHAROID:
+                    return (int64_t) (unsigned char) Value[0];
+                case INT2OID:
+                    return PQBinaryInt16(Value);
+                case INT4OID:
+                    return PQBinaryInt32(Value);
+                case OIDOID:
+                    return (int64_t) (uint32_t) PQBinaryInt32(Value);
+                case INT8OID:
+                    return PQBinaryInt64(Value);
+                default:
+                    break;
+            }
+
+            throw EDBError(_T("Column %d (type %u) is not an integer."), ColumnNumber, fType(ColumnNumber));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        float CPQResult::GetFloat(int RowNumber, int ColumnNumber) {
+            return (float) GetDouble(RowNumber, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        double CPQResult::GetDouble(int RowNumber, int ColumnNumber) {
+            if (GetIsNull(RowNumber, ColumnNumber))
+                return 0;
+
+            const auto Value = GetValue(RowNumber, ColumnNumber);
+
+            if (fFormat(ColumnNumber) == 0)
+                return strtod(Value, nullptr);
+
+            switch (fType(ColumnNumber)) {
+                case FLOAT4OID: {
+                    const auto Bits = (uint32_t) PQBinaryInt32(Value);
+                    float Result;
+                    memcpy(&Result, &Bits, sizeof(Result));
+                    return Result;
+                }
+
+                case FLOAT8OID: {
+                    const auto Bits = (uint64_t) PQBinaryInt64(Value);
+                    double Result;
+                    memcpy(&Result, &Bits, sizeof(Result));
+                    return Result;
+                }
+
+                case NUMERICOID:
+                    return strtod(GetNumeric(RowNumber, ColumnNumber).c_str(), nullptr);
+
+                default:
+                    return (double) GetInt64(RowNumber, ColumnNumber);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQResult::GetBool(int RowNumber, int ColumnNumber) {
+            if (GetIsNull(RowNumber, ColumnNumber))
+                return false;
+
+            const auto Value = GetValue(RowNumber, ColumnNumber);
+
+            if (fFormat(ColumnNumber) == 0)
+                return Value[0] == 't';
+
+            return Value[0] != 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int64_t CPQResult::GetTimestamp(int RowNumber, int ColumnNumber) {
+            if (GetIsNull(RowNumber, ColumnNumber))
+                return 0;
+
+            if (fFormat(ColumnNumber) == 0)
+                return (int64_t) ((GetDateTime(RowNumber, ColumnNumber) - PQ_EPOCH_DELTA) * PQ_USECS_PER_DAY);
+
+            const auto Value = GetValue(RowNumber, ColumnNumber);
+
+            switch (fType(ColumnNumber)) {
+                case DATEOID: // days
+                    return (int64_t) PQBinaryInt32(Value) * 86400000000LL;
+                case TIMESTAMPOID:
+                case TIMESTAMPTZOID: // microseconds
+                    return PQBinaryInt64(Value);
+                default:
+                    break;
+            }
+
+            throw EDBError(_T("Column %d (type %u) is not a timestamp."), ColumnNumber, fType(ColumnNumber));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDateTime CPQResult::GetDateTime(int RowNumber, int ColumnNumber) {
+            if (GetIsNull(RowNumber, ColumnNumber))
+                return 0;
+
+            if (fFormat(ColumnNumber) == 0)
+                return StrToDateTimeA(GetValue(RowNumber, ColumnNumber));
+
+            return (CDateTime) PQ_EPOCH_DELTA + (CDateTime) GetTimestamp(RowNumber, ColumnNumber) / PQ_USECS_PER_DAY;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCBYTE CPQResult::GetUUID(int RowNumber, int ColumnNumber) {
+            if (IsBinary(RowNumber, ColumnNumber) && GetLength(RowNumber, ColumnNumber) == 16)
+                return (LPCBYTE) GetValue(RowNumber, ColumnNumber);
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        LPCBYTE CPQResult::GetBytes(int RowNumber, int ColumnNumber, int &Length) {
+            if (GetIsNull(RowNumber, ColumnNumber)) {
+                Length = 0;
+                return nullptr;
+            }
+            Length = GetLength(RowNumber, ColumnNumber);
+            return (LPCBYTE) GetValue(RowNumber, ColumnNumber);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CPQResult::GetNumeric(int RowNumber, int ColumnNumber) {
+            if (GetIsNull(RowNumber, ColumnNumber))
+                return CString();
+
+            const auto Value = GetValue(RowNumber, ColumnNumber);
+
+            if (fFormat(ColumnNumber) == 0)
+                return CString(Value);
+
+            if (GetLength(RowNumber, ColumnNumber) < 8)
+                throw EDBError(_T("Column %d (type %u) is not a numeric."), ColumnNumber, fType(ColumnNumber));
+
+            // ndigits, weight, sign and dscale, then ndigits base 10000 digits
+            const int nDigits = PQBinaryInt16(Value);
+            const int Weight = PQBinaryInt16(Value + 2);
+            const auto Sign = (uint16_t) PQBinaryInt16(Value + 4);
+            const int Scale = PQBinaryInt16(Value + 6);
+
+            switch (Sign) {
+                case 0xC000:
+                    return CString("NaN");
+                case 0xD000:
+                    return CString("Infinity");
+                case 0xF000:
+                    return CString("-Infinity");
+                default:
+                    break;
+            }
+
+            auto Digit = [Value, nDigits](int Index) -> int {
+                return Index >= 0 && Index < nDigits ? PQBinaryInt16(Value + 8 + Index * 2) : 0;
+            };
+
+            CString Result;
+            TCHAR Group[8];
+
+            if (Sign == 0x4000)
+                Result.Append('-');
+
+            if (Weight < 0) {
+                Result.Append('0');
+            } else {
+                for (int i = 0; i <= Weight; ++i) {
+                    Result.Append(Group, snprintf(Group, sizeof(Group), i == 0 ? "%d" : "%04d", Digit(i)));
+                }
+            }
+
+            if (Scale > 0) {
+                Result.Append('.');
+                for (int i = Weight + 1, Left = Scale; Left > 0; ++i, Left -= 4) {
+                    snprintf(Group, sizeof(Group), "%04d", Digit(i));
+                    Result.Append(Group, Left < 4 ? Left : 4);
+                }
+            }
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQResult::DoStatus() {
+            if (m_OnStatus != nullptr) {
+                m_OnStatus(this);
+            }
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPQCopy ---------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy::CPQCopy(CPQCopyFormat AFormat): CObject(), CHeapComponent() {
+            m_Format = AFormat;
+            m_pBuffer = nullptr;
+            m_Size = 0;
+            m_Capacity = 0;
+            m_RowStart = 0;
+            m_Fields = 0;
+            m_Header = false;
+            m_Ended = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy::~CPQCopy() {
+            if (m_pBuffer != nullptr)
+                GHeap->Free(0, m_pBuffer, m_Capacity);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::Clear() {
+            m_Size = 0;
+            m_RowStart = 0;
+            m_Fields = 0;
+            m_Header = false;
+            m_Ended = false;
+            m_Error.Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::Reserve(size_t Size) {
+            if (m_Size + Size <= m_Capacity)
+                return;
+
+            size_t Capacity = m_Capacity == 0 ? PQ_COPY_BUFFER_SIZE : m_Capacity * 2;
+            while (Capacity < m_Size + Size)
+                Capacity *= 2;
+
+            auto pBuffer = (LPSTR) GHeap->ReAlloc(0, m_pBuffer, Capacity, m_Capacity);
+            if (pBuffer == nullptr)
+                throw Delphi::Exception::Exception(_T("Out of memory while expanding COPY buffer"));
+
+            m_pBuffer = pBuffer;
+            m_Capacity = Capacity;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::Put(LPCSTR Data, size_t Length) {
+            Reserve(Length);
+            memcpy(m_pBuffer + m_Size, Data, Length);
+            m_Size += Length;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::PutInt16(int16_t Value) {
+            const auto Data = htobe16((uint16_t) Value);
+            Put((LPCSTR) &Data, sizeof(Data));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::PutInt32(int32_t Value) {
+            const auto Data = htobe32((uint32_t) Value);
+            Put((LPCSTR) &Data, sizeof(Data));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::NextField() {
+            if (m_Format != cfBinary && m_Fields > 0)
+                Put(m_Format == cfCSV ? "," : "\t", 1);
+            m_Fields++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::PutText(LPCSTR Value, size_t Length) {
+            size_t Start = 0;
+            LPCSTR Escape;
+
+            Reserve(Length);
+
+            for (size_t i = 0; i < Length; ++i) {
+                switch (Value[i]) {
+                    case '\\':
+                        Escape = "\\\\";
+                        break;
+                    case '\t':
+                        Escape = "\\t";
+                        break;
+                    case '\n':
+                        Escape = "\\n";
+                        break;
+                    case '\r':
+                        Escape = "\\r";
+                        break;
+                    default:
+                        continue;
+                }
+
+                Put(Value + Start, i - Start);
+                Put(Escape, 2);
+                Start = i + 1;
+            }
+
+            Put(Value + Start, Length - Start);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::PutCSV(LPCSTR Value, size_t Length) {
+            size_t Start = 0;
+
+            // An empty unquoted field is NULL
+            bool Quote = Length == 0;
+            for (size_t i = 0; i < Length && !Quote; ++i) {
+                const auto ch = Value[i];
+                Quote = ch == ',' || ch == '"' || ch == '\n' || ch == '\r';
+            }
+
+            if (!Quote) {
+                Put(Value, Length);
+                return;
+            }
+
+            Put("\"", 1);
+            for (size_t i = 0; i < Length; ++i) {
+                if (Value[i] == '"') {
+                    Put(Value + Start, i + 1 - Start);
+                    Put("\"", 1);
+                    Start = i + 1;
+                }
+            }
+            Put(Value + Start, Length - Start);
+            Put("\"", 1);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::BeginRow() {
+            if (m_Format == cfBinary) {
+                if (!m_Header) {
+                    // Signature, flags and header extension length
+                    Put("PGCOPY\n\377\r\n", 11);
+                    PutInt32(0);
+                    PutInt32(0);
+                    m_Header = true;
+                }
+                m_RowStart = m_Size;
+                PutInt16(0);
+            }
+            m_Fields = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::EndRow() {
+            if (m_Format == cfBinary) {
+                const auto Count = htobe16((uint16_t) m_Fields);
+                memcpy(m_pBuffer + m_RowStart, &Count, sizeof(Count));
+            } else {
+                Put("\n", 1);
+            }
+            m_Fields = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy &CPQCopy::Field(LPCSTR Value, size_t Length) {
+            NextField();
+            switch (m_Format) {
+                case cfText:
+                    PutText(Value, Length);
+                    break;
+                case cfCSV:
+                    PutCSV(Value, Length);
+                    break;
+                case cfBinary:
+                    PutInt32((int32_t) Length);
+                    Put(Value, Length);
+                    break;
+            }
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy &CPQCopy::Int32(int32_t Value) {
+            NextField();
+            if (m_Format == cfBinary) {
+                PutInt32(4);
+                PutInt32(Value);
+            } else {
+                TCHAR Text[16];
+                Put(Text, snprintf(Text, sizeof(Text), "%d", Value));
+            }
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy &CPQCopy::Int64(int64_t Value) {
+            NextField();
+            if (m_Format == cfBinary) {
+                const auto Data = htobe64((uint64_t) Value);
+                PutInt32(8);
+                Put((LPCSTR) &Data, sizeof(Data));
+            } else {
+                TCHAR Text[24];
+                Put(Text, snprintf(Text, sizeof(Text), "%lld", (long long) Value));
+            }
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy &CPQCopy::Double(double Value) {
+            NextField();
+            if (m_Format == cfBinary) {
+                uint64_t Bits;
+                memcpy(&Bits, &Value, sizeof(Bits));
+                Bits = htobe64(Bits);
+                PutInt32(8);
+                Put((LPCSTR) &Bits, sizeof(Bits));
+            } else {
+                TCHAR Text[32];
+                Put(Text, snprintf(Text, sizeof(Text), "%.17g", Value));
+            }
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy &CPQCopy::Bool(bool Value) {
+            NextField();
+            if (m_Format == cfBinary) {
+                const char Data = Value ? 1 : 0;
+                PutInt32(1);
+                Put(&Data, 1);
+            } else {
+                Put(Value ? "t" : "f", 1);
+            }
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQCopy &CPQCopy::Null() {
+            NextField();
+            switch (m_Format) {
+                case cfText:
+                    Put("\\N", 2);
+                    break;
+                case cfCSV:
+                    break;
+                case cfBinary:
+                    PutInt32(-1);
+                    break;
+            }
+            return *this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::End() {
+            if (m_Ended)
+                return;
+
+            if (m_Format == cfBinary) {
+                if (!m_Header) {
+                    Put("PGCOPY\n\377\r\n", 11);
+                    PutInt32(0);
+                    PutInt32(0);
+                    m_Header = true;
+                }
+                PutInt16(-1);
+            }
+
+            m_Ended = true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQCopy::Abort(const CString &Error) {
+            m_Error = Error.IsEmpty() ? CString("COPY aborted") : Error;
+            m_Ended = true;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPQParamValues --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Text format arrays for PQsendQueryParams built from the query parameters.
+        class CPQParamValues {
+        private:
+
+            CStringList m_Text;
+
+        public:
+
+            int Count;
+
+            Oid *Types;
+            const char **Values;
+
+            explicit CPQParamValues(const CPQParams &Params) {
+                Count = Params.Count();
+
+                Types = nullptr;
+                Values = nullptr;
+
+                if (Count == 0)
+                    return;
+
+                Types = new Oid[Count];
+                Values = new const char *[Count];
+
+                for (int i = 0; i < Count; ++i) {
+                    const CVariant &Value = Params[i];
+
+                    Types[i] = 0;
+
+                    switch (Value.VType) {
+                        case vtInteger:
+                            Types[i] = INT4OID;
+                            m_Text.Add(CString().Format("%d", Value.varInteger));
+                            break;
+                        case vtBoolean:
+                            Types[i] = BOOLOID;
+                            m_Text.Add(Value.varBoolean ? "t" : "f");
+                            break;
+                        case vtChar:
+                            m_Text.Add(CString(Value.varChar));
+                            break;
+                        case vtDouble:
+                            Types[i] = FLOAT8OID;
+                            m_Text.Add(CString().Format("%.17g", Value.varDouble));
+                            break;
+                        case vtString:
+                            m_Text.Add(*Value.varString);
+                            break;
+                        case vtPChar:
+                            m_Text.Add(Value.varPChar);
+                            break;
+                        case vtUnsigned:
+                            Types[i] = INT8OID;
+                            m_Text.Add(CString().Format("%u", Value.varUnsigned));
+                            break;
+                        case vtAnsiString:
+                            m_Text.Add(Value.varAnsiString);
+                            break;
+                        case vtFloat:
+                            Types[i] = FLOAT4OID;
+                            m_Text.Add(CString().Format("%.9g", Value.varFloat));
+                            break;
+                        case vtUInt64:
+                            Types[i] = NUMERICOID;
+                            m_Text.Add(CString().Format("%llu", (unsigned long long) Value.varUInt64));
+                            break;
+                        case vtInt64:
+                            Types[i] = INT8OID;
+                            m_Text.Add(CString().Format("%lld", (long long) Value.varInt64));
+                            break;
+                        case vtUnicodeString:
+                            m_Text.Add(*Value.varUnicodeString);
+                            break;
+                        default:
+                            // vtEmpty, vtPointer, vtObject and the rest are sent as NULL
+                            m_Text.Add(CString());
+                            break;
+                    }
+                }
+
+                for (int i = 0; i < Count; ++i) {
+                    switch (Params[i].VType) {
+                        case vtEmpty:
+                        case vtPointer:
+                        case vtObject:
+                        case vtWideChar:
+                        case vtPWideChar:
+                        case vtVariant:
+                        case vtWideString:
+                            Values[i] = nullptr;
+                            break;
+                        default:
+                            Values[i] = m_Text[i].c_str();
+                            break;
+                    }
+                }
+            }
+
+            CPQParamValues(const CPQParamValues &) = delete;
+            CPQParamValues &operator=(const CPQParamValues &) = delete;
+
+            ~CPQParamValues() {
+                delete [] Types;
+                delete [] Values;
+            }
+
+            /// Cache key part: the same SQL prepared with other parameter types is another statement.
+            CString TypesKey() const {
+                CString Result;
+                for (int i = 0; i < Count; ++i) {
+                    Result << (i == 0 ? "\n-- " : ",");
+                    Result << (unsigned int) Types[i];
+                }
+                return Result;
+            }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPQQuery --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQQuery::CPQQuery(): CCollection(this) {
+            m_StartTime = 0;
+            m_pConnection = nullptr;
+
+            m_Prepared = false;
+            m_ResultFormat = 0;
+
+            m_ChunkSize = 0;
+            m_RowMode = false;
+            m_Paused = false;
+            m_Cancelled = false;
+
+            m_CopyState = csNone;
+
+            m_Statement = 0;
+            m_Hidden = 0;
+            m_Statements = 0;
+
+            m_OnSendQuery = nullptr;
+            m_OnExecuted = nullptr;
+
+            m_OnResultStatus = nullptr;
+            m_OnResult = nullptr;
+            m_OnRows = nullptr;
+
+            m_OnCopyIn = nullptr;
+            m_OnCopyOut = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQQuery::CPQQuery(CPQConnection *AConnection): CPQQuery() {
+            m_pConnection = AConnection;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQQuery::~CPQQuery() {
+            CPQQuery::Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQResult *CPQQuery::GetResult(int Index) {
+            return (CPQResult *) inherited::GetItem(Index);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::SetConnection(CPQConnection *Value) {
+            if (m_pConnection != Value) {
+                m_pConnection = Value;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::AddResult(PGresult *AResult) {
+            if (m_Cancelled) {
+                PQclear(AResult);
+                return;
+            }
+
+            auto pQueryResult = new CPQResult(this, AResult);
+#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+            pQueryResult->OnStatus([this](auto &&AResult) { DoResultStatus(AResult); });
+#else
+            pQueryResult->OnStatus(std::bind(&CPQQuery::DoResultStatus, this, _1));
+#endif
+            const auto status = pQueryResult->ResultStatus();
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            const auto streamed = status == PGRES_SINGLE_TUPLE || status == PGRES_TUPLES_CHUNK;
+#else
+            const auto streamed = status == PGRES_SINGLE_TUPLE;
+#endif
+            if (streamed && m_OnRows != nullptr) {
+                DoRows(pQueryResult);
+                delete pQueryResult;
+                return;
+            }
+
+            DoResult(pQueryResult, status);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::SetRowMode() {
+            if (m_ChunkSize <= 0 || m_RowMode)
+                return;
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            if (m_ChunkSize > 1) {
+                m_RowMode = PQsetChunkedRowsMode(m_pConnection->Handle(), m_ChunkSize) == 1;
+                return;
+            }
+#endif
+            m_RowMode = PQsetSingleRowMode(m_pConnection->Handle()) == 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::GetResult() {
+            PGresult *pResult;
+
+            while ((pResult = m_pConnection->GetResult()) != nullptr) {
+                AddResult(pResult);
+            }
+
+            DoExecuted();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::SendQuery() {
+            if (m_pConnection == nullptr)
+                throw EDBError(_T("Not set connection!"));
+
+            if (!m_pConnection->Connected())
+                throw EDBError(_T("Not connected!"));
+
+            if (m_SQL.Count() == 0)
+                throw EDBError(_T("Empty SQL query!"));
+
+            m_RowMode = false;
+            m_CopyState = csNone;
+
+            if (m_Params.Count() > 0 || m_ResultFormat != 0) {
+                CPQParamValues Params(m_Params);
+                if (PQsendQueryParams(m_pConnection->Handle(), m_SQL.Text().c_str(), Params.Count, Params.Types,
+                        Params.Values, nullptr, nullptr, m_ResultFormat) == 0) {
+                    throw EDBError("PQsendQueryParams failed: %s", m_pConnection->GetErrorMessage());
+                }
+            } else {
+                if (PQsendQuery(m_pConnection->Handle(), m_SQL.Text().c_str()) == 0) {
+                    throw EDBError("PQsendQuery failed: %s", m_pConnection->GetErrorMessage());
+                }
+            }
+
+            m_StartTime = Now();
+
+            DoSendQuery();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::SendPipeline() {
+            if (m_pConnection == nullptr)
+                throw EDBError(_T("Not set connection!"));
+
+            if (!m_pConnection->Connected())
+                throw EDBError(_T("Not connected!"));
+
+            if (m_SQL.Count() == 0)
+                throw EDBError(_T("Empty SQL query!"));
+#ifdef LIBPQ_HAS_PIPELINING
+            m_StatementKey.Clear();
+
+            m_RowMode = false;
+            m_Statement = 0;
+            m_Hidden = 0;
+            m_Statements = 0;
+
+            if (m_Prepared || m_Params.Count() > 0) {
+                SendStatement();
+            } else {
+                // The extended protocol takes one statement per call, CanPipeline() keeps anything else away
+                if (PQsendQueryParams(m_pConnection->Handle(), m_SQL.Text().c_str(), 0, nullptr, nullptr, nullptr, nullptr, m_ResultFormat) == 0)
+                    throw EDBError("PQsendQueryParams failed: %s", m_pConnection->GetErrorMessage());
+                m_Statements = 1;
+            }
+
+            if (PQpipelineSync(m_pConnection->Handle()) == 0)
+                throw EDBError("PQpipelineSync failed: %s", m_pConnection->GetErrorMessage());
+#else
+            throw EDBError(_T("Pipeline mode is not supported by libpq."));
+#endif
+            m_StartTime = Now();
+
+            DoSendQuery();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQQuery::CanPipeline() const {
+            if (IsCopy())
+                return false;
+
+            if (m_Prepared || m_Params.Count() > 0 || m_ResultFormat != 0)
+                return true;
+
+            // A ';' followed by anything but blanks and ';' may start another statement (or sit in a literal)
+            const CString SQL(m_SQL.Text());
+            bool bSeparator = false;
+            for (size_t i = 0; i < SQL.Size(); ++i) {
+                const auto ch = SQL.at(i);
+                if (ch == ';') {
+                    bSeparator = true;
+                } else if (bSeparator && ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n') {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::SendStatement() {
+            const auto Handle = m_pConnection->Handle();
+            const CString SQL(m_SQL.Text());
+
+            CPQParamValues Params(m_Params);
+
+            auto pConnection = dynamic_cast<CPQPollConnection *> (m_pConnection);
+
+            if (m_Prepared && pConnection != nullptr) {
+                CString Key(SQL);
+                Key << Params.TypesKey();
+
+                CString Evicted;
+                auto pStatement = pConnection->Statements().Find(Key);
+
+                if (pStatement == nullptr) {
+                    pStatement = pConnection->Statements().Add(Key, Evicted);
+                    if (PQsendPrepare(Handle, pStatement->Name.c_str(), SQL.c_str(), Params.Count, Params.Types) == 0) {
+                        pConnection->Statements().Remove(Key);
+                        throw EDBError("PQsendPrepare failed: %s", m_pConnection->GetErrorMessage());
+                    }
+                    m_Hidden++;
+                }
+
+                m_StatementKey = Key;
+
+                if (PQsendQueryPrepared(Handle, pStatement->Name.c_str(), Params.Count, Params.Values, nullptr, nullptr, m_ResultFormat) == 0)
+                    throw EDBError("PQsendQueryPrepared failed: %s", m_pConnection->GetErrorMessage());
+
+                m_Statements++;
+
+                // Queued after our statement, so queries already in the pipeline still find the evicted one
+                if (!Evicted.IsEmpty()) {
+                    const CString Deallocate(CString().Format("DEALLOCATE %s", Evicted.c_str()));
+                    if (PQsendQueryParams(Handle, Deallocate.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 0) == 0)
+                        throw EDBError("PQsendQueryParams failed: %s", m_pConnection->GetErrorMessage());
+                }
+            } else {
+                if (PQsendQueryParams(Handle, SQL.c_str(), Params.Count, Params.Types, Params.Values, nullptr, nullptr, m_ResultFormat) == 0)
+                    throw EDBError("PQsendQueryParams failed: %s", m_pConnection->GetErrorMessage());
+
+                m_Statements++;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQQuery::CancelQuery(CString &Error) {
+            const auto cancel = m_pConnection->GetCancel();
+            Error.Clear();
+            Error.SetLength(512);
+            const auto result = PQcancel(cancel, Error.Data(), (int) Error.Size());
+            PQfreeCancel(cancel);
+            return result == 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::DoSendQuery() {
+            if (m_OnSendQuery != nullptr) {
+                try {
+                    m_OnSendQuery(this);
+                } catch (...) {
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::DoResultStatus(CPQResult *AResult) {
+            if (m_OnResultStatus != nullptr) {
+                try {
+                    m_OnResultStatus(AResult);
+                } catch (...) {
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::DoResult(CPQResult *AResult, ExecStatusType AExecStatus) {
+            if (m_OnResult != nullptr) {
+                try {
+                    m_OnResult(AResult, AExecStatus);
+                } catch (...) {
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::DoRows(CPQResult *AResult) {
+            if (m_OnRows != nullptr) {
+                try {
+                    m_OnRows(AResult);
+                } catch (...) {
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::DoCopyIn() {
+            if (m_OnCopyIn != nullptr && !m_Cancelled) {
+                try {
+                    m_OnCopyIn(this, m_Copy);
+                } catch (Delphi::Exception::Exception &E) {
+                    m_Copy.Abort(E.what());
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::DoCopyOut(LPCSTR AData, int ALength) {
+            if (m_OnCopyOut != nullptr && !m_Cancelled) {
+                try {
+                    m_OnCopyOut(this, AData, ALength);
+                } catch (...) {
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQQuery::DoExecuted() {
+            if (m_OnExecuted != nullptr) {
+                try {
+                    m_OnExecuted(this);
+                } catch (...) {
+                }
+            }
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPQPollQuery ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollQuery::CPQPollQuery(CPQConnectPoll *AConnectPoll): CPQQuery(), CPollConnection(AConnectPoll->ptrQueryManager()) {
+            m_pConnectPoll = AConnectPoll;
+
+            m_Ticket = 0;
+            m_Queued = 0;
+            m_Deadline = 0;
+
+            m_Timeout = 0;
+
+            m_Route = rtWrite;
+
+            m_OnExecuted = nullptr;
+            m_OnException = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollQuery::~CPQPollQuery() {
+            if (m_Ticket != 0)
+                RemoveFromQueue();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQPollQuery::Start() {
+            try {
+                // Queries already waiting go first
+                if (m_Ticket == 0 && m_pConnectPoll->Queue().Count() > 0) {
+                    if (m_pConnectPoll->Queue().Count() == PQ_POLL_QUEUE_MAX)
+                        throw EPollServerError(_T("Query queue is full."));
+
+                    const auto Index = AddToQueue();
+                    m_pConnectPoll->CheckQueue();
+                    return Index;
+                }
+
+                if (m_Deadline == 0) {
+                    const auto timeout = m_Timeout > 0 ? m_Timeout : m_pConnectPoll->QueryTimeout();
+                    if (timeout > 0)
+                        m_Deadline = Now() + (CDateTime) timeout / MSecsPerDay;
+                }
+
+                const auto role = m_pConnectPoll->RouteRole(m_Route);
+
+#ifdef LIBPQ_HAS_PIPELINING
+                const auto pipeline = (m_pConnectPoll->PipelineDepth() > 0 || Prepared()) && CanPipeline();
+#else
+                const auto pipeline = false;
+#endif
+                auto pConnection = m_pConnectPoll->GetReadyConnection(role);
+
+                if (pConnection == nullptr && pipeline)
+                    pConnection = m_pConnectPoll->GetPipelineConnection(role);
+
+                if (pConnection != nullptr) {
+                    m_pConnectPoll->QueryStarted(this);
+
+                    if (pipeline) {
+                        try {
+                            pConnection->PipelineStart(this);
+                        } catch (Delphi::Exception::Exception &E) {
+                            DoException(E);
+                            delete this;
+                        }
+                    } else {
+                        try {
+                            pConnection->QueryStart(this);
+                        } catch (Delphi::Exception::Exception &E) {
+                            DoException(E);
+                            pConnection->QueryStop();
+                        }
+                    }
+                } else {
+                    // A queued query keeps its place at the head of the queue
+                    if (m_Ticket != 0)
+                        return (int) (m_Ticket - m_pConnectPoll->Queue().Head());
+
+                    if (m_pConnectPoll->Queue().Count() == PQ_POLL_QUEUE_MAX)
+                        throw EPollServerError(_T("Query queue is full."));
+
+                    return AddToQueue();
+                }
+
+                return POLL_QUERY_START_OK;
+            } catch (Delphi::Exception::Exception &E) {
+                DoException(E);
+                if (m_Ticket != 0)
+                    delete this;
+            }
+
+            return POLL_QUERY_START_FAIL;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQPollQuery::Cancel() {
+            if (m_Ticket != 0) {
+                RemoveFromQueue();
+                m_pConnectPoll->m_Stats.Cancelled++;
+
+                DoException(EPollServerError(_T("Query cancelled.")));
+                delete this;
+
+                return true;
+            }
+
+            auto pConnection = dynamic_cast<CPQPollConnection *> (Connection());
+            const auto paused = pConnection != nullptr && pConnection->Paused();
+
+            if (!Interrupt(EPollServerError(_T("Query cancelled."))))
+                return false;
+
+            m_pConnectPoll->m_Stats.Cancelled++;
+
+            // The query may be freed by this call
+            if (paused && !pConnection->Reading())
+                m_pConnectPoll->Wake(pConnection);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQPollQuery::Interrupt(const Delphi::Exception::Exception &E) {
+            auto pConnection = dynamic_cast<CPQPollConnection *> (Connection());
+
+            if (m_Cancelled || pConnection == nullptr || pConnection->ConnectionStatus() != qsWait)
+                return false;
+
+            m_Cancelled = true;
+
+            try {
+                if (CopyState() == csCopyIn) {
+                    // Ending COPY with an error message makes the server abort it
+                    Copy().Abort(E.what());
+                    CopyFlush();
+                } else if (pConnection->WorkQuery() == this || (pConnection->PipelineCount() > 0 && pConnection->Pipeline(0) == this)) {
+                    // Only the statement running now is cancelled on the server, the rest are just dropped
+                    pConnection->Cancel();
+                }
+            } catch (Delphi::Exception::Exception &CE) {
+                m_pConnectPoll->DoPQConnectException(pConnection, CE);
             }
 
-            m_StartTime = Now();
+            DoException(E);
 
-            DoSendQuery();
+            return true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        bool CPQQuery::CancelQuery(CString &Error) {
-            const auto cancel = m_pConnection->GetCancel();
-            Error.Clear();
-            Error.SetLength(512);
-            const auto result = PQcancel(cancel, Error.Data(), (int) Error.Size());
-            PQfreeCancel(cancel);
-            return result == 1;
+        void CPQPollQuery::Close() {
+
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQQuery::DoSendQuery() {
-            if (m_OnSendQuery != nullptr) {
-                try {
-                    m_OnSendQuery(this);
-                } catch (...) {
-                }
+        int CPQPollQuery::AddToQueue() {
+            return m_pConnectPoll->AddToQueue(this);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollQuery::RemoveFromQueue() {
+            m_pConnectPoll->RemoveFromQueue(this);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollQuery::Resume() {
+            if (!m_Paused)
+                return;
+
+            m_Paused = false;
+
+            auto pConnection = dynamic_cast<CPQPollConnection *> (Connection());
+
+            // Called from OnRows the running read loop just carries on
+            if (pConnection == nullptr || pConnection->Reading())
+                return;
+
+            // The query may be finished and freed by this call
+            m_pConnectPoll->Wake(pConnection);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollQuery::CopyFlush() {
+            auto pConnection = dynamic_cast<CPQPollConnection *> (Connection());
+
+            if (pConnection == nullptr || pConnection->Reading() || CopyState() != csCopyIn)
+                return;
+
+            auto pConnectPoll = m_pConnectPoll;
+            try {
+                pConnection->CheckCopyIn();
+            } catch (Delphi::Exception::Exception &E) {
+                pConnectPoll->DoPQConnectException(pConnection, E);
+                pConnection->ConnectionStatus(qsError);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQQuery::DoResultStatus(CPQResult *AResult) {
-            if (m_OnResultStatus != nullptr) {
+        void CPQPollQuery::DoExecuted() {
+            if (m_OnExecuted != nullptr && !m_Cancelled) {
                 try {
-                    m_OnResultStatus(AResult);
+                    m_OnExecuted(this);
                 } catch (...) {
                 }
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQQuery::DoResult(CPQResult *AResult, ExecStatusType AExecStatus) {
-            if (m_OnResult != nullptr) {
+        void CPQPollQuery::DoException(const Delphi::Exception::Exception &E) {
+            if (m_OnException != nullptr) {
                 try {
-                    m_OnResult(AResult, AExecStatus);
+                    m_OnException(this, E);
                 } catch (...) {
                 }
             }
         }
+
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQQuery::DoExecuted() {
-            if (m_OnExecuted != nullptr) {
-                try {
-                    m_OnExecuted(this);
-                } catch (...) {
-                }
+        //-- CPQPollQueue ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollQueue::CPQPollQueue(): CObject(), CHeapComponent() {
+            m_Capacity = PQ_POLL_QUEUE_SIZE;
+            m_pItems = (CPQPollQuery **) GHeap->Alloc(HEAP_ZERO_MEMORY, m_Capacity * sizeof(CPQPollQuery *));
+            // Ticket 0 means "not queued"
+            m_Head = 1;
+            m_Tail = 1;
+            m_Count = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollQueue::~CPQPollQueue() {
+            GHeap->Free(0, m_pItems, m_Capacity * sizeof(CPQPollQuery *));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQPollQueue::Grow() {
+            const auto Capacity = m_Capacity * 2;
+            auto pItems = (CPQPollQuery **) GHeap->Alloc(HEAP_ZERO_MEMORY, Capacity * sizeof(CPQPollQuery *));
+
+            // Tickets stay valid: each one just maps to its slot in the larger ring
+            for (size_t Ticket = m_Head; Ticket < m_Tail; ++Ticket)
+                pItems[Ticket & (Capacity - 1)] = m_pItems[Ticket & (m_Capacity - 1)];
+
+            GHeap->Free(0, m_pItems, m_Capacity * sizeof(CPQPollQuery *));
+
+            m_pItems = pItems;
+            m_Capacity = Capacity;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CPQPollQueue::Push(CPQPollQuery *AQuery) {
+            if (m_Tail - m_Head == m_Capacity)
+                Grow();
+
+            m_pItems[m_Tail & (m_Capacity - 1)] = AQuery;
+            m_Count++;
+
+            return m_Tail++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollQuery *CPQPollQueue::First() {
+            // Drop the removed entries from the head
+            while (m_Head < m_Tail && m_pItems[m_Head & (m_Capacity - 1)] == nullptr)
+                m_Head++;
+            return m_Head < m_Tail ? m_pItems[m_Head & (m_Capacity - 1)] : nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollQuery *CPQPollQueue::Pop() {
+            auto pQuery = First();
+            if (pQuery != nullptr) {
+                m_pItems[m_Head++ & (m_Capacity - 1)] = nullptr;
+                m_Count--;
+            }
+            return pQuery;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CPQPollQueue::Remove(size_t Ticket, CPQPollQuery *AQuery) {
+            if (Ticket < m_Head || Ticket >= m_Tail)
+                return false;
+
+            auto &Item = m_pItems[Ticket & (m_Capacity - 1)];
+            if (Item != AQuery)
+                return false;
+
+            Item = nullptr;
+            m_Count--;
+
+            if (Ticket == m_Tail - 1) {
+                while (m_Tail > m_Head && m_pItems[(m_Tail - 1) & (m_Capacity - 1)] == nullptr)
+                    m_Tail--;
             }
+
+            return true;
         }
 
         //--------------------------------------------------------------------------------------------------------------
 
-        //-- CPQPollQuery ----------------------------------------------------------------------------------------------
+        //-- CPQConnectPollEvent ---------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
 
-        CPQPollQuery::CPQPollQuery(CPQConnectPoll *AConnectPoll): CPQQuery(), CPollConnection(AConnectPoll->ptrQueryManager()) {
-            m_pConnectPoll = AConnectPoll;
+        CPQConnectPollEvent::CPQConnectPollEvent(): CObject() {
+            m_OnReceiver = nullptr;
+            m_OnProcessor = nullptr;
 
-            m_OnExecuted = nullptr;
-            m_OnException = nullptr;
+            m_OnNotify = nullptr;
+
+            m_OnPQError = nullptr;
+            m_OnPQTimeOut = nullptr;
+            m_OnPQStatus = nullptr;
+            m_OnPQPollingStatus = nullptr;
+
+            m_OnConnectException = nullptr;
+            m_OnServerException = nullptr;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQPollQuery::Start() {
-            try {
-                auto pConnection = m_pConnectPoll->GetReadyConnection();
+        void CPQConnectPollEvent::DoPQReceiver(CPQConnection *AConnection, const PGresult *AResult) {
+            if (m_OnReceiver != nullptr) {
+                m_OnReceiver(AConnection, AResult);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                if (pConnection != nullptr) {
-                    try {
-                        pConnection->QueryStart(this);
-                    } catch (Delphi::Exception::Exception &E) {
-                        DoException(E);
-                        pConnection->QueryStop();
-                    }
-                } else {
-                    if (m_pConnectPoll->Queue().Count() == 0x0FFF)
-                        throw EPollServerError(_T("Query queue is full."));
+        void CPQConnectPollEvent::DoPQProcessor(CPQConnection *AConnection, LPCSTR AMessage) {
+            if (m_OnProcessor != nullptr) {
+                m_OnProcessor(AConnection, AMessage);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                    return AddToQueue();
-                }
+        void CPQConnectPollEvent::DoPQNotify(CPQConnection *AConnection, PGnotify *ANotify) {
+            if (m_OnNotify != nullptr) {
+                m_OnNotify(AConnection, ANotify);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                return POLL_QUERY_START_OK;
-            } catch (Delphi::Exception::Exception &E) {
-                DoException(E);
+        void CPQConnectPollEvent::DoPQError(CPQConnection *AConnection) {
+            if (m_OnPQError != nullptr) {
+                m_OnPQError(AConnection);
             }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            return POLL_QUERY_START_FAIL;
+        void CPQConnectPollEvent::DoPQTimeOut(CPQConnection *AConnection) {
+            if (m_OnPQTimeOut != nullptr) {
+                m_OnPQTimeOut(AConnection);
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQPollQuery::Close() {
+        void CPQConnectPollEvent::DoPQStatus(CPQConnection *AConnection) {
+            if (m_OnPQStatus != nullptr) {
+                m_OnPQStatus(AConnection);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
+        void CPQConnectPollEvent::DoPQPollingStatus(CPQConnection *AConnection) {
+            if (m_OnPQPollingStatus != nullptr) {
+                m_OnPQPollingStatus(AConnection);
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CPQPollQuery::AddToQueue() {
-            return m_pConnectPoll->AddToQueue(this);
+        void CPQConnectPollEvent::DoPQConnectException(CPQConnection *AConnection,
+                const Delphi::Exception::Exception &E) {
+            if (m_OnConnectException != nullptr) {
+                m_OnConnectException(AConnection, E);
+            }
         }
+
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQPollQuery::RemoveFromQueue() {
-            m_pConnectPoll->RemoveFromQueue(this);
+        //-- CPQConnectPoll --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQConnectPoll::CPQConnectPoll(size_t ASizeMin, size_t ASizeMax): CPQConnectPollEvent(), CEPollClient() {
+            m_pTimer = nullptr;
+            m_TimerInterval = 0;
+
+            m_Active = false;
+
+            m_SizeMin = ASizeMin;
+            m_SizeMax = ASizeMax;
+
+            m_PipelineDepth = 0;
+
+            m_QueueTimeout = 0;
+            m_QueryTimeout = 0;
+            m_WaitTarget = 0;
+            m_IdleTimeout = 30 * 60;
+            m_ConnectTimeout = 10 * 1000;
+            m_StartupTimeout = 10 * 1000;
+
+            m_SizeLimit = ASizeMax;
+
+            m_PackTime = 0;
+
+            m_Failures = 0;
+            m_RetryTime = 0;
+
+            m_TickWait = 0;
+            m_TickWaited = 0;
+
+            m_Dispatching = 0;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQPollQuery::DoExecuted() {
-            if (m_OnExecuted != nullptr) {
-                try {
-                    m_OnExecuted(this);
-                } catch (...) {
-                }
+        CPQConnectPoll::CPQConnectPoll(const CPQConnInfo &AConnInfo, size_t ASizeMin, size_t ASizeMax):
+            CPQConnectPoll(ASizeMin, ASizeMax) {
+            m_ConnInfo = AConnInfo;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQConnectPoll::~CPQConnectPoll() {
+            CList Subscribers;
+
+            for (int i = 0; i < m_Channels.Count(); ++i)
+                m_Subscribers.FindAll(m_Channels[i], Subscribers);
+            for (int i = 0; i < Subscribers.Count(); ++i)
+                delete (CPQSubscriber *) Subscribers[i];
+            m_Subscribers.Clear();
+
+            ClearEndpoints();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::Assign(const CPQConnectPoll &Other) {
+            m_TimerInterval = Other.m_TimerInterval;
+            m_Active = Other.m_Active;
+            m_SizeMin = Other.m_SizeMin;
+            m_SizeMax = Other.m_SizeMax;
+            m_PipelineDepth = Other.m_PipelineDepth;
+            m_QueueTimeout = Other.m_QueueTimeout;
+            m_QueryTimeout = Other.m_QueryTimeout;
+            m_WaitTarget = Other.m_WaitTarget;
+            m_IdleTimeout = Other.m_IdleTimeout;
+            m_ConnectTimeout = Other.m_ConnectTimeout;
+            m_StartupTimeout = Other.m_StartupTimeout;
+            m_ConnInfo = Other.m_ConnInfo;
+
+            ClearEndpoints();
+            for (int i = 0; i < Other.EndpointCount(); ++i) {
+                const auto pEndpoint = Other.Endpoints(i);
+                AddEndpoint(pEndpoint->ConnInfo, pEndpoint->Weight, pEndpoint->Role);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQPollQuery::DoException(const Delphi::Exception::Exception &E) {
-            if (m_OnException != nullptr) {
-                try {
-                    m_OnException(this, E);
-                } catch (...) {
+        int CPQConnectPoll::AddEndpoint(const CPQConnInfo &AConnInfo, int AWeight, CPQServerRole ARole) {
+            auto pEndpoint = new CPQEndpoint();
+
+            pEndpoint->ConnInfo = AConnInfo;
+            pEndpoint->Weight = AWeight < 1 ? 1 : AWeight;
+            pEndpoint->Role = ARole;
+
+            return m_Endpoints.Add(pEndpoint);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::ClearEndpoints() {
+            for (int i = 0; i < m_Endpoints.Count(); ++i)
+                delete Endpoints(i);
+            m_Endpoints.Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQServerRole CPQConnectPoll::RouteRole(CPQRoute ARoute) const {
+            if (m_Endpoints.Count() == 0)
+                return srUnknown;
+            return ARoute == rtRead ? srStandby : srPrimary;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQConnectPoll::EndpointConnections(int Index) const {
+            int Result = 0;
+            for (int i = 0; i < m_ConnectManager.Count(); ++i) {
+                if (GetConnection(i)->Endpoint() == Index)
+                    Result++;
+            }
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CPQConnectPoll::SelectEndpoint(CPQServerRole ARole, CDateTime Now) const {
+            CPQEndpoint *pEndpoint;
+
+            int Result = -1;
+            double Load = 0;
+
+            // The endpoints of the role asked for first, then a primary may serve reads and a new server writes
+            for (int pass = 0; pass < 2 && Result == -1; ++pass) {
+                for (int i = 0; i < m_Endpoints.Count(); ++i) {
+                    pEndpoint = Endpoints(i);
+
+                    if (!pEndpoint->Healthy && Now < pEndpoint->RetryTime)
+                        continue;
+
+                    if (pass == 0) {
+                        if (ARole != srUnknown && pEndpoint->Role != ARole)
+                            continue;
+                    } else if (ARole == srPrimary && pEndpoint->Role == srStandby) {
+                        continue;
+                    }
+
+                    // Weighted: the endpoint with the fewest connections per weight unit gets the next one
+                    const auto load = (double) EndpointConnections(i) / pEndpoint->Weight;
+                    if (Result == -1 || load < Load) {
+                        Result = i;
+                        Load = load;
+                    }
                 }
             }
-        }
 
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::EndpointFailed(int Index) {
+            if (Index >= m_Endpoints.Count())
+                return;
+
+            int &Failures = Index < 0 ? m_Failures : Endpoints(Index)->Failures;
+            CDateTime &RetryTime = Index < 0 ? m_RetryTime : Endpoints(Index)->RetryTime;
+
+            if (Index < 0) {
+                m_ConnInfo.PingValid(false);
+            } else {
+                Endpoints(Index)->Healthy = false;
+                Endpoints(Index)->ConnInfo.PingValid(false);
+            }
+
+            Failures++;
+
+            // 2, 4, 8 ... 60 seconds
+            const auto delay = Failures < 6 ? 1 << Failures : 60;
+            RetryTime = Now() + (CDateTime) delay / SecsPerDay;
+        }
         //--------------------------------------------------------------------------------------------------------------
 
-        //-- CPQConnectPollEvent ---------------------------------------------------------------------------------------
+        void CPQConnectPoll::EndpointReady(CPQPollConnection *AConnection) {
+            const auto index = AConnection->Endpoint();
 
-        //--------------------------------------------------------------------------------------------------------------
+            if (index < 0) {
+                m_Failures = 0;
+                m_RetryTime = 0;
+                return;
+            }
 
-        CPQConnectPollEvent::CPQConnectPollEvent(): CObject() {
-            m_OnReceiver = nullptr;
-            m_OnProcessor = nullptr;
+            if (index >= m_Endpoints.Count())
+                return;
 
-            m_OnNotify = nullptr;
+            auto pEndpoint = Endpoints(index);
 
-            m_OnPQError = nullptr;
-            m_OnPQTimeOut = nullptr;
-            m_OnPQStatus = nullptr;
-            m_OnPQPollingStatus = nullptr;
+            pEndpoint->Healthy = true;
+            pEndpoint->Failures = 0;
 
-            m_OnConnectException = nullptr;
-            m_OnServerException = nullptr;
+            if (AConnection->Role() != srUnknown)
+                pEndpoint->Role = AConnection->Role();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQReceiver(CPQConnection *AConnection, const PGresult *AResult) {
-            if (m_OnReceiver != nullptr) {
-                m_OnReceiver(AConnection, AResult);
-            }
+        bool CPQConnectPoll::ConnectAllowed(int Index, CDateTime Now) const {
+            if (Index < 0)
+                return Now >= m_RetryTime;
+
+            if (Index >= m_Endpoints.Count())
+                return false;
+
+            const auto pEndpoint = Endpoints(Index);
+
+            return pEndpoint->Healthy || Now >= pEndpoint->RetryTime;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQProcessor(CPQConnection *AConnection, LPCSTR AMessage) {
-            if (m_OnProcessor != nullptr) {
-                m_OnProcessor(AConnection, AMessage);
-            }
+        void CPQConnectPoll::Subscribe(const CString &Channel, Pointer Sender, COnPQSubscriberNotifyEvent Handler) {
+            auto pSubscriber = new CPQSubscriber();
+
+            pSubscriber->Channel = Channel;
+            pSubscriber->Sender = Sender;
+            pSubscriber->Handler = std::move(Handler);
+
+            if (m_Subscribers.Find(Channel) == nullptr)
+                m_Channels.Add(Channel);
+
+            m_Subscribers.Add(Channel, pSubscriber);
+
+            CheckListener();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQNotify(CPQConnection *AConnection, PGnotify *ANotify) {
-            if (m_OnNotify != nullptr) {
-                m_OnNotify(AConnection, ANotify);
+        bool CPQConnectPoll::Unsubscribe(const CString &Channel, Pointer Sender) {
+            CList Subscribers;
+            CPQSubscriber *pSubscriber;
+
+            m_Subscribers.FindAll(Channel, Subscribers);
+
+            for (int i = 0; i < Subscribers.Count(); ++i) {
+                pSubscriber = (CPQSubscriber *) Subscribers[i];
+                if (pSubscriber->Sender == Sender) {
+                    m_Subscribers.Remove(Channel, pSubscriber);
+
+                    // The handler being called may unsubscribe: free it once the delivery is over
+                    if (m_Dispatching > 0) {
+                        pSubscriber->Removed = true;
+                        m_Removed.Add(pSubscriber);
+                    } else {
+                        delete pSubscriber;
+                    }
+
+                    if (m_Subscribers.Find(Channel) == nullptr) {
+                        const auto index = m_Channels.IndexOf(Channel);
+                        if (index != -1)
+                            m_Channels.Delete(index);
+                        CheckListener();
+                    }
+
+                    return true;
+                }
             }
+
+            return false;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQError(CPQConnection *AConnection) {
-            if (m_OnPQError != nullptr) {
-                m_OnPQError(AConnection);
+        void CPQConnectPoll::UnsubscribeAll(Pointer Sender) {
+            for (int i = m_Channels.Count() - 1; i >= 0; --i) {
+                const CString Channel(m_Channels[i]);
+                while (Unsubscribe(Channel, Sender)) {
+                }
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQTimeOut(CPQConnection *AConnection) {
-            if (m_OnPQTimeOut != nullptr) {
-                m_OnPQTimeOut(AConnection);
+        CPQPollConnection *CPQConnectPoll::GetListener() const {
+            for (int i = 0; i < m_ConnectManager.Count(); ++i) {
+                if (GetConnection(i)->Listener())
+                    return GetConnection(i);
             }
+            return nullptr;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQStatus(CPQConnection *AConnection) {
-            if (m_OnPQStatus != nullptr) {
-                m_OnPQStatus(AConnection);
+        void CPQConnectPoll::CheckListener() {
+            if (!m_Active)
+                return;
+
+            auto pListener = GetListener();
+
+            if (pListener == nullptr) {
+                // LISTEN is not allowed on a standby
+                if (m_Channels.Count() > 0)
+                    NewConnection(srPrimary, true);
+                return;
             }
+
+            // A lost listener is reset by CheckConnections and subscribes again once ready
+            SyncListener(pListener);
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQPollingStatus(CPQConnection *AConnection) {
-            if (m_OnPQPollingStatus != nullptr) {
-                m_OnPQPollingStatus(AConnection);
+        void CPQConnectPoll::SyncListener(CPQPollConnection *AListener) {
+            CStringList SQL;
+
+            if (AListener->ConnectionStatus() != qsReady || !AListener->Connected())
+                return;
+
+            auto &Listening = AListener->Listeners();
+
+            auto Add = [AListener, &SQL](LPCSTR Command, const CString &Channel) {
+                auto pIdentifier = PQescapeIdentifier(AListener->Handle(), Channel.c_str(), Channel.Size());
+                if (pIdentifier != nullptr) {
+                    SQL.Add(CString().Format("%s %s;", Command, pIdentifier));
+                    PQfreemem(pIdentifier);
+                }
+            };
+
+            for (int i = 0; i < m_Channels.Count(); ++i) {
+                if (Listening.Count() == 0 || Listening.IndexOf(m_Channels[i]) == -1)
+                    Add("LISTEN", m_Channels[i]);
             }
-        }
-        //--------------------------------------------------------------------------------------------------------------
 
-        void CPQConnectPollEvent::DoPQConnectException(CPQConnection *AConnection,
-                const Delphi::Exception::Exception &E) {
-            if (m_OnConnectException != nullptr) {
-                m_OnConnectException(AConnection, E);
+            for (int i = 0; i < Listening.Count(); ++i) {
+                if (m_Subscribers.Find(Listening[i]) == nullptr)
+                    Add("UNLISTEN", Listening[i]);
             }
-        }
 
-        //--------------------------------------------------------------------------------------------------------------
+            if (SQL.Count() == 0)
+                return;
 
-        //-- CPQConnectPoll --------------------------------------------------------------------------------------------
+            auto pQuery = new CPQPollQuery(this);
+            pQuery->SQL() = SQL;
+
+            Listening = m_Channels;
 
+            try {
+                AListener->QueryStart(pQuery);
+            } catch (Delphi::Exception::Exception &E) {
+                DoPQConnectException(AListener, E);
+                Listening.Clear();
+                AListener->QueryStop();
+            }
+        }
         //--------------------------------------------------------------------------------------------------------------
 
-        CPQConnectPoll::CPQConnectPoll(size_t ASizeMin, size_t ASizeMax): CPQConnectPollEvent(), CEPollClient() {
-            m_pTimer = nullptr;
-            m_TimerInterval = 0;
+        void CPQConnectPoll::DoListenerNotify(CPQConnection *AConnection, PGnotify *ANotify) {
+            CList Subscribers;
+            CPQSubscriber *pSubscriber;
 
-            m_Active = false;
+            m_Subscribers.FindAll(ANotify->relname, Subscribers);
 
-            m_SizeMin = ASizeMin;
-            m_SizeMax = ASizeMax;
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            m_Dispatching++;
+            for (int i = 0; i < Subscribers.Count(); ++i) {
+                pSubscriber = (CPQSubscriber *) Subscribers[i];
+                if (!pSubscriber->Removed && pSubscriber->Handler != nullptr) {
+                    try {
+                        pSubscriber->Handler(pSubscriber->Sender, ANotify);
+                    } catch (...) {
+                    }
+                }
+            }
+            m_Dispatching--;
 
-        CPQConnectPoll::CPQConnectPoll(const CPQConnInfo &AConnInfo, size_t ASizeMin, size_t ASizeMax):
-            CPQConnectPoll(ASizeMin, ASizeMax) {
-            m_ConnInfo = AConnInfo;
-        }
-        //--------------------------------------------------------------------------------------------------------------
+            if (m_Dispatching == 0) {
+                for (int i = 0; i < m_Removed.Count(); ++i)
+                    delete (CPQSubscriber *) m_Removed[i];
+                m_Removed.Clear();
+            }
 
-        void CPQConnectPoll::Assign(const CPQConnectPoll &Other) {
-            m_TimerInterval = Other.m_TimerInterval;
-            m_Active = Other.m_Active;
-            m_SizeMin = Other.m_SizeMin;
-            m_SizeMax = Other.m_SizeMax;
-            m_ConnInfo = Other.m_ConnInfo;
+            if (m_OnNotify != nullptr)
+                DoPQNotify(AConnection, ANotify);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1210,12 +3299,16 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnectPoll::Start() {
+            m_SizeLimit = m_WaitTarget > 0 ? m_SizeMin : m_SizeMax;
+
+            // Every connection is only started here: they are all established in parallel by the event loop
             for (size_t i = 0; i < m_SizeMin; ++i) {
                 if (!NewConnection())
                     break;
             }
 
-            SetTimerInterval(60 * 1000);
+            // Queue deadlines and pool size are checked every second
+            SetTimerInterval(1000);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1265,12 +3358,52 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         int CPQConnectPoll::AddToQueue(CPQPollQuery *AQuery) {
-            return m_Queue.AddToQueue(this, AQuery);
+            AQuery->m_Ticket = m_Queue.Push(AQuery);
+            AQuery->m_Queued = Now();
+
+            return m_Queue.Count() - 1;
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnectPoll::RemoveFromQueue(CPQPollQuery *AQuery) {
-            m_Queue.RemoveFromQueue(this, AQuery);
+            m_Queue.Remove(AQuery->m_Ticket, AQuery);
+            AQuery->m_Ticket = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::QueryStarted(CPQPollQuery *AQuery) {
+            m_Stats.Started++;
+
+            if (AQuery->m_Ticket == 0)
+                return;
+
+            RemoveFromQueue(AQuery);
+
+            const double Wait = (Now() - AQuery->m_Queued) * MSecsPerDay;
+
+            m_Stats.Waited++;
+            m_Stats.WaitTime += Wait;
+            if (Wait > m_Stats.WaitTimeMax)
+                m_Stats.WaitTimeMax = Wait;
+
+            m_TickWait += Wait;
+            m_TickWaited++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPoolStats CPQConnectPoll::Stats() const {
+            CPQPoolStats Result = m_Stats;
+
+            Result.Connections = m_ConnectManager.Count();
+            for (int i = 0; i < m_ConnectManager.Count(); ++i) {
+                if (GetConnection(i)->ConnectionStatus() == qsWait)
+                    Result.Busy++;
+            }
+
+            Result.Queued = m_Queue.Count();
+            Result.Limit = m_SizeLimit;
+
+            return Result;
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1318,39 +3451,29 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        bool CPQConnectPoll::NewConnection() {
-            int PingCount = 0;
-            auto pConnection = new CPQPollConnection(m_ConnInfo, &m_ConnectManager);
+        bool CPQConnectPoll::NewConnection(CPQServerRole ARole, bool AListener) {
+            int index = -1;
 
-            try {
-                m_ConnInfo.PingValid(m_ConnInfo.Ping() == PQPING_OK);
-                while (!m_ConnInfo.PingValid() && (PingCount < 3)) {
-                    sleep(1);
-                    PingCount++;
-                    m_ConnInfo.PingValid(m_ConnInfo.Ping() == PQPING_OK);
-                }
+            auto pConnInfo = &m_ConnInfo;
 
-                if (!m_ConnInfo.PingValid()) {
-                    switch (m_ConnInfo.Ping()) {
-                        case PQPING_OK:
-                            m_ConnInfo.PingValid(true);
-                            break;
+            if (m_Endpoints.Count() > 0) {
+                index = SelectEndpoint(ARole, Now());
+                if (index == -1)
+                    return false;
+                pConnInfo = &Endpoints(index)->ConnInfo;
+            } else if (!ConnectAllowed(index, Now())) {
+                return false;
+            }
 
-                        case PQPING_REJECT:
-                            throw EDBConnectionError(
-                                    _T("The server is running but is in a state that disallows connections "
-                                       "(startup, shutdown, or crash recovery)."));
+            auto pConnection = new CPQPollConnection(*pConnInfo, &m_ConnectManager);
 
-                        case PQPING_NO_RESPONSE:
-                            throw EDBConnectionError(_T("The server could not be contacted."));
+            pConnection->IdleList(AListener ? nullptr : &m_Idle);
+            pConnection->Listener(AListener);
+            pConnection->Endpoint(index);
+            if (index != -1)
+                pConnection->RoleHint(Endpoints(index)->Role);
 
-                        case PQPING_NO_ATTEMPT:
-                            throw EDBConnectionError(
-                                    _T("No attempt was made to contact the server, because the supplied parameters "
-                                       "were obviously incorrect or there was some client-side problem "
-                                       "(for example, out of memory)."));
-                    }
-                }
+            try {
 #if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
                 pConnection->OnChangeSocket([this](auto && AConnection, auto && AOldSocket) { OnChangeSocket(AConnection, AOldSocket); });
 
@@ -1362,7 +3485,9 @@ namespace Delphi {
                     pConnection->OnProcessor([this](auto && AConnection, auto && AMessage) { DoPQProcessor(AConnection, AMessage); });
                 }
 
-                if (m_OnNotify != nullptr) {
+                if (AListener) {
+                    pConnection->OnNotify([this](auto && AConnection, auto && ANotify) { DoListenerNotify(AConnection, ANotify); });
+                } else if (m_OnNotify != nullptr) {
                     pConnection->OnNotify([this](auto && AConnection, auto && ANotify) { DoPQNotify(AConnection, ANotify); });
                 }
 
@@ -1400,7 +3525,9 @@ namespace Delphi {
                     pConnection->OnProcessor(std::bind(&CPQConnectPoll::DoPQProcessor, this, _1, _2));
                 }
 
-                if (m_OnNotify != nullptr) {
+                if (AListener) {
+                    pConnection->OnNotify(std::bind(&CPQConnectPoll::DoListenerNotify, this, _1, _2));
+                } else if (m_OnNotify != nullptr) {
                     pConnection->OnNotify(std::bind(&CPQConnectPoll::DoPQNotify, this, _1, _2));
                 }
 
@@ -1431,9 +3558,12 @@ namespace Delphi {
                 pConnection->ConnectStart();
                 pConnection->ConnectPoll();
 
+                pConnection->UpdatePhase(PQstatus(pConnection->Handle()), Now());
+
                 return true;
             } catch (Delphi::Exception::Exception &E) {
                 DoPQConnectException(pConnection, E);
+                EndpointFailed(index);
                 delete pConnection;
             }
 
@@ -1446,8 +3576,9 @@ namespace Delphi {
             if (m_ConnectManager.Count() > m_SizeMin) {
                 for (int i = m_ConnectManager.Count() - 1; i >= m_SizeMin; --i) {
                     pConnection = dynamic_cast<CPQPollConnection *> (m_ConnectManager[i]);
-                    if ((pConnection->Listeners().Count() == 0) && (pConnection->ConnectionStatus() != qsWait)) {
-                        if (Now - pConnection->AntiFreeze() >= Period)
+                    if ((pConnection->Listeners().Count() == 0) && (pConnection->ConnectionStatus() != qsWait) && !pConnection->Listener()) {
+                        // Above the adaptive limit an idle connection is not kept for the whole period
+                        if (i >= (int) m_SizeLimit || Now - pConnection->AntiFreeze() >= Period)
                             m_ConnectManager.Delete(i);
                     }
                 }
@@ -1455,37 +3586,106 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CPQPollConnection *CPQConnectPoll::GetReadyConnection() {
+        void CPQConnectPoll::CheckConnections(CDateTime Now) {
             CPQPollConnection *pConnection;
-            CPQPollConnection *pResult = nullptr;
 
-            for (int i = 0; i < m_ConnectManager.Count(); ++i) {
-                pConnection = dynamic_cast<CPQPollConnection *> (m_ConnectManager[i]);
+            for (int i = m_ConnectManager.Count() - 1; i >= 0; --i) {
+                pConnection = GetConnection(i);
 
-                if (pConnection->Connected()) {
-                    if (pConnection->ConnectionStatus() == qsReady) {
-                        pResult = pConnection;
-                        break;
+                if (pConnection->Connected())
+                    continue;
+
+                const auto status = pConnection->Status();
+
+                if (status == CONNECTION_BAD) {
+                    // A lost server is tried again once its backoff is over
+                    if (!ConnectAllowed(pConnection->Endpoint(), Now))
+                        continue;
+
+                    DoPQError(pConnection);
+                    pConnection->Statements().Clear();
+                    // Pipelined queries never see their sync point on a new session
+                    for (int j = 0; j < pConnection->PipelineCount(); ++j) {
+                        const auto pPollQuery = dynamic_cast<CPQPollQuery *> (pConnection->Pipeline(j));
+                        if (pPollQuery != nullptr && !pPollQuery->Cancelled())
+                            pPollQuery->DoException(EDBConnectionError(_T("Connection lost, the query was not completed.")));
                     }
-                } else {
-                    const auto status = pConnection->Status();
-                    if ((status == CONNECTION_STARTED) || (status == CONNECTION_MADE)) {
-                        if ((Now() - pConnection->AntiFreeze()) >= (CDateTime) 10 / SecsPerDay) {
-                            DoPQError(pConnection);
-                            pConnection->Close();
-                        }
-                    } else if (status == CONNECTION_BAD) {
-                        DoPQError(pConnection);
-                        pConnection->ConnectionStatus(qsReset);
+                    pConnection->PipelineReset();
+                    // The server forgets the LISTENs of a lost session: the listener subscribes again when ready
+                    if (pConnection->Listener())
+                        pConnection->Listeners().Clear();
+                    pConnection->ConnectionStatus(qsReset);
+
+                    try {
                         pConnection->ResetStart();
                         pConnection->ResetPoll();
+                        pConnection->UpdatePhase(PQstatus(pConnection->Handle()), Now);
+                    } catch (Delphi::Exception::Exception &E) {
+                        DoPQConnectException(pConnection, E);
+                        pConnection->ConnectionStatus(qsError);
+                        EndpointFailed(pConnection->Endpoint());
+                    }
+                } else if (pConnection->ConnectionStatus() == qsConnect || pConnection->ConnectionStatus() == qsReset) {
+                    // Each phase has its own deadline: the TCP connect, then every step of the startup
+                    pConnection->UpdatePhase(status, Now);
+
+                    const auto timeout = status == CONNECTION_STARTED ? m_ConnectTimeout : m_StartupTimeout;
+
+                    if (timeout > 0 && Now - pConnection->PhaseTime() >= (CDateTime) timeout / MSecsPerDay) {
+                        DoPQConnectException(pConnection, EDBConnectionError(_T("[%d] Connection timed out: %s"),
+                            pConnection->Socket(), pConnection->StatusString()));
+                        EndpointFailed(pConnection->Endpoint());
+                        m_ConnectManager.Delete(i);
                     }
                 }
             }
 
-            if (pResult == nullptr && (m_ConnectManager.Count() <= (int) m_SizeMax)) {
-                if (!NewConnection())
-                    throw Exception::EDBConnectionError(_T("Unable to create new database connection."));
+            // SizeMin connections are kept: the dropped ones are opened again once the backoff allows it
+            if (m_Active) {
+                while (m_ConnectManager.Count() < (int) m_SizeMin) {
+                    if (!NewConnection())
+                        break;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollConnection *CPQConnectPoll::GetReadyConnection(CPQServerRole ARole) {
+            auto pResult = m_Idle.Pop(ARole);
+
+            if (pResult == nullptr) {
+                CheckConnections(Now());
+
+                if (m_ConnectManager.Count() < (int) m_SizeLimit) {
+                    // While the servers back off the query waits for one of the connections already there
+                    if (!NewConnection(ARole) && m_ConnectManager.Count() == 0)
+                        throw Exception::EDBConnectionError(_T("Unable to create new database connection."));
+                }
+            }
+
+            return pResult;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CPQPollConnection *CPQConnectPoll::GetPipelineConnection(CPQServerRole ARole) {
+            CPQPollConnection *pConnection;
+            CPQPollConnection *pResult = nullptr;
+
+            if (m_PipelineDepth == 0)
+                return nullptr;
+
+            for (int i = 0; i < m_ConnectManager.Count(); ++i) {
+                pConnection = dynamic_cast<CPQPollConnection *> (m_ConnectManager[i]);
+
+                if (ARole == srPrimary && pConnection->Role() == srStandby)
+                    continue;
+
+                if (pConnection->Connected() && pConnection->PipelineMode() && pConnection->ConnectionStatus() == qsWait) {
+                    if (pConnection->PipelineCount() < (int) m_PipelineDepth) {
+                        if (pResult == nullptr || pConnection->PipelineCount() < pResult->PipelineCount())
+                            pResult = pConnection;
+                    }
+                }
             }
 
             return pResult;
@@ -1493,7 +3693,8 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnectPoll::Fault(CPollEventHandler *AHandler) {
-            m_ConnInfo.PingValid(false);
+            auto pConnection = GetHandlerConnection(AHandler);
+            EndpointFailed(pConnection != nullptr ? pConnection->Endpoint() : -1);
             AHandler->Fault();
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -1504,7 +3705,113 @@ namespace Delphi {
             auto pTimer = dynamic_cast<CEPollTimer *> (AHandler->Binding());
             pTimer->Read(&exp, sizeof(uint64_t));
 
-            PackConnections(AHandler->TimeStamp(), (CDateTime) 30 / MinsPerDay); // 30 min
+            const auto now = AHandler->TimeStamp();
+
+            m_Idle.Update();
+
+            CheckConnections(now);
+            CheckListener();
+            CheckDeadlines(now);
+            CheckSize(now);
+
+            if (now - m_PackTime >= (CDateTime) 1 / MinsPerDay) {
+                m_PackTime = now;
+                PackConnections(now, (CDateTime) m_IdleTimeout / SecsPerDay);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::CheckDeadlines(CDateTime Now) {
+            CPQPollConnection *pConnection;
+            CPQPollQuery *pPollQuery;
+
+            const auto QueueDeadline = m_QueueTimeout > 0 ? Now - (CDateTime) m_QueueTimeout / MSecsPerDay : 0;
+
+            for (size_t Ticket = m_Queue.Head(); Ticket < m_Queue.Tail(); ++Ticket) {
+                pPollQuery = m_Queue.Items(Ticket);
+
+                if (pPollQuery == nullptr)
+                    continue;
+
+                if ((pPollQuery->m_Deadline != 0 && Now >= pPollQuery->m_Deadline) ||
+                    (QueueDeadline != 0 && pPollQuery->m_Queued <= QueueDeadline)) {
+                    RemoveFromQueue(pPollQuery);
+                    m_Stats.Timeouts++;
+
+                    pPollQuery->DoException(EPollServerError(_T("Query timed out waiting for a connection.")));
+                    delete pPollQuery;
+                }
+            }
+
+            for (int i = 0; i < m_ConnectManager.Count(); ++i) {
+                pConnection = GetConnection(i);
+                pConnection->CancelPoll();
+
+                if (pConnection->ConnectionStatus() != qsWait)
+                    continue;
+
+                const auto paused = pConnection->Paused();
+                const auto count = pConnection->PipelineMode() ? pConnection->PipelineCount() : 1;
+
+                for (int j = 0; j < count; ++j) {
+                    pPollQuery = dynamic_cast<CPQPollQuery *> (pConnection->PipelineMode() ? pConnection->Pipeline(j) : pConnection->WorkQuery());
+
+                    if (pPollQuery != nullptr && pPollQuery->m_Deadline != 0 && Now >= pPollQuery->m_Deadline) {
+                        if (pPollQuery->Interrupt(EPollServerError(_T("Query timed out."))))
+                            m_Stats.Timeouts++;
+                    }
+                }
+
+                // A timed out query that paused streaming no longer holds the input back
+                if (paused && !pConnection->Paused() && !pConnection->Reading())
+                    Wake(pConnection);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::Wake(CPQPollConnection *AConnection) {
+            // Edge triggered polling will not report input that is already waiting: read it now
+            try {
+                CheckInput(AConnection);
+                if (AConnection->ConnectionStatus() == qsReady)
+                    CheckQueue();
+            } catch (Delphi::Exception::Exception &E) {
+                DoPQConnectException(AConnection, E);
+                AConnection->ConnectionStatus(qsError);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::CheckSize(CDateTime Now) {
+            // Wait of this tick: the queries started from the queue and the oldest one still waiting
+            double Wait = m_TickWaited == 0 ? 0 : m_TickWait / (double) m_TickWaited;
+
+            auto pFirst = m_Queue.First();
+            if (pFirst != nullptr)
+                Wait = Max(Wait, (Now - pFirst->m_Queued) * MSecsPerDay);
+
+            m_Stats.WaitAverage = m_Stats.WaitAverage * 0.7 + Wait * 0.3;
+
+            m_TickWait = 0;
+            m_TickWaited = 0;
+
+            if (m_WaitTarget <= 0) {
+                m_SizeLimit = m_SizeMax;
+                return;
+            }
+
+            m_SizeLimit = Min(Max(m_SizeLimit, m_SizeMin), m_SizeMax);
+
+            if (m_Stats.WaitAverage > m_WaitTarget) {
+                if (m_SizeLimit < m_SizeMax) {
+                    m_SizeLimit++;
+                    if (m_Queue.Count() > 0 && m_ConnectManager.Count() < (int) m_SizeLimit)
+                        NewConnection();
+                }
+            } else if (m_Stats.WaitAverage < m_WaitTarget / 4.0 && m_SizeLimit > m_SizeMin) {
+                if (Stats().Busy * 2 < m_SizeLimit)
+                    m_SizeLimit--;
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1534,11 +3841,9 @@ namespace Delphi {
                             break;
 
                         case qsWait:
-                            pConnection->ConsumeInput();
-                            if (pConnection->Flush()) {
-                                pConnection->CheckResult();
-                                pConnection->CheckNotify();
-                            }
+                            CheckInput(pConnection);
+                            if (pConnection->Listener())
+                                SyncListener(pConnection);
                             break;
 
                         case qsError:
@@ -1555,6 +3860,27 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CPQConnectPoll::CheckInput(CPQPollConnection *AConnection) {
+            // A paused stream keeps the data in the socket, so the server is held back by TCP flow control
+            if (AConnection->Paused())
+                return;
+
+            AConnection->ConsumeInput();
+
+            if (AConnection->PipelineMode()) {
+                AConnection->Flush();
+                if (AConnection->CheckPipeline() > 0)
+                    CheckPipeline(AConnection);
+                if (!AConnection->Paused())
+                    AConnection->CheckNotify();
+            } else if (AConnection->Flush()) {
+                AConnection->CheckResult();
+                if (!AConnection->Paused())
+                    AConnection->CheckNotify();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CPQConnectPoll::DoWrite(CPollEventHandler *AHandler) {
             auto pConnection = GetHandlerConnection(AHandler);
             chASSERT(pConnection);
@@ -1564,7 +3890,11 @@ namespace Delphi {
                         case qsConnect:
                             if (pConnection->Connected()) {
                                 pConnection->ConnectionStatus(qsReady);
-                                CheckQueue();
+                                EndpointReady(pConnection);
+                                if (pConnection->Listener())
+                                    SyncListener(pConnection);
+                                else
+                                    CheckQueue();
                             } else {
                                 pConnection->ConnectPoll();
                             }
@@ -1573,17 +3903,34 @@ namespace Delphi {
                         case qsReset:
                             if (pConnection->Connected()) {
                                 pConnection->ConnectionStatus(qsReady);
-                                CheckQueue();
+                                EndpointReady(pConnection);
+                                if (pConnection->Listener())
+                                    SyncListener(pConnection);
+                                else
+                                    CheckQueue();
                             } else {
                                 pConnection->ResetPoll();
                             }
                             break;
 
                         case qsReady:
-                            CheckQueue();
+                            if (pConnection->Listener())
+                                SyncListener(pConnection);
+                            else
+                                CheckQueue();
                             break;
 
                         case qsWait:
+                            if (pConnection->PipelineMode()) {
+                                if (pConnection->Flush())
+                                    CheckPipeline(pConnection);
+                            } else if (pConnection->WorkQuery() != nullptr && pConnection->WorkQuery()->CopyState() == csCopyIn) {
+                                pConnection->CheckCopyIn();
+                            } else {
+                                pConnection->Flush();
+                            }
+                            break;
+
                         case qsError:
                             break;
                     }
@@ -1615,11 +3962,18 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CPQConnectPoll::CheckQueue() {
-            CPQPollQuery *pPollQuery;
-            if (m_Queue.Count() > 0) {
-                pPollQuery = (CPQPollQuery *) m_Queue.FirstItem(this);
-                pPollQuery->RemoveFromQueue();
-                pPollQuery->Start();
+            // The head leaves the queue only when it gets a connection
+            while (m_Queue.Count() > 0) {
+                if (m_Queue.First()->Start() != POLL_QUERY_START_OK)
+                    break;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CPQConnectPoll::CheckPipeline(CPQPollConnection *AConnection) {
+            while (m_Queue.Count() > 0 && AConnection->PipelineCount() < (int) m_PipelineDepth) {
+                if (m_Queue.First()->Start() != POLL_QUERY_START_OK)
+                    break;
             }
         }
 
@@ -1635,6 +3989,9 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         bool CPQClient::CheckListen(const CString &Listen) {
+            if (Subscribed(Listen))
+                return true;
+
             int index = 0;
             while (index < m_ConnectManager.Count() && (Connections(index)->Listeners().IndexOf(Listen) == -1))
                 index++;
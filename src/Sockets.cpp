@@ -23,10 +23,13 @@ Author:
 
 #include "delphi.hpp"
 #include "delphi/Sockets.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 //----------------------------------------------------------------------------------------------------------------------
 
 #define EVENT_SIZE 512
-#define WEBSOCKET_ERROR_MESSAGE "Invalid WebSocket header size (%s)."
 #define SSL_NOT_INITIALIZED "SSL not initialized."
 //----------------------------------------------------------------------------------------------------------------------
 
@@ -113,11 +116,19 @@ namespace Delphi {
             m_LastError = 0;
 #ifdef WITH_SSL
             m_SSLError = SSL_ERROR_NONE;
+            m_pSendFileBuffer = nullptr;
 #endif
             SecureZeroMemory(m_szBuffer, sizeof(m_szBuffer));
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        CStack::~CStack() {
+#ifdef WITH_SSL
+            delete [] m_pSendFileBuffer;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         bool CStack::CheckForSocketError(ssize_t AResult, CErrorGroup AErrGroup) {
             int Ignore[] = {0};
             return CheckForSocketError(AResult, Ignore, 0, AErrGroup);
@@ -182,6 +193,9 @@ namespace Delphi {
 
             SSL_CTX *ctx = ::SSL_CTX_new(method);
 
+            // A write retried after SSL_ERROR_WANT_WRITE may resume from the output queue (see CTCPConnection::Enqueue)
+            SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
             if (ACertificateFile != nullptr) {
                 SSL_CTX_use_certificate_file(ctx, ACertificateFile, SSL_FILETYPE_PEM);
             }
@@ -251,6 +265,35 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        bool CStack::SSLEnableKTLS(SSL *ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+            // Must be set before the handshake: the kernel takes over record encryption once keys are negotiated
+            ::SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+            return true;
+#else
+            return false;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStack::SSLKTLSSend(SSL *ssl) {
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && defined(BIO_get_ktls_send)
+            return ssl != nullptr && BIO_get_ktls_send(::SSL_get_wbio(ssl));
+#else
+            return false;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CStack::SSLKTLSRecv(SSL *ssl) {
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && defined(BIO_get_ktls_recv)
+            return ssl != nullptr && BIO_get_ktls_recv(::SSL_get_rbio(ssl));
+#else
+            return false;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         ssize_t CStack::SSLSend(SSL *ssl, void *ABuffer, int ABufferLength) {
             return ::SSL_write(ssl, ABuffer, ABufferLength);
         }
@@ -258,10 +301,18 @@ namespace Delphi {
 
         ssize_t CStack::SSLSendFile(SSL *ssl, CHandle AHandle, off_t AOffSet, size_t ASize, int AFlags) {
 #if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && defined(BIO_get_ktls_send)
-            return ::SSL_sendfile(ssl, AHandle, AOffSet, ASize, AFlags);
-#else
-            throw ESocketError("SSL_sendfile() not available");
+            if (SSLKTLSSend(ssl))
+                return ::SSL_sendfile(ssl, AHandle, AOffSet, ASize, AFlags);
 #endif
+            // No kernel TLS offload: copy the file through user space and encrypt with SSL_write()
+            if (m_pSendFileBuffer == nullptr)
+                m_pSendFileBuffer = new char[SSL3_RT_MAX_PLAIN_LENGTH];
+
+            const auto Size = ::pread(AHandle, m_pSendFileBuffer, Min(ASize, (size_t) SSL3_RT_MAX_PLAIN_LENGTH), AOffSet);
+            if (Size <= 0)
+                return Size;
+
+            return ::SSL_write(ssl, m_pSendFileBuffer, (int) Size);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -808,6 +859,45 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CSharedBuffer ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSharedBuffer::CSharedBuffer(const void *ABuffer, size_t ASize): m_RefCount(1), m_Size(ASize) {
+            if (ASize > 0)
+                ::CopyMemory(reinterpret_cast<char *> (this + 1), ABuffer, ASize);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSharedBuffer *CSharedBuffer::Create(const void *ABuffer, size_t ASize) {
+            // Header and data share one allocation
+            void *P = ::malloc(sizeof(CSharedBuffer) + ASize);
+            if (P == nullptr)
+                throw Delphi::Exception::Exception(_T("Out of memory."));
+            return new (P) CSharedBuffer(ABuffer, ASize);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSharedBuffer *CSharedBuffer::Create(const CMemoryStream &Stream) {
+            return Create(Stream.Memory(), Stream.Size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSharedBuffer *CSharedBuffer::AddRef() {
+            m_RefCount++;
+            return this;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSharedBuffer::Release() {
+            if (--m_RefCount == 0) {
+                this->~CSharedBuffer();
+                ::free(this);
+            }
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CSocketHandle ---------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -817,6 +907,7 @@ namespace Delphi {
 #ifdef WITH_SSL
             m_pSSL = nullptr;
             m_SSLMethod = sslNotUsed;
+            m_KTLS = false;
 #endif
             m_Port = 0;
             m_PeerPort = 0;
@@ -848,11 +939,23 @@ namespace Delphi {
             if (m_SSLMethod != sslNotUsed) {
                 if (m_pSSL == nullptr)
                     m_pSSL = CStack::SSLNew(m_SSLMethod == sslServer);
+                if (m_KTLS)
+                    CStack::SSLEnableKTLS(m_pSSL);
                 CStack::SSLAllocate(m_pSSL, m_Handle);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        bool CSocketHandle::KTLSSend() const {
+            return m_KTLS && CStack::SSLKTLSSend(m_pSSL);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CSocketHandle::KTLSRecv() const {
+            return m_KTLS && CStack::SSLKTLSRecv(m_pSSL);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CSocketHandle::ShutdownSSL() {
             if (m_pSSL != nullptr) {
                 CStack::SSLShutdown(m_pSSL);
@@ -1327,6 +1430,13 @@ namespace Delphi {
             return sslNotUsed;
         }
         //--------------------------------------------------------------------------------------------------------------
+
+        bool CIOHandlerSocket::KTLSSend() const {
+            if (m_pBinding != nullptr)
+                return m_pBinding->KTLSSend();
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 #else
         void CIOHandlerSocket::Open() {
             if (m_pBinding == nullptr)
@@ -1501,11 +1611,18 @@ namespace Delphi {
             m_ClosedGracefully = false;
             m_OEM = false;
             m_UsedSSL = false;
+            m_KTLS = false;
 
             m_RecvBufferSize = GRecvBufferSizeDefault;
             m_SendBufferSize = GSendBufferSizeDefault;
 
             m_MaxLineLength = MaxLineLengthDefault;
+
+            m_OutputQueueOffset = 0;
+            m_OutputQueueSize = 0;
+            m_OutputQueueLimit = OutputQueueLimitDefault;
+            m_OutputQueueDropped = 0;
+            m_OutputQueueAction = oqDisconnect;
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1513,6 +1630,8 @@ namespace Delphi {
             DisconnectSocket();
 
             FreeIOHandler();
+
+            ClearOutputQueue();
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -1569,11 +1688,30 @@ namespace Delphi {
 
                 if (m_pIOHandler != nullptr) {
                     m_UsedSSL = m_pIOHandler->UsedSSL();
+                    if (m_pSocket->Binding() != nullptr)
+                        m_KTLS = m_pSocket->Binding()->KTLS();
                 }
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CTCPConnection::SetKTLS(bool Value) {
+            if (m_KTLS != Value) {
+                m_KTLS = Value;
+                // Takes effect for the next TLS session allocated on this binding
+                if (m_pSocket != nullptr && m_pSocket->Binding() != nullptr)
+                    m_pSocket->Binding()->KTLS(Value);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTCPConnection::KTLSSend() {
+            if (m_UsedSSL && m_KTLS && m_pIOHandler != nullptr)
+                return m_pIOHandler->KTLSSend();
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         bool CTCPConnection::CheckForDisconnect(bool ARaiseExceptionIfDisconnected) {
             bool bDisconnected = false;
             if (ClosedGracefully() || (IOHandler() == nullptr)) {
@@ -1763,6 +1901,10 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         bool CTCPConnection::WriteAsync(ssize_t AByteCount) {
+            // The queue holds everything produced before the output buffer (see Enqueue)
+            if (m_OutputQueue.Count() > 0 && !WriteQueueAsync())
+                return false;
+
             ssize_t byteCount = AByteCount;
 
             if (m_OutputBuffer.Size() > 0) {
@@ -1780,6 +1922,64 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        bool CTCPConnection::WriteQueueAsync() {
+            while (m_OutputQueue.Count() > 0) {
+                auto pBuffer = (CSharedBuffer *) m_OutputQueue.First();
+
+                const size_t size = pBuffer->Size() - m_OutputQueueOffset;
+                const ssize_t byteCount = WriteBufferAsync((char *) pBuffer->Memory() + m_OutputQueueOffset, size);
+
+                if (byteCount > 0) {
+                    m_OutputQueueSize -= (size_t) byteCount;
+                    m_OutputQueueOffset += (size_t) byteCount;
+                }
+
+                if (m_OutputQueueOffset < pBuffer->Size())
+                    return false;
+
+                m_OutputQueueOffset = 0;
+                m_OutputQueue.Delete(0);
+                pBuffer->Release();
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTCPConnection::Enqueue(CSharedBuffer *ABuffer) {
+            if (ABuffer == nullptr || ABuffer->Size() == 0)
+                return false;
+
+            if (m_OutputQueueLimit > 0 && m_OutputBuffer.Size() + m_OutputQueueSize + ABuffer->Size() > m_OutputQueueLimit) {
+                m_OutputQueueDropped++;
+                return false;
+            }
+
+            // Bytes still waiting in the output buffer were produced first, so they go out ahead of the frame
+            if (m_OutputBuffer.Size() > 0) {
+                m_OutputQueue.Add(CSharedBuffer::Create(m_OutputBuffer));
+                m_OutputQueueSize += m_OutputBuffer.Size();
+                m_OutputBuffer.Clear();
+            }
+
+            m_OutputQueue.Add(ABuffer->AddRef());
+            m_OutputQueueSize += ABuffer->Size();
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTCPConnection::ClearOutputQueue() {
+            for (int i = 0; i < m_OutputQueue.Count(); i++)
+                ((CSharedBuffer *) m_OutputQueue.Items(i))->Release();
+
+            m_OutputQueue.Clear();
+
+            m_OutputQueueOffset = 0;
+            m_OutputQueueSize = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CTCPConnection::WriteInteger(int AValue, bool AConvert) {
             if (AConvert)
                 AValue = (int) GStack->HToNL((unsigned int) AValue);
@@ -1902,7 +2102,7 @@ namespace Delphi {
                 off_t offset = AOffSet;
 
                 while (byteTotal < AByteCount) {
-                    byteCount = m_pIOHandler->SendFile(AHandle, &offset, AByteCount, AFlags);
+                    byteCount = m_pIOHandler->SendFile(AHandle, &offset, AByteCount - byteTotal, AFlags);
 #ifdef WITH_SSL
                     if (m_UsedSSL) {
                         unsigned long Ignore[] = {SSL_ERROR_NONE, SSL_ERROR_WANT_WRITE};
@@ -2203,9 +2403,17 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
-        CWebSocket::CWebSocket() {
+        CWebSocket::CWebSocket(): m_Header() {
             m_MaskingIndex = 0;
             m_PayloadSize = 0;
+            m_HeaderSize = 0;
+            m_Compressed = false;
+            m_Streaming = false;
+            m_Chunked = false;
+            m_MessageOpcode = WS_OPCODE_CONTINUATION;
+            m_MessageSize = 0;
+            m_MaxMessageSize = WS_MAX_MESSAGE_SIZE;
+            m_FrameRemaining = 0;
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -2215,11 +2423,18 @@ namespace Delphi {
             m_Payload.Clear();
             m_MaskingIndex = 0;
             m_PayloadSize = 0;
+            m_HeaderSize = 0;
+            m_Compressed = false;
+            m_Chunked = false;
+            m_MessageOpcode = WS_OPCODE_CONTINUATION;
+            m_MessageSize = 0;
+            m_FrameRemaining = 0;
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CWebSocket::Close(CMemoryStream &Stream) {
             m_Frame.FIN = WS_FIN;
+            m_Frame.RSV1 = 0;
             m_Frame.Opcode = WS_OPCODE_CLOSE;
             m_Frame.Mask = 0;
             SaveToStream(Stream);
@@ -2228,6 +2443,7 @@ namespace Delphi {
 
         void CWebSocket::Ping(CMemoryStream &Stream) {
             m_Frame.FIN = WS_FIN;
+            m_Frame.RSV1 = 0;
             m_Frame.Opcode = WS_OPCODE_PING;
             m_Frame.Mask = 0;
             SaveToStream(Stream);
@@ -2236,41 +2452,66 @@ namespace Delphi {
 
         void CWebSocket::Pong(CMemoryStream &Stream) {
             m_Frame.FIN = WS_FIN;
+            m_Frame.RSV1 = 0;
             m_Frame.Opcode = WS_OPCODE_PONG;
             m_Frame.Mask = 0;
             SaveToStream(Stream);
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocket::Encode(CMemoryStream &Stream) {
-            unsigned char ch;
-            m_Payload.Position(0);
-            for (size_t i = 0; i < m_Payload.Size(); i++) {
-                m_Payload.Read(&ch, 1);
-                ch = ch ^ m_Frame.MaskingKey[i % 4];
-                Stream.Write(&ch, 1);
+        void CWebSocket::Mask(unsigned char *Data, size_t Size, const unsigned char Key[4], size_t Index) {
+            // Rotate the key so that key[0] applies to Data[0]; every block below is a multiple of 4 bytes
+            const unsigned char key[4] = { Key[Index % 4], Key[(Index + 1) % 4], Key[(Index + 2) % 4], Key[(Index + 3) % 4] };
+
+            uint32_t key32;
+            ::CopyMemory(&key32, key, sizeof(key32));
+
+            size_t i = 0;
+#ifdef __AVX2__
+            const __m256i mask256 = _mm256_set1_epi32((int) key32);
+            for (; i + 32 <= Size; i += 32) {
+                const __m256i value = _mm256_loadu_si256((const __m256i *) (Data + i));
+                _mm256_storeu_si256((__m256i *) (Data + i), _mm256_xor_si256(value, mask256));
+            }
+#endif
+#ifdef __SSE2__
+            const __m128i mask128 = _mm_set1_epi32((int) key32);
+            for (; i + 16 <= Size; i += 16) {
+                const __m128i value = _mm_loadu_si128((const __m128i *) (Data + i));
+                _mm_storeu_si128((__m128i *) (Data + i), _mm_xor_si128(value, mask128));
+            }
+#endif
+            const uint64_t mask64 = ((uint64_t) key32 << 32u) | key32;
+            for (; i + 8 <= Size; i += 8) {
+                uint64_t value;
+                ::CopyMemory(&value, Data + i, sizeof(value));
+                value ^= mask64;
+                ::CopyMemory(Data + i, &value, sizeof(value));
+            }
+
+            for (; i < Size; i++) {
+                Data[i] ^= key[i % 4];
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CWebSocket::Decode(const CMemoryStream &Stream) {
-            unsigned char ch;
-            size_t size = 0;
-
             const auto payloadSize = m_Payload.Size() - m_Payload.Position();
             const auto streamSize = Stream.Size() - Stream.Position();
 
-            if (payloadSize > streamSize) {
-                size = streamSize;
-            } else {
-                size = payloadSize;
-            }
+            const auto size = payloadSize > streamSize ? streamSize : payloadSize;
+
+            if (size != 0) {
+                const auto pos = m_Payload.Position();
+                auto *data = (unsigned char *) m_Payload.Memory() + pos;
+
+                ::CopyMemory(data, (const unsigned char *) Stream.Memory() + Stream.Position(), size);
+                Mask(data, size, m_Frame.MaskingKey, m_MaskingIndex);
+
+                Stream.Position(Stream.Position() + (off_t) size);
+                m_Payload.Position(pos + (off_t) size);
 
-            for (size_t i = 0; i < size; i++) {
-                Stream.Read(&ch, 1);
-                ch = ch ^ m_Frame.MaskingKey[m_MaskingIndex % 4];
-                m_Payload.Write(&ch, 1);
-                m_MaskingIndex++;
+                m_MaskingIndex += size;
             }
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -2299,157 +2540,198 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocket::PayloadToStream(CMemoryStream &Stream) {
+        void CWebSocket::WriteFrame(CMemoryStream &Stream, unsigned char Header, const void *Data, size_t Size) {
+            unsigned char header[14];
+            size_t size = 2;
 
-            union {
-                uint16_t val;
-                uint8_t  arr[2];
-            } len16 = {0};
+            header[0] = Header;
 
-            union {
-                uint64_t val;
-                uint8_t  arr[8];
-            } len64 = {0};
-
-            if (m_Frame.Length == WS_PAYLOAD_LENGTH_16) {
-                len16.val = be16toh(m_Payload.Size());
-                Stream.Write(len16.arr, sizeof(len16));
-            } else if (m_Frame.Length == WS_PAYLOAD_LENGTH_64) {
-                len64.val = be64toh(m_Payload.Size());
-                Stream.Write(len64.arr, sizeof(len64));
+            if (Size < WS_PAYLOAD_LENGTH_16) {
+                header[1] = m_Frame.Mask | (unsigned char) Size;
+            } else if (Size <= 0xFFFF) {
+                header[1] = m_Frame.Mask | WS_PAYLOAD_LENGTH_16;
+                const uint16_t len16 = htobe16((uint16_t) Size);
+                ::CopyMemory(header + size, &len16, sizeof(len16));
+                size += sizeof(len16);
+            } else {
+                header[1] = m_Frame.Mask | WS_PAYLOAD_LENGTH_64;
+                const uint64_t len64 = htobe64((uint64_t) Size);
+                ::CopyMemory(header + size, &len64, sizeof(len64));
+                size += sizeof(len64);
             }
 
             if (m_Frame.Mask == WS_MASK) {
-                Stream.Write(m_Frame.MaskingKey, sizeof(m_Frame.MaskingKey));
-                Encode(Stream);
-            } else {
-                m_Payload.Position(0);
-                m_Payload.SaveToStream(Stream);
+                ::CopyMemory(header + size, m_Frame.MaskingKey, sizeof(m_Frame.MaskingKey));
+                size += sizeof(m_Frame.MaskingKey);
+            }
+
+            Stream.Write(header, size);
+
+            if (Size > 0) {
+                const auto pos = Stream.Position();
+                Stream.Write(Data, Size);
+                if (m_Frame.Mask == WS_MASK)
+                    Mask((unsigned char *) Stream.Memory() + pos, Size, m_Frame.MaskingKey);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CWebSocket::SaveToStream(CMemoryStream &Stream) {
-            unsigned char frame[2];
+            WriteFrame(Stream, m_Frame.FIN | m_Frame.RSV1 | m_Frame.Opcode, m_Payload.Memory(), m_Payload.Size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            frame[0] = m_Frame.FIN | m_Frame.Opcode;
-            frame[1] = m_Frame.Mask | m_Frame.Length;
+        void CWebSocket::SaveToStream(CMemoryStream &Stream, size_t FragmentSize) {
+            const auto size = m_Payload.Size();
 
-            Stream.Write(&frame, sizeof(frame));
+            if (FragmentSize == 0 || size <= FragmentSize) {
+                SaveToStream(Stream);
+                return;
+            }
 
-            if (m_Frame.Length > 0) {
-                PayloadToStream(Stream);
+            // RSV1 and the opcode belong to the first frame only, FIN to the last one
+            const auto *data = (const unsigned char *) m_Payload.Memory();
+            for (size_t pos = 0; pos < size; pos += FragmentSize) {
+                const auto count = Min(FragmentSize, size - pos);
+                const unsigned char header = (pos == 0 ? m_Frame.RSV1 | m_Frame.Opcode : WS_OPCODE_CONTINUATION) |
+                        (pos + count == size ? m_Frame.FIN : 0);
+                WriteFrame(Stream, header, data + pos, count);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocket::LoadHeader(const CMemoryStream &Stream) {
-            if (Stream.Size() - Stream.Position() < 2)
-                throw Delphi::Exception::ExceptionFrm(WEBSOCKET_ERROR_MESSAGE, "Frame");
+        void CWebSocket::SaveFragment(CMemoryStream &Stream, const void *Data, size_t Size, unsigned char Opcode, bool Final) {
+            WriteFrame(Stream, (Final ? WS_FIN : 0) | Opcode, Data, Size);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocket::LoadHeader(const CMemoryStream &Stream) {
+            // The header is 2 to 14 bytes long; its full size is known from the second byte. Collect it in
+            // m_Header (it may be split between reads) and decode all fields at once.
+            size_t headerSize = 2;
 
-            unsigned char frame[2] = {0, 0};
-            Stream.Read(frame, sizeof(frame));
+            while (true) {
+                if (m_HeaderSize >= 2) {
+                    const unsigned char length = m_Header[1] & 0x7Fu;
+                    headerSize = 2 + (length == WS_PAYLOAD_LENGTH_16 ? 2 : length == WS_PAYLOAD_LENGTH_64 ? 8 : 0) +
+                                 ((m_Header[1] & WS_MASK) == WS_MASK ? 4 : 0);
+                }
 
-            m_Frame.FIN = frame[0] & WS_FIN;
-            m_Frame.Opcode = frame[0] & 0x0Fu;
+                if (m_HeaderSize == headerSize)
+                    break;
 
-            m_Frame.Mask = frame[1] & WS_MASK;
-            m_Frame.Length = frame[1] & 0x7Fu;
-        }
-        //--------------------------------------------------------------------------------------------------------------
+                const auto streamSize = Stream.Size() - Stream.Position();
+                if (streamSize == 0)
+                    return false;
 
-        void CWebSocket::LoadExtended(const CMemoryStream &Stream) {
+                const auto size = Min(headerSize - m_HeaderSize, streamSize);
+                ::CopyMemory(m_Header + m_HeaderSize, (const unsigned char *) Stream.Memory() + Stream.Position(), size);
+                Stream.Position(Stream.Position() + (off_t) size);
+                m_HeaderSize += size;
+            }
 
-            union {
-                uint16_t val;
-                uint8_t arr[2];
-            } len16 = {0};
+            size_t pos = 2;
 
-            union {
-                uint64_t val;
-                uint8_t arr[8];
-            } len64 = {0};
+            m_Frame.FIN = m_Header[0] & WS_FIN;
+            m_Frame.RSV1 = m_Header[0] & WS_RSV1;
+            m_Frame.Opcode = m_Header[0] & 0x0Fu;
 
-            if (m_Frame.Length == WS_PAYLOAD_LENGTH_16) {
-                if (Stream.Size() - Stream.Position() < sizeof(len16))
-                    throw Delphi::Exception::ExceptionFrm(WEBSOCKET_ERROR_MESSAGE, "Extended-16");
+            m_Frame.Mask = m_Header[1] & WS_MASK;
+            m_Frame.Length = m_Header[1] & 0x7Fu;
 
-                Stream.Read(len16.arr, sizeof(len16));
-                m_PayloadSize = htobe16(len16.val);
+            if (m_Frame.Length == WS_PAYLOAD_LENGTH_16) {
+                uint16_t len16;
+                ::CopyMemory(&len16, m_Header + pos, sizeof(len16));
+                m_PayloadSize = be16toh(len16);
+                pos += sizeof(len16);
             } else if (m_Frame.Length == WS_PAYLOAD_LENGTH_64) {
-                if (Stream.Size() - Stream.Position() < sizeof(len64))
-                    throw Delphi::Exception::ExceptionFrm(WEBSOCKET_ERROR_MESSAGE, "Extended-64");
-
-                Stream.Read(len64.arr, sizeof(len64));
-                m_PayloadSize = htobe64(len64.val);
+                uint64_t len64;
+                ::CopyMemory(&len64, m_Header + pos, sizeof(len64));
+                m_PayloadSize = be64toh(len64);
+                pos += sizeof(len64);
             } else {
                 m_PayloadSize = m_Frame.Length;
             }
-        }
-        //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocket::LoadMaskingKey(const CMemoryStream &Stream) {
-            if (Stream.Size() - Stream.Position() < sizeof(m_Frame.MaskingKey))
-                throw Delphi::Exception::ExceptionFrm(WEBSOCKET_ERROR_MESSAGE, "Masking-key");
+            if (m_Frame.Mask == WS_MASK) {
+                ::CopyMemory(m_Frame.MaskingKey, m_Header + pos, sizeof(m_Frame.MaskingKey));
+            }
 
-            Stream.Read(m_Frame.MaskingKey, sizeof(m_Frame.MaskingKey));
+            m_HeaderSize = 0;
+
+            return true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
         int CWebSocket::LoadFromStream(const CMemoryStream &Stream) {
 
             if (m_State == frame) {
-                LoadHeader(Stream);
-
-                m_State = extended;
-
-                if (Stream.Position() == Stream.Size())
+                if (!LoadHeader(Stream))
                     return -1;
-            }
-
-            if (m_State == extended) {
-                LoadExtended(Stream);
-
-                if (m_Frame.Mask == WS_MASK) {
-                    m_State = masking_key;
-                } else {
-                    m_State = payload_start;
-                }
 
-                if (Stream.Position() == Stream.Size())
-                    return -1;
+                m_State = payload_start;
             }
 
-            if (m_State == masking_key) {
-                LoadMaskingKey(Stream);
+            if (m_State == payload_start) {
+                const bool control = (m_Frame.Opcode & 0x08u) != 0;
+
+                if (!control) {
+                    if (m_Frame.Opcode != WS_OPCODE_CONTINUATION) {
+                        m_MessageOpcode = m_Frame.Opcode;
+                        m_MessageSize = 0;
+                        m_Compressed = m_Frame.RSV1 == WS_RSV1;
+                        m_Chunked = m_Streaming && !m_Compressed;
+                    }
 
-                m_State = payload_start;
+                    // Refuse before the payload buffer grows
+                    if (m_MaxMessageSize != 0 && m_MessageSize + m_PayloadSize > m_MaxMessageSize) {
+                        m_State = frame;
+                        return -2;
+                    }
 
-                if (Stream.Position() == Stream.Size())
-                    return -1;
-            }
+                    m_MessageSize += m_PayloadSize;
+                }
 
-            if (m_State == payload_start) {
+                m_MaskingIndex = 0;
 
-                if (m_Frame.Opcode != WS_OPCODE_CONTINUATION) {
-                    m_MaskingIndex = 0;
+                if (m_Chunked && !control) {
                     m_Payload.Clear();
-                }
+                    m_FrameRemaining = m_PayloadSize;
+                } else {
+                    if (m_Frame.Opcode != WS_OPCODE_CONTINUATION)
+                        m_Payload.Clear();
 
-                const auto payloadSize = m_Payload.Size();
+                    const auto payloadSize = m_Payload.Size();
 
-                m_Payload.SetSize((ssize_t) (payloadSize + m_PayloadSize));
-                SecureZeroMemory((LPBYTE) m_Payload.Memory() + payloadSize, m_PayloadSize);
+                    m_Payload.SetSize((ssize_t) (payloadSize + m_PayloadSize));
+                    m_Payload.Position((off_t) payloadSize);
 
-                m_MaskingIndex = 0;
+                    m_FrameRemaining = 0;
+                }
 
                 m_State = payload;
-
-                if (Stream.Position() == Stream.Size())
-                    return -1;
             }
 
             if (m_State == payload) {
+                if (m_Chunked && (m_Frame.Opcode & 0x08u) == 0) {
+                    // Only what has arrived so far is handed out, memory stays bounded by the read size
+                    const auto streamSize = (uint64_t) (Stream.Size() - Stream.Position());
+                    const auto size = (size_t) (m_FrameRemaining < streamSize ? m_FrameRemaining : streamSize);
+
+                    m_Payload.SetSize((ssize_t) size);
+                    m_Payload.Position(0);
+
+                    PayloadFromStream(Stream);
+                    m_FrameRemaining -= size;
+
+                    if (m_FrameRemaining == 0) {
+                        m_State = frame;
+                        return 1;
+                    }
+
+                    return size == 0 ? -1 : 2;
+                }
+
                 PayloadFromStream(Stream);
 
                 if (m_Payload.Position() == m_Payload.Size()) {
@@ -2465,48 +2747,442 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        CSharedBuffer *CWebSocket::SaveToShared() {
+            CMemoryStream Stream;
+            SaveToStream(Stream);
+            return CSharedBuffer::Create(Stream);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocket::UpdateLength() {
+            const auto size = m_Payload.Size();
+
+            if (size < WS_PAYLOAD_LENGTH_16) {
+                m_Frame.Length = size;
+            } else if (size <= 0xFFFF) {
+                m_Frame.Length = WS_PAYLOAD_LENGTH_16;
+            } else {
+                m_Frame.Length = WS_PAYLOAD_LENGTH_64;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocket::SetPayload(CMemoryStream &Stream, uint32_t Key) {
             m_Frame.FIN = WS_FIN;
+            m_Frame.RSV1 = 0;
             m_Frame.Opcode = WS_OPCODE_BINARY;
 
             if (Key != 0) {
                 m_Frame.SetMaskingKey(Key);
             }
 
-            if (Stream.Size() < WS_PAYLOAD_LENGTH_16) {
-                m_Frame.Length = Stream.Size();
-            } else if (Stream.Size() <= 0xFFFF) {
-                m_Frame.Length = WS_PAYLOAD_LENGTH_16;
-            } else {
-                m_Frame.Length = WS_PAYLOAD_LENGTH_64;
-            }
-
             m_Payload.LoadFromStream(Stream);
+
+            UpdateLength();
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CWebSocket::SetPayload(const CString &String, uint32_t Key) {
             m_Frame.FIN = WS_FIN;
+            m_Frame.RSV1 = 0;
             m_Frame.Opcode = WS_OPCODE_TEXT;
 
             if (Key != 0) {
                 m_Frame.SetMaskingKey(Key);
             }
 
-            if (String.Size() < WS_PAYLOAD_LENGTH_16) {
-                m_Frame.Length = String.Size();
-            } else if (String.Size() <= 0xFFFF) {
-                m_Frame.Length = WS_PAYLOAD_LENGTH_16;
-            } else {
-                m_Frame.Length = WS_PAYLOAD_LENGTH_64;
-            }
-
             m_Payload.Position(0);
             m_Payload.SetSize((ssize_t) String.Size());
 
             String.SaveToStream(m_Payload);
+
+            UpdateLength();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocket::PayloadWritten(unsigned char Opcode, uint32_t Key) {
+            m_Frame.Clear();
+
+            m_Frame.FIN = WS_FIN;
+            m_Frame.Opcode = Opcode;
+
+            if (Key != 0) {
+                m_Frame.SetMaskingKey(Key);
+            }
+
+            m_Payload.SetSize(m_Payload.Position());
+
+            UpdateLength();
         }
+#ifdef WITH_ZLIB
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CWebSocketDeflate -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        #define WS_DEFLATE_EXTENSION "permessage-deflate"
+        #define WS_DEFLATE_ERROR_MESSAGE "WebSocket permessage-deflate error: %s."
+        //--------------------------------------------------------------------------------------------------------------
+
+        static const unsigned char WSDeflateTail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+        //--------------------------------------------------------------------------------------------------------------
+
+        CWebSocketDeflate::CWebSocketDeflate(const CWebSocketDeflateOptions &Options, bool Server):
+                m_Options(Options), m_Server(Server), m_Deflate(), m_Inflate() {
+
+            m_DeflateReady = false;
+            m_InflateReady = false;
+            m_MemoryUsed = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CWebSocketDeflate::~CWebSocketDeflate() {
+            if (m_DeflateReady)
+                deflateEnd(&m_Deflate);
+            if (m_InflateReady)
+                inflateEnd(&m_Inflate);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        voidpf CWebSocketDeflate::Alloc(voidpf Opaque, uInt Items, uInt Size) {
+            auto pDeflate = static_cast<CWebSocketDeflate *> (Opaque);
+
+            const size_t size = (size_t) Items * Size;
+            const size_t header = alignof(max_align_t);
+
+            if (pDeflate->m_Options.MemoryLimit != 0 && pDeflate->m_MemoryUsed + size > pDeflate->m_Options.MemoryLimit)
+                return Z_NULL;
+
+            auto pMemory = static_cast<unsigned char *> (::malloc(header + size));
+            if (pMemory == nullptr)
+                return Z_NULL;
+
+            *reinterpret_cast<size_t *> (pMemory) = size;
+            pDeflate->m_MemoryUsed += size;
+
+            return pMemory + header;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketDeflate::Free(voidpf Opaque, voidpf Address) {
+            auto pDeflate = static_cast<CWebSocketDeflate *> (Opaque);
+            auto pMemory = static_cast<unsigned char *> (Address) - alignof(max_align_t);
+
+            pDeflate->m_MemoryUsed -= *reinterpret_cast<size_t *> (pMemory);
+
+            ::free(pMemory);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketDeflate::InitDeflate() {
+            if (!m_DeflateReady) {
+                // zlib has no raw deflate with an 8-bit window: 9 bits is what it would use anyway
+                const int windowBits = Max(m_Server ? m_Options.ServerMaxWindowBits : m_Options.ClientMaxWindowBits, 9);
+
+                m_Deflate.zalloc = Alloc;
+                m_Deflate.zfree = Free;
+                m_Deflate.opaque = this;
+
+                // Negative window bits: raw deflate stream without zlib header and trailer
+                m_DeflateReady = deflateInit2(&m_Deflate, m_Options.Level, Z_DEFLATED, -windowBits, m_Options.MemLevel,
+                                              Z_DEFAULT_STRATEGY) == Z_OK;
+            }
+
+            return m_DeflateReady;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketDeflate::InitInflate() {
+            if (!m_InflateReady) {
+                // A larger window inflates a stream of a smaller one, and zlib rejects 8 bits for raw inflate
+                const int windowBits = Max(m_Server ? m_Options.ClientMaxWindowBits : m_Options.ServerMaxWindowBits, 9);
+
+                m_Inflate.zalloc = Alloc;
+                m_Inflate.zfree = Free;
+                m_Inflate.opaque = this;
+
+                if (inflateInit2(&m_Inflate, -windowBits) != Z_OK)
+                    throw ExceptionFrm(WS_DEFLATE_ERROR_MESSAGE, m_Inflate.msg == nullptr ? "inflateInit2" : m_Inflate.msg);
+
+                m_InflateReady = true;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
+        void CWebSocketDeflate::Compress(CWebSocket &WebSocket) {
+            auto &Payload = WebSocket.Payload();
+            const auto size = Payload.Size();
+
+            if (size < m_Options.Threshold)
+                return;
+
+            // RSV1 is per message: if zlib could not be initialized (memory limit) just send it uncompressed
+            if (!InitDeflate())
+                return;
+
+            CMemoryStream Stream(deflateBound(&m_Deflate, size) + sizeof(WSDeflateTail));
+            size_t total = 0;
+
+            m_Deflate.next_in = (Bytef *) Payload.Memory();
+            m_Deflate.avail_in = (uInt) size;
+
+            do {
+                if (total == Stream.Size())
+                    Stream.SetSize(total * 2);
+
+                m_Deflate.next_out = (Bytef *) Stream.Memory() + total;
+                m_Deflate.avail_out = (uInt) (Stream.Size() - total);
+
+                const int result = deflate(&m_Deflate, Z_SYNC_FLUSH);
+                if (result != Z_OK && result != Z_BUF_ERROR)
+                    throw ExceptionFrm(WS_DEFLATE_ERROR_MESSAGE, m_Deflate.msg == nullptr ? "deflate" : m_Deflate.msg);
+
+                total = Stream.Size() - m_Deflate.avail_out;
+            } while (m_Deflate.avail_out == 0);
+
+            // RFC 7692 7.2.1: remove the 0x00 0x00 0xFF 0xFF tail of the sync flush
+            if (total >= sizeof(WSDeflateTail))
+                total -= sizeof(WSDeflateTail);
+
+            if (DeflateNoContextTakeover()) {
+                deflateReset(&m_Deflate);
+                // Without a shared window the peer loses nothing if we send the original instead
+                if (total >= size)
+                    return;
+            }
+
+            Stream.SetSize(total);
+            Payload.LoadFromStream(Stream);
+
+            WebSocket.Frame().RSV1 = WS_RSV1;
+            WebSocket.UpdateLength();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketDeflate::Decompress(CWebSocket &WebSocket) {
+            auto &Payload = WebSocket.Payload();
+
+            InitInflate();
+
+            // One byte over the limit tells a message of exactly MaxMessageSize from a bigger one
+            const auto limit = m_Options.MaxMessageSize;
+            auto capacity = Max((size_t) Payload.Size() * 4, (size_t) 4096);
+            if (limit != 0 && capacity > limit)
+                capacity = limit + 1;
+
+            CMemoryStream Stream(capacity);
+            size_t total = 0;
+
+            for (int i = 0; i < 2; i++) {
+                // Second pass appends the tail removed by the sender
+                m_Inflate.next_in = i == 0 ? (Bytef *) Payload.Memory() : (Bytef *) WSDeflateTail;
+                m_Inflate.avail_in = i == 0 ? (uInt) Payload.Size() : (uInt) sizeof(WSDeflateTail);
+
+                do {
+                    if (total == Stream.Size())
+                        Stream.SetSize(limit == 0 ? total * 2 : Min(total * 2, limit + 1));
+
+                    m_Inflate.next_out = (Bytef *) Stream.Memory() + total;
+                    m_Inflate.avail_out = (uInt) (Stream.Size() - total);
+
+                    const int result = inflate(&m_Inflate, Z_SYNC_FLUSH);
+
+                    total = Stream.Size() - m_Inflate.avail_out;
+
+                    if (limit != 0 && total > limit)
+                        throw ExceptionFrm(WS_DEFLATE_ERROR_MESSAGE, "message too big");
+
+                    if (result == Z_STREAM_END) {
+                        inflateReset(&m_Inflate);
+                        m_Inflate.avail_in = 0;
+                        break;
+                    }
+
+                    if (result == Z_BUF_ERROR)
+                        break;
+
+                    if (result != Z_OK)
+                        throw ExceptionFrm(WS_DEFLATE_ERROR_MESSAGE, m_Inflate.msg == nullptr ? "inflate" : m_Inflate.msg);
+
+                } while (m_Inflate.avail_in > 0 || m_Inflate.avail_out == 0);
+            }
+
+            if (InflateNoContextTakeover())
+                inflateReset(&m_Inflate);
+
+            Stream.SetSize(total);
+            Payload.LoadFromStream(Stream);
+            Payload.Position(0);
+
+            WebSocket.Compressed(false);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static bool ParseDeflateExtension(const CString &Extension, CStringList &Names, CStringList &Values) {
+            CStringList Params;
+            SplitColumns(Extension, Params, ';');
+
+            if (Params.Count() == 0 || Params[0].Trim().Lower() != WS_DEFLATE_EXTENSION)
+                return false;
+
+            for (int i = 1; i < Params.Count(); i++) {
+                const auto &Param = Params[i];
+                const auto pos = Param.Find('=');
+                if (pos == CString::npos) {
+                    Names.Add(Param.Trim().Lower());
+                    Values.Add(CString());
+                } else {
+                    Names.Add(Param.SubString(0, pos).Trim().Lower());
+                    Values.Add(Param.SubString(pos + 1).Trim().Trim('"'));
+                }
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        static bool ParseWindowBits(const CString &Value, int &Bits) {
+            if (Value.IsEmpty() || Value.Size() > 2)
+                return false;
+            for (size_t i = 0; i < Value.Size(); i++)
+                if (!IsNumeral(Value.at(i)))
+                    return false;
+            Bits = StrToInt(Value.c_str());
+            return Bits >= 8 && Bits <= 15;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketDeflate::Negotiate(const CString &Offers, const CWebSocketDeflateOptions &Options,
+                CWebSocketDeflateOptions &Agreed, CString &Response) {
+
+            CStringList Extensions;
+            SplitColumns(Offers, Extensions, ',');
+
+            // zlib cannot produce a stream for an 8-bit window (it uses 9), so never agree to less than 9
+            const int serverMaxWindowBits = Max(Min(Options.ServerMaxWindowBits, 15), 9);
+            const int clientMaxWindowBits = Max(Min(Options.ClientMaxWindowBits, 15), 9);
+
+            for (int i = 0; i < Extensions.Count(); i++) {
+                CStringList Names;
+                CStringList Values;
+
+                if (!ParseDeflateExtension(Extensions[i], Names, Values))
+                    continue;
+
+                Agreed = Options;
+                Agreed.Enabled = true;
+                Agreed.ServerMaxWindowBits = serverMaxWindowBits;
+                Agreed.ClientMaxWindowBits = 15;
+
+                bool valid = true;
+                bool clientWindowBits = false;
+
+                for (int j = 0; valid && j < Names.Count(); j++) {
+                    const auto &Name = Names[j];
+                    const auto &Value = Values[j];
+
+                    // Each parameter may appear only once
+                    valid = Names.IndexOf(Name) == j;
+
+                    if (!valid) {
+                        break;
+                    } else if (Name == "server_no_context_takeover") {
+                        valid = Value.IsEmpty();
+                        Agreed.ServerNoContextTakeover = true;
+                    } else if (Name == "client_no_context_takeover") {
+                        valid = Value.IsEmpty();
+                        Agreed.ClientNoContextTakeover = true;
+                    } else if (Name == "server_max_window_bits") {
+                        int bits = 0;
+                        valid = ParseWindowBits(Value, bits) && bits >= 9;
+                        Agreed.ServerMaxWindowBits = Min(bits, serverMaxWindowBits);
+                    } else if (Name == "client_max_window_bits") {
+                        int bits = 15;
+                        valid = Value.IsEmpty() || ParseWindowBits(Value, bits);
+                        // An offered 8 is kept in the response, InitInflate reads that stream with a 9-bit window
+                        Agreed.ClientMaxWindowBits = Min(bits, clientMaxWindowBits);
+                        clientWindowBits = true;
+                    } else {
+                        valid = false;
+                    }
+                }
+
+                if (!valid)
+                    continue;
+
+                Response = WS_DEFLATE_EXTENSION;
+
+                if (Agreed.ServerNoContextTakeover)
+                    Response << "; server_no_context_takeover";
+                if (Agreed.ClientNoContextTakeover)
+                    Response << "; client_no_context_takeover";
+                if (Agreed.ServerMaxWindowBits < 15)
+                    Response << "; server_max_window_bits=" << Agreed.ServerMaxWindowBits;
+                if (clientWindowBits && Agreed.ClientMaxWindowBits < 15)
+                    Response << "; client_max_window_bits=" << Agreed.ClientMaxWindowBits;
+
+                return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketDeflate::Accept(const CString &Response, const CWebSocketDeflateOptions &Options,
+                CWebSocketDeflateOptions &Agreed) {
+
+            CStringList Names;
+            CStringList Values;
+
+            if (!ParseDeflateExtension(Response, Names, Values))
+                return false;
+
+            Agreed = Options;
+            Agreed.Enabled = true;
+            Agreed.ServerMaxWindowBits = 15;
+            Agreed.ClientMaxWindowBits = Max(Min(Options.ClientMaxWindowBits, 15), 9);
+
+            for (int i = 0; i < Names.Count(); i++) {
+                const auto &Name = Names[i];
+                const auto &Value = Values[i];
+
+                int bits = 15;
+
+                if (Name == "server_no_context_takeover") {
+                    Agreed.ServerNoContextTakeover = true;
+                } else if (Name == "client_no_context_takeover") {
+                    Agreed.ClientNoContextTakeover = true;
+                } else if (Name == "server_max_window_bits" && ParseWindowBits(Value, bits)) {
+                    Agreed.ServerMaxWindowBits = bits;
+                } else if (Name == "client_max_window_bits" && ParseWindowBits(Value, bits) && bits >= 9) {
+                    Agreed.ClientMaxWindowBits = Min(bits, Agreed.ClientMaxWindowBits);
+                } else {
+                    throw ExceptionFrm(WS_DEFLATE_ERROR_MESSAGE, "invalid extension response");
+                }
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CWebSocketDeflate::Offer(const CWebSocketDeflateOptions &Options) {
+            CString Result(WS_DEFLATE_EXTENSION);
+
+            if (Options.ServerNoContextTakeover)
+                Result << "; server_no_context_takeover";
+            if (Options.ClientNoContextTakeover)
+                Result << "; client_no_context_takeover";
+            if (Options.ServerMaxWindowBits < 15)
+                Result << "; server_max_window_bits=" << Max(Options.ServerMaxWindowBits, 9);
+
+            Result << "; client_max_window_bits";
+            if (Options.ClientMaxWindowBits < 15)
+                Result << "=" << Max(Options.ClientMaxWindowBits, 9);
+
+            return Result;
+        }
+#endif
         //--------------------------------------------------------------------------------------------------------------
 
         //-- CWebSocketConnection --------------------------------------------------------------------------------------
@@ -2527,9 +3203,36 @@ namespace Delphi {
 
             m_OnPing = nullptr;
             m_OnPong = nullptr;
+
+            m_OnFragment = nullptr;
+
+            m_FragmentSize = 0;
+            m_FragmentOpen = false;
+#ifdef WITH_ZLIB
+            m_pDeflate = nullptr;
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CWebSocketConnection::~CWebSocketConnection() {
+#ifdef WITH_ZLIB
+            DisableDeflate();
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+#ifdef WITH_ZLIB
+        void CWebSocketConnection::EnableDeflate(const CWebSocketDeflateOptions &Agreed, bool Server) {
+            DisableDeflate();
+            m_pDeflate = new CWebSocketDeflate(Agreed, Server);
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CWebSocketConnection::DisableDeflate() {
+            delete m_pDeflate;
+            m_pDeflate = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+#endif
         void CWebSocketConnection::Clear() {
             m_WSRequest.Clear();
             m_WSReply.Clear();
@@ -2556,15 +3259,57 @@ namespace Delphi {
 
                 status = CWebSocketParser::Parse(m_WSRequest, Stream);
 
+                if (status == -2) {
+                    const uint16_t code = htobe16(WS_CLOSE_MESSAGE_TOO_BIG);
+
+                    m_WSReply.Clear();
+                    m_WSReply.Payload().Write(&code, sizeof(code));
+                    m_WSReply.UpdateLength();
+
+                    m_CloseConnection = true;
+                    SendWebSocketClose();
+                    break;
+                }
+
+                // RSV1 is only defined for the first frame of a data message and only with permessage-deflate
+                if (m_WSRequest.Frame().RSV1 != 0) {
+#ifdef WITH_ZLIB
+                    const auto opcode = m_WSRequest.Frame().Opcode;
+                    if (m_pDeflate == nullptr || (opcode != WS_OPCODE_TEXT && opcode != WS_OPCODE_BINARY)) {
+#endif
+                        m_CloseConnection = true;
+                        DoRequest();
+                        SendWebSocketClose();
+                        break;
+#ifdef WITH_ZLIB
+                    }
+#endif
+                }
+
                 switch (m_WSRequest.Frame().Opcode) {
                     case WS_OPCODE_CONTINUATION:
                     case WS_OPCODE_TEXT:
                     case WS_OPCODE_BINARY:
 
-                        if (m_WSRequest.Frame().FIN == 0 || status == -1) {
+                        if (m_WSRequest.Chunked()) {
+                            if (status == 1 || status == 2)
+                                DoFragment();
+
+                            if (status == 1 && m_WSRequest.Frame().FIN == WS_FIN) {
+                                m_ConnectionStatus = csRequestOk;
+                                DoRequest();
+                            } else {
+                                m_ConnectionStatus = csWaitRequest;
+                                DoWaitRequest();
+                            }
+                        } else if (m_WSRequest.Frame().FIN == 0 || status == -1) {
                             m_ConnectionStatus = csWaitRequest;
                             DoWaitRequest();
                         } else {
+#ifdef WITH_ZLIB
+                            if (m_WSRequest.Compressed())
+                                m_pDeflate->Decompress(m_WSRequest);
+#endif
                             m_ConnectionStatus = csRequestOk;
                             DoRequest();
                             OnExecute(this);
@@ -2601,7 +3346,12 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         void CWebSocketConnection::SendWebSocket(bool bSendNow) {
-            m_WSReply.SaveToStream(OutputBuffer());
+#ifdef WITH_ZLIB
+            const auto opcode = m_WSReply.Frame().Opcode;
+            if (m_pDeflate != nullptr && m_WSReply.Frame().RSV1 == 0 && (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY))
+                m_pDeflate->Compress(m_WSReply);
+#endif
+            m_WSReply.SaveToStream(OutputBuffer(), m_FragmentSize);
 #ifdef _DEBUG
             const auto &Buffer = OutputBuffer();
             CString Hex;
@@ -2621,6 +3371,42 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        bool CWebSocketConnection::SendWebSocket(CSharedBuffer *AFrame) {
+            if (!Enqueue(AFrame))
+                return false;
+
+            WriteAsync();
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketConnection::SendWebSocketFragment(const void *Data, size_t Size, bool Final, unsigned char Opcode,
+                bool bSendNow) {
+
+            // Opcode goes with the first frame of the message, the rest are continuations
+            const auto *data = (const unsigned char *) Data;
+            size_t pos = 0;
+
+            do {
+                const auto count = m_FragmentSize == 0 ? Size - pos : Min(m_FragmentSize, Size - pos);
+                const auto opcode = m_FragmentOpen ? WS_OPCODE_CONTINUATION : Opcode;
+
+                pos += count;
+                m_FragmentOpen = !(Final && pos == Size);
+
+                m_WSReply.SaveFragment(OutputBuffer(), data + pos - count, count, opcode, !m_FragmentOpen);
+            } while (pos < Size);
+
+            m_ConnectionStatus = csReplyReady;
+
+            if (bSendNow) {
+                WriteAsync();
+                m_ConnectionStatus = csReplySent;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocketConnection::SendWebSocketPing(bool bSendNow) {
             TCHAR szDate[25] = {0};
 
@@ -2672,6 +3458,13 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CWebSocketConnection::DoFragment() {
+            if (m_OnFragment != nullptr) {
+                m_OnFragment(this);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocketConnection::DoWaitRequest() {
             if (m_OnWaitRequest != nullptr) {
                 m_OnWaitRequest(this);
@@ -3760,6 +4553,7 @@ namespace Delphi {
             m_AutoConnect = true;
 #ifdef WITH_SSL
             m_UsedSSL = false;
+            m_KTLS = false;
 #endif
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -3804,6 +4598,7 @@ namespace Delphi {
             try {
 #ifdef WITH_SSL
                 pIOHandler->Open(m_UsedSSL ? sslClient : sslNotUsed);
+                pIOHandler->Binding()->KTLS(m_UsedSSL && m_KTLS);
 #else
                 pIOHandler->Open();
 #endif
@@ -4692,6 +5487,7 @@ namespace Delphi {
             m_AutoConnect = true;
 #ifdef WITH_SSL
             m_UsedSSL = false;
+            m_KTLS = false;
 #endif
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -4742,6 +5538,7 @@ namespace Delphi {
             auto pIOHandler = new CIOHandlerSocket();
 #ifdef WITH_SSL
             pIOHandler->Open(m_UsedSSL ? sslClient : sslNotUsed);
+            pIOHandler->Binding()->KTLS(m_UsedSSL && m_KTLS);
 #else
             pIOHandler->Open();
 #endif
@@ -67,97 +67,299 @@ namespace Delphi {
         // m: ErrorMessage
         // p: Payload
 
-        bool CWSProtocol::Request(const CString &String, CWSMessage &Message) {
-            bool Result = false;
+        #define WS_PROTOCOL_SYNTAX_ERROR "JSON Parser syntax error in position %d, char: %#x"
 
-            if (String.Size() > 0) {
-                CJSON Json(String);
+        static LPCTSTR SkipWS(LPCTSTR P, LPCTSTR End) {
+            while (P < End && (*P == ' ' || *P == '\t' || *P == '\n' || *P == '\r'))
+                P++;
+            return P;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                const auto &Type = Json["t"].AsString();
-                const auto type = Type.IsEmpty() ? -1 : StrToIntDef(Type.c_str(), -1);
+        /// P points to the opening quote; returns the position after the closing one or nullptr.
+        static LPCTSTR SkipString(LPCTSTR P, LPCTSTR End) {
+            P++;
+            while (P < End) {
+                auto Quote = (LPCTSTR) ::memchr(P, '"', End - P);
+                if (Quote == nullptr)
+                    return nullptr;
 
-                switch (type) {
-                    case 0:
-                        Message.MessageTypeId = mtOpen;
-                        break;
-                    case 1:
-                        Message.MessageTypeId = mtClose;
-                        break;
-                    case 2:
-                        Message.MessageTypeId = mtCall;
-                        break;
-                    case 3:
-                        Message.MessageTypeId = mtCallResult;
-                        break;
-                    case 4:
-                        Message.MessageTypeId = mtCallError;
-                        break;
-                    default:
-                        throw Delphi::Exception::Exception("Invalid \"MessageTypeId\" value.");
+                LPCTSTR Back = Quote;
+                while (Back > P && *(Back - 1) == '\\')
+                    Back--;
+
+                if (((Quote - Back) & 1) == 0)
+                    return Quote + 1;
+
+                P = Quote + 1;
+            }
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Delimits one value without decoding it; returns the position after it or nullptr.
+        static LPCTSTR SkipValue(LPCTSTR P, LPCTSTR End) {
+            if (P >= End)
+                return nullptr;
+
+            if (*P == '"')
+                return SkipString(P, End);
+
+            if (*P == '{' || *P == '[') {
+                int Depth = 0;
+                while (P < End) {
+                    switch (*P) {
+                        case '"':
+                            P = SkipString(P, End);
+                            if (P == nullptr)
+                                return nullptr;
+                            continue;
+                        case '{':
+                        case '[':
+                            Depth++;
+                            break;
+                        case '}':
+                        case ']':
+                            if (--Depth == 0)
+                                return P + 1;
+                            break;
+                        default:
+                            break;
+                    }
+                    P++;
                 }
+                return nullptr;
+            }
 
-                const auto& errorCode = Json["c"];
+            LPCTSTR Start = P;
+            while (P < End && *P != ',' && *P != '}' && *P != ']' && *P != ' ' && *P != '\t' && *P != '\n' && *P != '\r')
+                P++;
 
-                Message.UniqueId     = Json["u"].AsString();
-                Message.Action       = Json["a"].AsString();
-                Message.ErrorCode    = errorCode.IsEmpty() ? -1 : Json["c"].AsInteger();
-                Message.ErrorMessage = Json["m"].AsString();
+            return P == Start ? nullptr : P;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                const auto& payload  = Json["p"];
-                if (payload.ValueType() == jvtObject || payload.ValueType() == jvtArray)
-                    Message.Payload  = payload.ToString();
+        static int ValueToInt(LPCTSTR Begin, LPCTSTR End, int Default) {
+            if (*Begin == '"') {
+                Begin++;
+                End--;
             }
 
-            return Result;
+            if (Begin >= End)
+                return Default;
+
+            bool Negative = *Begin == '-';
+            if (Negative)
+                Begin++;
+
+            if (Begin == End)
+                return Default;
+
+            int Result = 0;
+            for (; Begin < End; ++Begin) {
+                if (*Begin < '0' || *Begin > '9')
+                    return Default;
+                Result = Result * 10 + (*Begin - '0');
+            }
+
+            return Negative ? -Result : Result;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWSProtocol::Response(const CWSMessage &Message, CString &String) {
+        static CString ValueToString(LPCTSTR Begin, LPCTSTR End) {
+            if (*Begin != '"') {
+                if (End - Begin == 4 && ::strncmp(Begin, "null", 4) == 0)
+                    return {};
+                return { Begin, (size_t) (End - Begin) };
+            }
 
-            const auto& UniqueId = Message.UniqueId.IsEmpty() ? GetUID(42) : Message.UniqueId;
-            const auto& Payload = Message.Payload.ToString();
-            const size_t Size = Message.Size() + Payload.Size();
+            const auto Size = (size_t) (End - Begin - 2);
+            if (Size == 0)
+                return {};
 
-            String.MaxFormatSize(256 + Size);
+            const CString Data(Begin + 1, Size);
+            if (::memchr(Data.Data(), '\\', Size) == nullptr)
+                return Data;
 
-            switch (Message.MessageTypeId) {
-                case mtOpen:
-                    String.Format(R"({"t":0,"u":"%s","p":%s})",
-                                  UniqueId.c_str(),
-                                  Payload.IsEmpty() ? "{}" : Payload.c_str()
-                    );
-                    break;
+            return Delphi::Json::DecodeJsonString(Data);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                case mtClose:
-                    String.Format(R"({"t":1,"u":"%s","p":%s})",
-                                  UniqueId.c_str(),
-                                  Payload.IsEmpty() ? "{}" : Payload.c_str()
-                    );
-                    break;
+        bool CWSProtocol::Request(LPCTSTR Buffer, size_t Size, CWSMessage &Message) {
+
+            if (Buffer == nullptr || Size == 0)
+                return false;
+
+            LPCTSTR End = Buffer + Size;
+            LPCTSTR P = SkipWS(Buffer, End);
+
+            const auto SyntaxError = [Buffer, End](LPCTSTR Pos) {
+                const auto Index = Pos == nullptr ? End - Buffer : Pos - Buffer;
+                throw Delphi::Exception::EJSONParseSyntaxError(_T(WS_PROTOCOL_SYNTAX_ERROR), (int) Index,
+                                                               Pos < End && Pos != nullptr ? (u_char) *Pos : 0);
+            };
+
+            if (P == End || *P != '{')
+                SyntaxError(P);
+
+            int Type = -1;
+
+            Message.UniqueId.Clear();
+            Message.Action.Clear();
+            Message.ErrorCode = -1;
+            Message.ErrorMessage.Clear();
+            Message.m_Payload.Clear();
+            Message.RawPayload.Clear();
+
+            P = SkipWS(P + 1, End);
+
+            if (P < End && *P == '}') {
+                P++;
+            } else {
+                while (true) {
+                    if (P == End || *P != '"')
+                        SyntaxError(P);
+
+                    LPCTSTR Key = P + 1;
+                    P = SkipString(P, End);
+                    if (P == nullptr)
+                        SyntaxError(P);
+
+                    const auto KeySize = P - Key - 1;
+
+                    P = SkipWS(P, End);
+                    if (P == End || *P != ':')
+                        SyntaxError(P);
+
+                    LPCTSTR Value = SkipWS(P + 1, End);
+                    P = SkipValue(Value, End);
+                    if (P == nullptr)
+                        SyntaxError(P);
+
+                    if (KeySize == 1) {
+                        switch (*Key) {
+                            case 't':
+                                Type = ValueToInt(Value, P, -1);
+                                break;
+                            case 'u':
+                                Message.UniqueId = ValueToString(Value, P);
+                                break;
+                            case 'a':
+                                Message.Action = ValueToString(Value, P);
+                                break;
+                            case 'c':
+                                Message.ErrorCode = ValueToInt(Value, P, -1);
+                                break;
+                            case 'm':
+                                Message.ErrorMessage = ValueToString(Value, P);
+                                break;
+                            case 'p':
+                                if (*Value == '{' || *Value == '[') {
+                                    Message.RawPayload = CString(Value, (size_t) (P - Value));
+                                }
+                                break;
+                            default:
+                                break;
+                        }
+                    }
 
-                case mtCall:
-                    String.Format(R"({"t":2,"u":"%s","a":"%s","p":%s})",
-                                  UniqueId.c_str(),
-                                  Message.Action.c_str(),
-                                  Payload.IsEmpty() ? "{}" : Payload.c_str()
-                    );
-                    break;
+                    P = SkipWS(P, End);
+                    if (P == End)
+                        SyntaxError(P);
 
-                case mtCallResult:
-                    String.Format(R"({"t":3,"u":"%s","p":%s})",
-                                  UniqueId.c_str(),
-                                  Payload.IsEmpty() ? "{}" : Payload.c_str()
-                    );
-                    break;
+                    if (*P == '}') {
+                        P++;
+                        break;
+                    }
+
+                    if (*P != ',')
+                        SyntaxError(P);
 
-                case mtCallError:
-                    String.Format(R"({"t":4,"u":"%s","c":%d,"m":"%s"})",
-                                  UniqueId.c_str(),
-                                  Message.ErrorCode,
-                                  Delphi::Json::EncodeJsonString(Message.ErrorMessage).c_str()
-                    );
+                    P = SkipWS(P + 1, End);
+                }
+            }
+
+            if (SkipWS(P, End) != End)
+                SyntaxError(P);
+
+            switch (Type) {
+                case 0:
+                    Message.MessageTypeId = mtOpen;
+                    break;
+                case 1:
+                    Message.MessageTypeId = mtClose;
+                    break;
+                case 2:
+                    Message.MessageTypeId = mtCall;
+                    break;
+                case 3:
+                    Message.MessageTypeId = mtCallResult;
                     break;
+                case 4:
+                    Message.MessageTypeId = mtCallError;
+                    break;
+                default:
+                    throw Delphi::Exception::Exception("Invalid \"MessageTypeId\" value.");
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWSProtocol::Request(const CString &String, CWSMessage &Message) {
+            return Request(String.Data(), String.Size(), Message);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWSProtocol::Response(const CWSMessage &Message, CMemoryStream &Stream) {
+            CJSONWriter Writer(Stream);
+
+            Writer.BeginObject();
+
+            Writer.Key("t", 1).Integer(Message.MessageTypeId);
+
+            if (Message.UniqueId.IsEmpty())
+                Writer.Key("u", 1).String(GetUID(42));
+            else
+                Writer.Key("u", 1).String(Message.UniqueId);
+
+            if (Message.MessageTypeId == mtCall)
+                Writer.Key("a", 1).String(Message.Action);
+
+            if (Message.MessageTypeId == mtCallError) {
+                Writer.Key("c", 1).Integer(Message.ErrorCode);
+                Writer.Key("m", 1).String(Message.ErrorMessage);
+            } else {
+                Writer.Key("p", 1);
+
+                // An accessed (possibly modified) payload wins over the raw text it was parsed from
+                if (!Message.m_Payload.IsNull()) {
+                    const auto &Payload = Message.m_Payload.ToString();
+                    Writer.Raw(Payload.IsEmpty() ? CString("{}") : Payload);
+                } else if (!Message.RawPayload.IsEmpty()) {
+                    Writer.Raw(Message.RawPayload);
+                } else {
+                    Writer.Raw("{}", 2);
+                }
             }
+
+            Writer.EndObject();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWSProtocol::Response(const CWSMessage &Message, CWebSocket &Reply) {
+            Reply.Payload().Position(0);
+            Response(Message, Reply.Payload());
+            Reply.PayloadWritten();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWSProtocol::Response(const CWSMessage &Message, CString &String) {
+            CMemoryStream Stream;
+            Response(Message, Stream);
+            String.Clear();
+            if (Stream.Size() > 0)
+                String.Append((LPCTSTR) Stream.Memory(), Stream.Size());
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -172,7 +374,7 @@ namespace Delphi {
             Result.MessageTypeId = mtCall;
             Result.UniqueId = UniqueId;
             Result.Action = Action;
-            Result.Payload = Payload;
+            Result.Json() = Payload;
             return Result;
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -181,7 +383,7 @@ namespace Delphi {
             CWSMessage Result;
             Result.MessageTypeId = mtCallResult;
             Result.UniqueId = UniqueId;
-            Result.Payload = Payload;
+            Result.Json() = Payload;
             return Result;
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -192,7 +394,7 @@ namespace Delphi {
             Result.UniqueId = UniqueId;
             Result.ErrorCode = ErrorCode;
             Result.ErrorMessage = ErrorMessage;
-            Result.Payload = Payload;
+            Result.Json() = Payload;
             return Result;
         }
         //--------------------------------------------------------------------------------------------------------------
@@ -219,8 +421,19 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         CMessageHandler::CMessageHandler(CMessageManager *AManager, COnMessageHandlerEvent &&Handler) :
-                CCollectionItem(AManager), m_Handler(Handler) {
+                CCollectionItem(AManager), m_pManager(AManager), m_Handler(Handler) {
             m_UniqueId = GetUID(42);
+            m_Deadline = 0;
+            m_Slot = -1;
+            m_Expired = false;
+            m_OnCancel = nullptr;
+            m_pManager->m_Index.Add(m_UniqueId, this);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CMessageHandler::~CMessageHandler() {
+            if (Assigned(m_pManager))
+                m_pManager->Detach(this);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -236,6 +449,22 @@ namespace Delphi {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        CMessageManager::CMessageManager(CSession *ASession): CCollection(this), m_pSession(ASession) {
+            m_WheelTick = MsEpoch() / MESSAGE_WHEEL_RESOLUTION;
+            m_Timeout = MESSAGE_TIMEOUT_DEFAULT;
+            m_MaxPending = 0;
+            m_pDestroyed = nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CMessageManager::~CMessageManager() {
+            if (m_pDestroyed != nullptr)
+                *m_pDestroyed = true;
+            // Handlers detach themselves from the index and the wheel
+            Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         CMessageHandler *CMessageManager::Get(int Index) const {
             return dynamic_cast<CMessageHandler *> (inherited::GetItem(Index));
         }
@@ -246,22 +475,49 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CMessageManager::Schedule(CMessageHandler *AHandler, unsigned long Timeout) {
+            if (Timeout == 0)
+                return;
+
+            AHandler->m_Deadline = MsEpoch() + Timeout;
+            AHandler->m_Slot = (int) ((AHandler->m_Deadline / MESSAGE_WHEEL_RESOLUTION) % MESSAGE_WHEEL_SIZE);
+
+            m_Wheel[AHandler->m_Slot].Add(AHandler);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMessageManager::Detach(CMessageHandler *AHandler) {
+            m_Index.Remove(AHandler->UniqueId(), AHandler);
+
+            if (AHandler->m_Slot != -1) {
+                m_Wheel[AHandler->m_Slot].Remove(AHandler);
+                AHandler->m_Slot = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         CMessageHandler *CMessageManager::Add(COnMessageHandlerEvent &&Handler, const CString &Action,
                 const CJSON &Payload) {
-            
+            return Add(static_cast<COnMessageHandlerEvent &&>(Handler), Action, Payload, m_Timeout);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CMessageHandler *CMessageManager::Add(COnMessageHandlerEvent &&Handler, const CString &Action,
+                const CJSON &Payload, unsigned long Timeout, COnMessageCancelEvent &&OnCancel) {
+
+            // Back-pressure: the caller has to wait for answers before sending more
+            if (Full())
+                return nullptr;
+
             auto pHandler = new CMessageHandler(this, static_cast<COnMessageHandlerEvent &&>(Handler));
             auto pConnection = m_pSession->Connection();
 
             pHandler->Action() = Action;
+            pHandler->OnCancel(static_cast<COnMessageCancelEvent &&>(OnCancel));
 
-            CString Result;
-
-            CWSProtocol::ResponseCall(pHandler->UniqueId(), Action, Payload, Result);
+            Schedule(pHandler, Timeout);
 
-            auto &WSReply = pConnection->WSReply();
-
-            WSReply.Clear();
-            WSReply.SetPayload(Result);
+            CWSProtocol::Response(CWSProtocol::Call(pHandler->UniqueId(), Action, Payload), pConnection->WSReply());
 
             pConnection->SendWebSocket(true);
 
@@ -270,15 +526,121 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         CMessageHandler *CMessageManager::FindMessageById(const CString &Value) {
-            CMessageHandler *Handler = nullptr;
+            return (CMessageHandler *) m_Index.Find(Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            for (int i = 0; i < Count(); ++i) {
-                Handler = Get(i);
-                if (Handler->UniqueId() == Value)
-                    return Handler;
+        bool CMessageManager::Resolve(const CString &UniqueId, CHTTPServerConnection *AConnection) {
+            auto pHandler = FindMessageById(UniqueId);
+            if (pHandler == nullptr)
+                return false;
+
+            // Off the table first, so a late duplicate answer finds nothing
+            Detach(pHandler);
+
+            try {
+                pHandler->Handler(AConnection);
+            } catch (...) {
+                delete pHandler;
+                throw;
             }
 
-            return nullptr;
+            delete pHandler;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMessageManager::Cancel(CMessageHandler *AHandler) {
+            Detach(AHandler);
+
+            try {
+                if (AHandler->m_OnCancel != nullptr)
+                    AHandler->m_OnCancel(AHandler);
+            } catch (...) {
+                delete AHandler;
+                throw;
+            }
+
+            delete AHandler;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMessageManager::CancelAll() {
+            while (Count() > 0)
+                Cancel(Last());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CMessageManager::CheckTimeout(unsigned long Now) {
+            CList Expired;
+            CMessageHandler *pHandler;
+
+            const auto tick = Now / MESSAGE_WHEEL_RESOLUTION;
+            if (tick < m_WheelTick)
+                return 0;
+
+            // Visit every slot passed since the last check, at most one full turn
+            const auto from = tick - m_WheelTick >= MESSAGE_WHEEL_SIZE ? tick - MESSAGE_WHEEL_SIZE + 1 : m_WheelTick;
+
+            for (auto t = from; t <= tick; ++t) {
+                auto &Slot = m_Wheel[t % MESSAGE_WHEEL_SIZE];
+                for (int i = 0; i < Slot.Count(); ++i) {
+                    pHandler = (CMessageHandler *) Slot.Items(i);
+                    if (pHandler->m_Deadline <= Now)
+                        Expired.Add(pHandler);
+                }
+            }
+
+            m_WheelTick = tick;
+
+            // Taken out of the collection before any callback runs: CancelAll() or the end of the session
+            // can no longer reach them, they are freed here only
+            for (int i = 0; i < Expired.Count(); ++i) {
+                pHandler = (CMessageHandler *) Expired.Items(i);
+                Detach(pHandler);
+                pHandler->Collection(nullptr);
+                pHandler->m_pManager = nullptr;
+                pHandler->m_Expired = true;
+            }
+
+            const auto Result = Expired.Count();
+
+            bool Destroyed = false;
+            const auto pDestroyed = m_pDestroyed;
+            m_pDestroyed = &Destroyed;
+
+            int Index = 0;
+
+            const auto Release = [&]() {
+                while (Index < Expired.Count())
+                    delete (CMessageHandler *) Expired.Items(Index++);
+
+                if (Destroyed) {
+                    if (pDestroyed != nullptr)
+                        *pDestroyed = true;
+                } else {
+                    m_pDestroyed = pDestroyed;
+                }
+            };
+
+            try {
+                // Once a callback has destroyed this manager the rest are freed without notice
+                while (Index < Expired.Count() && !Destroyed) {
+                    pHandler = (CMessageHandler *) Expired.Items(Index);
+                    if (pHandler->m_OnCancel != nullptr)
+                        pHandler->m_OnCancel(pHandler);
+                    delete pHandler;
+                    Index++;
+                }
+            } catch (...) {
+                Release();
+                throw;
+            }
+
+            Release();
+
+            return Result;
         }
 
         //--------------------------------------------------------------------------------------------------------------
@@ -290,17 +652,57 @@ namespace Delphi {
         CSession::CSession(CHTTPServerConnection *AConnection, CSessionManager *AManager) : CCollectionItem(AManager) {
             m_UpdateCount = 0;
             m_Authorized = false;
+            m_Stale = false;
+            m_pManager = AManager;
             m_pConnection = AConnection;
             AddToConnection(AConnection);
         }
         //--------------------------------------------------------------------------------------------------------------
 
         CSession::~CSession() {
+            if (Assigned(m_pManager))
+                m_pManager->DeleteFromIndex(this);
             DeleteFromConnection(m_pConnection);
             m_pConnection = nullptr;
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CSession::SetIdentity(const CString &Value) {
+            if (m_Identity != Value) {
+                m_Identity = Value;
+                if (Assigned(m_pManager))
+                    m_pManager->UpdateIndex(this);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSession::SetSession(const CString &Value) {
+            if (m_Session != Value) {
+                m_Session = Value;
+                if (Assigned(m_pManager))
+                    m_pManager->UpdateIndex(this);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSession::SetIP(const CString &Value) {
+            if (m_IP != Value) {
+                m_IP = Value;
+                if (Assigned(m_pManager))
+                    m_pManager->UpdateIndex(this);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString &CSession::GetMutableKey(CString &Value) {
+            if (!m_Stale && Assigned(m_pManager)) {
+                m_Stale = true;
+                m_pManager->m_Stale.Add(this);
+            }
+            return Value;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CSession::AddToConnection(CHTTPServerConnection *AConnection) {
             if (Assigned(AConnection)) {
                 AConnection->Object(this);
@@ -341,6 +743,12 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        CSessionManager::~CSessionManager() {
+            // Sessions unregister themselves from the indexes, so they have to go first
+            Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         CSession *CSessionManager::Get(int Index) const {
             return dynamic_cast<CSession *> (inherited::GetItem(Index));
         }
@@ -351,16 +759,68 @@ namespace Delphi {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CSessionManager::Reindex(CHashTable &Index, CString &OldKey, const CString &NewKey, CSession *ASession) {
+            if (OldKey == NewKey)
+                return;
+            if (!OldKey.IsEmpty())
+                Index.Remove(OldKey, ASession);
+            if (!NewKey.IsEmpty())
+                Index.Add(NewKey, ASession);
+            OldKey = NewKey;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionManager::UpdateIndex(CSession *ASession) {
+            Reindex(m_SessionIndex, ASession->m_IndexedSession, ASession->m_Session, ASession);
+            Reindex(m_IdentityIndex, ASession->m_IndexedIdentity, ASession->m_Identity, ASession);
+            Reindex(m_IPIndex, ASession->m_IndexedIP, ASession->m_IP, ASession);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionManager::DeleteFromIndex(CSession *ASession) {
+            const CString Empty;
+
+            Reindex(m_SessionIndex, ASession->m_IndexedSession, Empty, ASession);
+            Reindex(m_IdentityIndex, ASession->m_IndexedIdentity, Empty, ASession);
+            Reindex(m_IPIndex, ASession->m_IndexedIP, Empty, ASession);
+
+            if (ASession->m_Stale)
+                m_Stale.Remove(ASession);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionManager::CheckStale() {
+            CSession *pSession;
+
+            for (int i = 0; i < m_Stale.Count(); ++i) {
+                pSession = (CSession *) m_Stale[i];
+                pSession->m_Stale = false;
+                UpdateIndex(pSession);
+            }
+
+            m_Stale.Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         CSession *CSessionManager::Add(CHTTPServerConnection *AConnection) {
             return new CSession(AConnection, this);
         }
         //--------------------------------------------------------------------------------------------------------------
 
         CSession *CSessionManager::Find(const CString &Session, const CString &Identity) {
+            CList List;
             CSession *pSession;
-            for (int i = 0; i < Count(); ++i) {
-                pSession = Get(i);
-                if (pSession->Session() == Session && pSession->Identity() == Identity)
+
+            // An empty key matches nothing, as CString never finds two empty strings equal
+            if (Session.IsEmpty() || Identity.IsEmpty())
+                return nullptr;
+
+            CheckStale();
+            m_SessionIndex.FindAll(Session, List);
+
+            for (int i = 0; i < List.Count(); ++i) {
+                pSession = (CSession *) List.Items(i);
+                if (pSession->m_Identity == Identity)
                     return pSession;
             }
 
@@ -369,50 +829,130 @@ namespace Delphi {
         //--------------------------------------------------------------------------------------------------------------
 
         CSession *CSessionManager::FindByIP(const CString &Value) {
-            CSession *pSession;
-            for (int i = 0; i < Count(); ++i) {
-                pSession = Get(i);
-                if (pSession->IP() == Value)
-                    return pSession;
-            }
-
-            return nullptr;
+            if (Value.IsEmpty())
+                return nullptr;
+            CheckStale();
+            return (CSession *) m_IPIndex.Find(Value);
         }
         //--------------------------------------------------------------------------------------------------------------
 
         CSession *CSessionManager::FindBySession(const CString &Value) {
-            CSession *pSession;
-            for (int i = 0; i < Count(); ++i) {
-                pSession = Get(i);
-                if (pSession->Session() == Value)
-                    return pSession;
-            }
+            if (Value.IsEmpty())
+                return nullptr;
+            CheckStale();
+            return (CSession *) m_SessionIndex.Find(Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSession *CSessionManager::FindByIdentity(const CString &Value) {
+            if (Value.IsEmpty())
+                return nullptr;
+            CheckStale();
+            return (CSession *) m_IdentityIndex.Find(Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSession *CSessionManager::FindByConnection(CHTTPServerConnection *Value) {
+            // The connection carries its session (see CSession::AddToConnection)
+            if (Value == nullptr)
+                return nullptr;
+
+            auto pSession = dynamic_cast<CSession *> (Value->Object());
+            if (pSession != nullptr && pSession->Collection() == this && pSession->Connection() == Value)
+                return pSession;
 
             return nullptr;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CSession *CSessionManager::FindByIdentity(const CString &Value) {
-            CSession *pSession;
-            for (int i = 0; i < Count(); ++i) {
-                pSession = Get(i);
-                if (pSession->Identity() == Value)
-                    return pSession;
+        int CSessionManager::FindAllByIP(const CString &Value, CList &List) {
+            if (Value.IsEmpty())
+                return 0;
+            CheckStale();
+            return m_IPIndex.FindAll(Value, List);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CSessionManager::FindAllByIdentity(const CString &Value, CList &List) {
+            if (Value.IsEmpty())
+                return 0;
+            CheckStale();
+            return m_IdentityIndex.FindAll(Value, List);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CSessionManager::CheckTimeout(unsigned long Now) {
+            int Result = 0;
+            // Cancel callbacks may drop sessions, hence the reverse walk and the bound check
+            for (int i = Count() - 1; i >= 0; --i) {
+                if (i >= Count())
+                    continue;
+                auto pSession = Get(i);
+                if (pSession->Messages().Count() > 0)
+                    Result += pSession->Messages().CheckTimeout(Now);
+            }
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CSessionManager::Broadcast(const CWSMessage &Message, const COnSessionFilterEvent &Filter) {
+            CWebSocket Frame;
+
+            // Serialize and frame once, every recipient queues the same bytes
+            CWSProtocol::Response(Message, Frame);
+
+            auto pFrame = Frame.SaveToShared();
+
+            int Count;
+            try {
+                Count = Broadcast(pFrame, Filter);
+            } catch (...) {
+                pFrame->Release();
+                throw;
             }
 
-            return nullptr;
+            pFrame->Release();
+
+            return Count;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CSession *CSessionManager::FindByConnection(CHTTPServerConnection *Value) {
+        int CSessionManager::Broadcast(CSharedBuffer *AFrame, const COnSessionFilterEvent &Filter) {
+            CList Slow;
             CSession *pSession;
+            CHTTPServerConnection *pConnection;
+
+            int Result = 0;
+
             for (int i = 0; i < Count(); ++i) {
                 pSession = Get(i);
-                if (pSession->Connection() == Value)
-                    return pSession;
+                pConnection = pSession->Connection();
+
+                if (pConnection == nullptr || pConnection->ClosedGracefully() || pConnection->Protocol() != pWebSocket)
+                    continue;
+
+                if (Filter && !Filter(pSession))
+                    continue;
+
+                try {
+                    if (pConnection->SendWebSocket(AFrame)) {
+                        Result++;
+                    } else if (pConnection->OutputQueueAction() == oqDisconnect) {
+                        Slow.Add(pConnection);
+                    }
+                } catch (Delphi::Exception::Exception &) {
+                    Slow.Add(pConnection);
+                }
             }
 
-            return nullptr;
+            // Disconnect handlers may delete sessions, so slow consumers are dropped after the loop
+            for (int i = 0; i < Slow.Count(); ++i) {
+                pConnection = (CHTTPServerConnection *) Slow.Items(i);
+                pConnection->ClearOutputQueue();
+                pConnection->Disconnect();
+            }
+
+            return Result;
         }
     }
 }